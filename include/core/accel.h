@@ -7,42 +7,77 @@
 #pragma once
 
 #include <objects/mesh.h>
+#include <objects/instance.h>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
- * The current implementation falls back to a brute force loop
- * through the geometry.
+ * This is the interface shared by all acceleration data structures. The
+ * scene description selects one with an \c accel element, e.g.
+ * <tt>&lt;accel type="bvh"/&gt;</tt> (\ref BVH, the default) or
+ * <tt>&lt;accel type="kdtree"/&gt;</tt> (\ref KDTree). Scenes without
+ * an \c accel element create a \c "bvh" from their own properties.
+ *
+ * The batched queries (\ref rayIntersectPacket(), \ref rayIntersectStream()
+ * and \ref occludedStream()) default to tracing one ray after the other,
+ * implementations may override them with faster variants.
  */
-class Accel {
+class Accel : public NoriObject {
 public:
+    /// Release all memory
+    virtual ~Accel() { }
+
     /**
      * \brief Register a triangle mesh for inclusion in the acceleration
      * data structure
      *
      * This function can only be used before \ref build() is called
      */
-    void addMesh(Mesh *mesh);
+    virtual void addMesh(const Mesh *mesh) {
+        m_meshes.push_back(mesh);
+        m_bbox.expandBy(mesh->getBoundingBox());
+    }
+
+    /**
+     * \brief Register an instance of a mesh
+     *
+     * The referenced mesh is stored only once, regardless of the number
+     * of instances. This function can only be used before \ref build()
+     * is called
+     */
+    virtual void addInstance(const Instance *instance) {
+        m_instances.push_back(instance);
+        m_bbox.expandBy(instance->getBoundingBox());
+    }
+
+    /// Build the acceleration data structure
+    virtual void build() = 0;
 
-    /// Build the acceleration data structure (currently a no-op)
-    void build();
+    /**
+     * \brief Update the acceleration data structure after the vertex
+     * positions of the registered meshes have changed
+     *
+     * The number of triangles of the meshes must not change.
+     */
+    virtual void update() = 0;
 
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
     /**
      * \brief Intersect a ray against all triangles stored in the scene and
-     * return detailed intersection information
+     * return the closest intersection
      *
      * \param ray
      *    A 3-dimensional ray data structure with minimum/maximum extent
      *    information
      *
      * \param its
-     *    A detailed intersection record, which will be filled by the
-     *    intersection query
+     *    A compact intersection record, which will be filled by the
+     *    intersection query. Surface attributes can be computed from
+     *    it on demand using \ref SurfaceInteraction.
      *
      * \param shadowRay
      *    \c true if this is a shadow ray query, i.e. a query that only aims to
@@ -51,30 +86,111 @@ public:
      *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+    virtual bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const = 0;
 
-private:
-    struct TriInfo {
-        uint32_t f;
-        Mesh *mesh;
+    /**
+     * \brief Check whether a ray segment is blocked by any triangle
+     *
+     * \return \c true if an intersection was found
+     */
+    virtual bool occluded(const Ray3f &ray) const = 0;
 
-        TriInfo(uint32_t f, Mesh *mesh) : 
-            f(f), mesh(mesh) {}
-    };
+    /// Largest number of rays traced together by \ref rayIntersectPacket()
+    static const uint32_t MaxPacketSize = 16;
+
+    /**
+     * \brief Intersect a packet of coherent rays against all triangles stored
+     * in the scene and return the closest intersection of every ray
+     *
+     * \param rays
+     *    Array of \c count rays (at most \ref MaxPacketSize)
+     *
+     * \param its
+     *    Array of \c count intersection records, which will be filled
+     *    like the record passed to \ref rayIntersect()
+     *
+     * \return A bit mask of the rays for which an intersection was found
+     */
+    virtual uint32_t rayIntersectPacket(const Ray3f *rays, Intersection *its, uint32_t count) const {
+        if (count > MaxPacketSize)
+            throw NoriException("Accel: packets hold at most %i rays!", (int) MaxPacketSize);
+        uint32_t hits = 0;
+        for (uint32_t r = 0; r < count; ++r) {
+            if (rayIntersect(rays[r], its[r], false))
+                hits |= 1u << r;
+        }
+        return hits;
+    }
+
+    /**
+     * \brief Intersect a stream of rays against all triangles stored in the
+     * scene and return the closest intersection of every ray
+     *
+     * \param rays
+     *    Array of \c count rays
+     *
+     * \param its
+     *    Array of \c count intersection records, which will be filled
+     *    like the record passed to \ref rayIntersect()
+     *
+     * \param hits
+     *    Array of \c count flags, which will be set for the rays that
+     *    intersect the scene
+     */
+    virtual void rayIntersectStream(const Ray3f *rays, Intersection *its, bool *hits, size_t count) const {
+        for (size_t r = 0; r < count; ++r)
+            hits[r] = rayIntersect(rays[r], its[r], false);
+    }
+
+    /**
+     * \brief Check a stream of ray segments for occlusion
+     *
+     * \param occluded
+     *    Array of \c count flags, which will be set for the blocked rays
+     */
+    virtual void occludedStream(const Ray3f *rays, bool *occluded, size_t count) const {
+        for (size_t r = 0; r < count; ++r)
+            occluded[r] = this->occluded(rays[r]);
+    }
 
-    struct BvhNode { 
-        BoundingBox3f bbox;
-        BvhNode *lchild = nullptr;
-        BvhNode *rchild = nullptr;
-        std::vector<TriInfo> tri_list;
+    /**
+     * \brief Counters of the work done by the ray queries
+     *
+     * The counters are only maintained if Nori is compiled with
+     * \c NORI_TRAVERSAL_STATS (otherwise they remain zero and cost nothing).
+     * Every thread has its own counters, which accumulate over all queries
+     * issued by the thread, including those of the bottom-level BVHs.
+     */
+    struct alignas(64) TraversalStatistics {
+        uint64_t rays = 0;              ///< Number of traced rays
+        uint64_t nodes = 0;             ///< Number of visited interior nodes
+        uint64_t boxTests = 0;          ///< Number of ray-box tests
+        uint64_t triangleTests = 0;     ///< Number of ray-triangle tests (lanes of the leaf kernel)
     };
 
-    BvhNode *buildBvhTree(std::vector<TriInfo> &tris, uint32_t begin, uint32_t end);
-    void traverseBvhTree(Ray3f &ray, Intersection &its, bool &intersected, BvhNode *node, bool shadowRay) const;
+    /// Return the traversal counters of the calling thread
+    static TraversalStatistics &getThreadStatistics();
+
+    /// Print the traversal counters of every thread that traced rays, and their sum
+    static void printTraversalStatistics();
 
-    std::vector<Mesh *> m_meshes;   ///< Meshes
-    BvhNode      *m_bvhTree;        ///< Tree of bounding volume hierarchies
+    /**
+     * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
+     * provided by this instance
+     * */
+    EClassType getClassType() const { return EAccel; }
+
+protected:
+    std::vector<const Mesh *> m_meshes; ///< Meshes
+    std::vector<const Instance *> m_instances; ///< Registered instances
     BoundingBox3f m_bbox;           ///< Bounding box of the entire scene
 };
 
+/// Increment a counter of \ref Accel::TraversalStatistics (if enabled at compile time)
+#if defined(NORI_TRAVERSAL_STATS)
+#define NORI_TRAVERSAL_COUNT(counter, n) (Accel::getThreadStatistics().counter += (n))
+#else
+#define NORI_TRAVERSAL_COUNT(counter, n) ((void) 0)
+#endif
+
 NORI_NAMESPACE_END
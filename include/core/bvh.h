@@ -0,0 +1,523 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <core/accel.h>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy over the triangles of all registered meshes
+ *
+ * This is the default acceleration data structure (\c "bvh"). It can be
+ * built either by splitting at the median centroid or using a binned
+ * surface area heuristic (SAH). The following properties control the build
+ * (they are taken from the enclosing scene unless an \c accel element is
+ * specified):
+ *
+ * - \c bvhBuilder: \c "sah" (default), \c "sbvh", \c "lbvh" or \c "median"
+ * - \c sahBins: number of bins per axis used by the SAH builder (16)
+ * - \c traversalCost: relative cost of traversing an interior node (1)
+ * - \c intersectionCost: relative cost of a ray-triangle test (1)
+ * - \c maxLeafSize: maximum number of triangles per SAH leaf (8)
+ * - \c bvhWidth: branching factor of the traversed tree (2, 4 or 8; default 4)
+ * - \c compressNodes: store the wide tree with quantized bounds (false)
+ * - \c nodeLayout: order of the wide tree nodes in memory, \c "depthfirst"
+ *   (default), \c "breadthfirst" or \c "treelet"
+ * - \c layoutTopSize: number of bytes of the top of the tree that the
+ *   \c "breadthfirst" layout stores in breadth-first order (65536)
+ * - \c layoutPageSize: number of bytes filled by one treelet of the
+ *   \c "treelet" layout (4096)
+ * - \c spatialSplitAlpha: relative overlap of the children of an object
+ *   split beyond which the \c "sbvh" builder also tries spatial splits (1e-5)
+ * - \c duplicationBudget: number of triangle references the \c "sbvh"
+ *   builder may add, relative to the number of triangles (0.3)
+ * - \c treeletPasses: number of treelet optimization passes applied to
+ *   the tree produced by the \c "lbvh" builder (0)
+ * - \c bvhCache: directory of the on-disk BVH cache (disabled if empty)
+ * - \c bvhStatistics: print a report on the quality and footprint of the
+ *   tree after the build, with one section per bottom-level BVH (false)
+ * - \c bvhStatisticsFile: also write the report to this JSON file
+ * - \c rebuildThreshold: relative SAH cost increase after which \ref update()
+ *   rebuilds a tree instead of refitting it (1.5)
+ *
+ * Wider trees are obtained by collapsing the binary tree. Their nodes store
+ * the bounds of all children in SoA form, so that a single SSE/AVX slab
+ * test covers all children of a node. A width of 2 traverses the binary
+ * tree with scalar code.
+ *
+ * When memory is tight, the wide tree can be stored in a compressed form
+ * whose child bounds are quantized to 8 bits relative to the bounds of
+ * their parent, which roughly halves the size of a node. The binary tree
+ * is released in this case, hence \ref update() always rebuilds.
+ *
+ * The triangles referenced by the leaves are copied into packed groups of
+ * \ref TriGroupSize (vertex and two edges in SoA form), which are
+ * intersected with a single SIMD kernel per group.
+ *
+ * The \c "sbvh" builder extends the SAH builder by spatial splits, which
+ * clip the triangles straddling a split plane and reference them from
+ * both children. This separates large overlapping triangles at the cost
+ * of duplicated references. The traversal is unaffected.
+ *
+ * The \c "lbvh" builder trades tree quality for build speed: it sorts the
+ * triangles along a Morton curve and emits all nodes of the hierarchy
+ * independently (Karras 2012), optionally followed by a few passes that
+ * reorganize small treelets to minimize their SAH cost (Karras and Aila 2013).
+ *
+ * Mesh instances are handled by a second level: every instanced mesh gets
+ * its own bottom-level BVH (built concurrently with the same parameters),
+ * and a top-level BVH over the world-space bounds of all instances selects
+ * the instances whose bottom-level BVH is traversed in object space.
+ *
+ * The nodes of the wide tree are stored in one array, in depth-first order
+ * by default. When the tree is much larger than the caches, the other node
+ * layouts reduce cache and TLB misses: \c "breadthfirst" stores the top
+ * levels of the tree (64 KiB) in breadth-first order, followed by the
+ * subtrees below them in depth-first order, and \c "treelet" cuts the tree
+ * into page-sized treelets of the nodes that are most likely to be visited
+ * together, grown greedily by surface area, and stores every treelet
+ * right before the treelets below it (similar to a cache-oblivious van Emde
+ * Boas layout). The binary tree is always stored in depth-first order.
+ *
+ * The statistics report describes the traversed tree: its node and leaf
+ * counts, leaf depths, a histogram of the leaf sizes, its SAH cost, the
+ * overlap ratio (surface area shared by pairs of sibling boxes relative to
+ * the total surface area of all child boxes), the memory used by the nodes
+ * and triangle references, and the durations of the build phases.
+ *
+ * Built trees can be cached on disk. The cache file of a tree is named
+ * after a hash of the triangle meshes and of all build parameters, and
+ * stores the (index-based, hence relocatable) node arrays along with the
+ * ordering of the triangles. Later runs map the file into memory instead
+ * of building the tree. Stale or corrupt files are detected and replaced.
+ *
+ * Coherent rays (e.g. the camera rays of a few neighboring pixels) can be
+ * traced together by \ref rayIntersectPacket(). The packet traverses the
+ * wide tree once for all of its rays, so that every node is fetched and
+ * decoded only once. The children of a node are tested exactly against the
+ * first active ray and conservatively against the whole packet, using
+ * interval arithmetic over the origins and directions of its rays.
+ *
+ * Large batches of incoherent rays are better served by \ref rayIntersectStream()
+ * and \ref occludedStream(), which sort the rays into coherent blocks and
+ * let every block traverse the tree together.
+ */
+class BVH : public Accel {
+public:
+    /// Create an empty acceleration data structure using the given build parameters
+    BVH(const PropertyList &propList = PropertyList());
+
+    /// Release all memory
+    virtual ~BVH();
+
+    /// Build the acceleration data structure
+    void build();
+
+    /**
+     * \brief Update the acceleration data structure after the vertex
+     * positions of the registered meshes have changed
+     *
+     * The topology of the tree is kept and only its bounds are recomputed
+     * bottom-up, which takes a single linear pass. Every tree whose SAH
+     * cost has grown by more than the \c rebuildThreshold factor since
+     * it was built is rebuilt from scratch instead. The number of
+     * triangles of the meshes must not change.
+     */
+    void update();
+
+    /**
+     * \brief Return the SAH cost of the built tree
+     *
+     * The cost is normalized by the surface area of the root node, i.e. it
+     * is the expected cost of tracing a ray that hits the scene bounds
+     * in units of the configured traversal and intersection costs.
+     */
+    float getSAHCost() const { return m_sahCost; }
+
+    /// Intersect a ray against all triangles stored in the scene (see \ref Accel::rayIntersect())
+    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+
+    /**
+     * \brief Check whether a ray segment is blocked by any triangle
+     *
+     * This query has its own traversal that stops at the first intersection
+     * found anywhere in the tree, without ordering the children by distance
+     * or recording any information about the hit. \ref rayIntersect()
+     * forwards shadow ray queries to this function.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool occluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Intersect a packet of coherent rays against all triangles stored
+     * in the scene and return the closest intersection of every ray
+     *
+     * The rays share a traversal stack, whose entries carry a mask of the
+     * rays that may intersect the respective subtree. Subtrees that are
+     * left with fewer than \ref PacketSplitThreshold rays are traversed by
+     * each of them individually, and so are the instances. The results
+     * match those of \ref rayIntersect(). Trees with a branching factor
+     * of 2 are always traversed by single rays.
+     *
+     * \param rays
+     *    Array of \c count rays (at most \ref MaxPacketSize)
+     *
+     * \param its
+     *    Array of \c count intersection records, which will be filled
+     *    like the record passed to \ref rayIntersect()
+     *
+     * \return A bit mask of the rays for which an intersection was found
+     */
+    uint32_t rayIntersectPacket(const Ray3f *rays, Intersection *its, uint32_t count) const;
+
+    /**
+     * \brief Intersect a stream of rays against all triangles stored in the
+     * scene and return the closest intersection of every ray
+     *
+     * Meant for large batches of incoherent rays, e.g. the bounce rays of
+     * all pixels of an image block. The rays are sorted by the octant of
+     * their direction and a coarse grid cell of their origin and cut into
+     * blocks of \ref StreamBlockSize rays. Every block traverses the wide
+     * tree as a whole: a node is fetched once per block and distributes the
+     * rays that intersect its children among them. Subtrees that are left
+     * with fewer than \ref StreamSplitThreshold rays are traversed by each
+     * of them individually, and so are the instances. Blocks are traced in
+     * parallel. The results match those of \ref rayIntersect().
+     *
+     * \param rays
+     *    Array of \c count rays
+     *
+     * \param its
+     *    Array of \c count intersection records, which will be filled
+     *    like the record passed to \ref rayIntersect()
+     *
+     * \param hits
+     *    Array of \c count flags, which will be set for the rays that
+     *    intersect the scene
+     */
+    void rayIntersectStream(const Ray3f *rays, Intersection *its, bool *hits, size_t count) const;
+
+    /**
+     * \brief Check a stream of ray segments for occlusion
+     *
+     * Traces the rays like \ref rayIntersectStream(), but retires each ray
+     * at its first intersection. This is the batched variant of \ref occluded()
+     * for e.g. the shadow rays of all pixels of an image block.
+     *
+     * \param occluded
+     *    Array of \c count flags, which will be set for the blocked rays
+     */
+    void occludedStream(const Ray3f *rays, bool *occluded, size_t count) const;
+
+    /// Return a brief string summary of the build parameters
+    std::string toString() const;
+
+private:
+    /// Maximum number of entries on the traversal stack
+    static const int TraversalStackSize = 128;
+
+    /// Depth beyond which the SAH builder falls back to median splits (at most 32 more levels)
+    static const int MaxSAHDepth = TraversalStackSize - 32;
+
+    /// Number of active rays below which a packet is split into single rays
+    static const int PacketSplitThreshold = 4;
+
+    /// Number of rays that traverse the tree together in \ref rayIntersectStream()
+    static const uint32_t StreamBlockSize = 1024;
+
+    /// Number of rays below which a stream is split into single rays
+    static const uint32_t StreamSplitThreshold = 8;
+
+    /// Number of triangles that are intersected at once by the leaf kernel
+    static const uint32_t TriGroupSize = 4;
+
+    /// Splitting strategies supported by \ref build()
+    enum EBuilder {
+        EMedianBuilder = 0,
+        ESAHBuilder,
+        ESBVHBuilder,
+        ELBVHBuilder
+    };
+
+    /// Memory layouts of the wide tree nodes
+    enum ENodeLayout {
+        EDepthFirstLayout = 0,
+        EBreadthFirstLayout,
+        ETreeletLayout
+    };
+
+    /// Per-triangle information that is only needed during the build
+    struct TriInfo {
+        uint32_t index;         ///< Global triangle index
+        BoundingBox3f bbox;     ///< Bounds of the triangle
+        Point3f centroid;       ///< Centroid of the triangle
+
+        TriInfo() : index(0) { }
+
+        TriInfo(uint32_t index, const Mesh *mesh, uint32_t f) :
+            index(index), bbox(mesh->getBoundingBox(f)),
+            centroid(mesh->getCentroid(f)) {}
+    };
+
+    /**
+     * \brief Temporary node of the tree produced by the builders
+     *
+     * Leaves reference a range of the reordered \ref TriInfo array. The
+     * tree is converted into the linear \ref BvhNode layout and released
+     * at the end of \ref build().
+     */
+    struct BuildNode {
+        BoundingBox3f bbox;
+        BuildNode *lchild = nullptr;
+        BuildNode *rchild = nullptr;
+        uint32_t offset = 0;
+        uint32_t count = 0;
+        int axis = 0;
+        float cost = 0.f;           ///< SAH cost of the subtree (only used by the \c "lbvh" builder)
+    };
+
+    /**
+     * \brief Node of the flattened tree (32 bytes)
+     *
+     * Nodes are stored in depth-first order, hence the left child of an
+     * interior node immediately follows its parent. Leaves reference a
+     * range of \ref m_primIndices that starts at a multiple of
+     * \ref TriGroupSize, so that it maps onto whole triangle groups.
+     */
+    struct BvhNode {
+        BoundingBox3f bbox;
+        union {
+            uint32_t primOffset;    ///< Leaf: first entry in \ref m_primIndices
+            uint32_t rightChild;    ///< Interior: index of the right child
+        };
+        uint16_t primCount;         ///< Number of triangles (0 for interior nodes)
+        uint8_t axis;               ///< Split axis of interior nodes
+        uint8_t pad;
+
+        bool isLeaf() const { return primCount > 0; }
+    };
+
+    /**
+     * \brief Node of a collapsed tree with up to \c Width children
+     *
+     * The child bounds are stored as [min/max][axis][child] so that
+     * they can be loaded straight into SIMD registers. Unused slots
+     * have empty bounds, which never intersect a ray.
+     */
+    template <int Width> struct alignas(4 * Width) WideBvhNode {
+        static const int ChildCount = Width;
+        typedef float Bounds[2][3][Width];
+
+        Bounds bounds;              ///< Child bounds ([min/max][axis][child])
+        uint32_t child[Width];      ///< Interior child: node index, leaf child: first entry in \ref m_primIndices
+        uint16_t primCount[Width];  ///< Number of triangles of leaf children (0 otherwise)
+
+        /// Return the child bounds
+        const Bounds &getBounds(Bounds &) const { return bounds; }
+    };
+
+    /**
+     * \brief Compressed node of a collapsed tree with up to \c Width children
+     *
+     * The child bounds are quantized to 8 bits on a grid that starts at the
+     * minimum of the node bounds. Its spacing along every axis is a power
+     * of two, so that decoding is exact. Minima are rounded down and maxima
+     * up, hence the decoded boxes always contain the original ones. Unused
+     * slots have inverted bounds (255 / 0), which never intersect a ray.
+     */
+    template <int Width> struct alignas(16) QuantizedBvhNode {
+        static const int ChildCount = Width;
+        typedef float Bounds[2][3][Width];
+
+        float origin[3];            ///< Minimum of the node bounds
+        int8_t exponent[3];         ///< Grid spacing along each axis (base 2 logarithm)
+        uint8_t pad;
+        uint8_t bounds[2][3][Width]; ///< Quantized child bounds ([min/max][axis][child])
+        uint32_t child[Width];      ///< Interior child: node index, leaf child: first entry in \ref m_primIndices
+        uint16_t primCount[Width];  ///< Number of triangles of leaf children (0 otherwise)
+
+        /// Decode the child bounds into \c storage and return it
+        const Bounds &getBounds(Bounds &storage) const;
+    };
+
+    /// Instance as seen by the top-level traversal
+    struct InstanceRecord {
+        const BVH *accel;           ///< Bottom-level BVH of the referenced mesh
+        const Transform *toWorld;   ///< Object-to-world transform (owned by the \ref Instance)
+        Transform toLocal;          ///< World-to-object transform
+    };
+
+    /**
+     * \brief Packed group of \ref TriGroupSize triangles
+     *
+     * Stores the first vertex and the two edges adjacent to it as
+     * [axis][lane], along with the mesh and triangle index needed to
+     * finalize a hit. Unused lanes have zero edges, which never produce
+     * an intersection.
+     */
+    struct alignas(16) TriangleGroup {
+        float p0[3][TriGroupSize];          ///< First vertex
+        float e1[3][TriGroupSize];          ///< Edge from the first to the second vertex
+        float e2[3][TriGroupSize];          ///< Edge from the first to the third vertex
+        uint32_t meshIdx[TriGroupSize];     ///< Index of the mesh ((uint32_t) -1 for unused lanes)
+        uint32_t triIdx[TriGroupSize];      ///< Local index of the triangle in its mesh
+    };
+
+    void buildBvh();
+    bool refitBvh();
+    BoundingBox3f refitBvhTree(uint32_t nodeIdx);
+    size_t getMemoryUsage() const;
+    bool traverse(Ray3f &ray, Intersection &its) const;
+    bool occludedMeshes(const Ray3f &ray) const;
+    BuildNode *buildBvhTree(std::vector<TriInfo> &tris, uint32_t begin, uint32_t end);
+    BuildNode *buildSAHTree(std::vector<TriInfo> &tris, uint32_t begin, uint32_t end, int depth);
+    float findSAHSplit(const std::vector<TriInfo> &tris, uint32_t begin, uint32_t end,
+                       const BoundingBox3f &bbox, const BoundingBox3f &centroidBox,
+                       int &bestAxis, int &bestSplit) const;
+    int binIndex(const Point3f &p, const BoundingBox3f &centroidBox, int axis) const;
+    BuildNode *makeLeaf(uint32_t begin, uint32_t end, const BoundingBox3f &bbox);
+    uint32_t flattenBvhTree(const BuildNode *node, const std::vector<TriInfo> &tris);
+    void releaseBvhTree(BuildNode *node);
+    float computeSAHCost() const;
+    bool traverseBvhTree(Ray3f &ray, Intersection &its) const;
+    bool occludedBvhTree(const Ray3f &ray) const;
+
+    /**
+     * \brief Branchless slab test of a ray segment against a bounding box
+     *
+     * The near and far plane of every slab are selected using the sign of the
+     * ray direction. Slabs that are parallel to the ray and contain its origin
+     * produce NaNs, which are ignored by the comparisons below.
+     *
+     * \param nearT
+     *    Upon success, the distance at which the ray enters the box
+     */
+    static bool intersectSlabs(const BoundingBox3f &bbox, const Ray3f &ray,
+                               const int dirIsNeg[3], float &nearT) {
+        float tNear = ray.mint, tFar = ray.maxt;
+        for (int i = 0; i < 3; ++i) {
+            float t0 = ((dirIsNeg[i] ? bbox.max[i] : bbox.min[i]) - ray.o[i]) * ray.dRcp[i];
+            float t1 = ((dirIsNeg[i] ? bbox.min[i] : bbox.max[i]) - ray.o[i]) * ray.dRcp[i];
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        nearT = tNear;
+        return tNear <= tFar;
+    }
+
+    /* Statistics report (see accel_stats.cpp) */
+    struct BvhStatistics;
+    void computeStatistics(BvhStatistics &stats) const;
+    template <typename Node> void gatherStatistics(const std::vector<Node> &nodes, BvhStatistics &stats) const;
+    void reportStatistics() const;
+
+    /* On-disk BVH cache (see accel_cache.cpp) */
+    bool buildOrLoadBvh();
+    uint64_t hashBuildInput() const;
+    bool loadBvh(const std::string &filename, uint64_t hash);
+    void saveBvh(const std::string &filename, uint64_t hash) const;
+
+    /* Spatial split BVH builder (see accel_sbvh.cpp) */
+    struct SBVHContext;
+    BuildNode *buildSBVH(std::vector<TriInfo> &tris);
+    BuildNode *buildSBVHTree(SBVHContext &ctx, std::vector<TriInfo> &refs, int depth);
+    float findSpatialSplit(const std::vector<TriInfo> &refs, const BoundingBox3f &bbox,
+                           int &bestAxis, float &bestPos, uint32_t &duplicates) const;
+    void splitReference(const TriInfo &ref, int axis, float pos, TriInfo &left, TriInfo &right) const;
+
+    /* Linear BVH builder (see accel_lbvh.cpp) */
+    BuildNode *buildLBVH(std::vector<TriInfo> &tris);
+    void optimizeTreelets(BuildNode *node);
+    void collapseLBVH(BuildNode *node, const std::vector<TriInfo> &tris, std::vector<TriInfo> &refs);
+    void gatherLeafRefs(const BuildNode *node, const std::vector<TriInfo> &tris, std::vector<TriInfo> &refs);
+
+    /* Node layouts (see accel_layout.cpp) */
+    template <int Width> void reorderWideBvh(std::vector<WideBvhNode<Width>> &nodes, size_t nodeSize) const;
+
+    /* Ray streams (see accel_stream.cpp) */
+    void traceStream(const Ray3f *rays, Intersection *its, bool *hits, size_t count, bool shadowRays) const;
+
+    /* Packed leaf triangles (see accel_tri.cpp) */
+    void buildTriangleGroups();
+    bool intersectLeaf(uint32_t primOffset, uint32_t primCount, Ray3f &ray, Intersection &its) const;
+    bool occludedLeaf(uint32_t primOffset, uint32_t primCount, const Ray3f &ray) const;
+
+    /* Two-level hierarchy over instances (see accel_instance.cpp) */
+    void buildInstances();
+    uint32_t buildInstanceTree(std::vector<TriInfo> &infos, uint32_t begin, uint32_t end);
+    uint32_t refitInstances();
+    BoundingBox3f refitInstanceTree(uint32_t nodeIdx);
+    bool traverseInstances(Ray3f &ray, Intersection &its) const;
+    bool occludedInstances(const Ray3f &ray) const;
+
+    /* Wide trees (see accel_wide.cpp) */
+    void buildWideBvh();
+    bool traverseWideBvh(Ray3f &ray, Intersection &its) const;
+    bool occludedWideBvh(const Ray3f &ray) const;
+    template <int Width> uint32_t collapseBvhNode(std::vector<WideBvhNode<Width>> &nodes, uint32_t nodeIdx) const;
+    template <int Width> void quantizeWideBvh(const std::vector<WideBvhNode<Width>> &nodes,
+                                              std::vector<QuantizedBvhNode<Width>> &qnodes) const;
+    template <typename Node> bool traverseWideBvh(const std::vector<Node> &nodes,
+                                                  Ray3f &ray, Intersection &its, uint32_t root = 0) const;
+    template <typename Node> bool occludedWideBvh(const std::vector<Node> &nodes,
+                                                  const Ray3f &ray, uint32_t root = 0) const;
+    uint32_t traversePacket(Ray3f *rays, Intersection *its, uint32_t count) const;
+    template <typename Node> uint32_t traversePacket(const std::vector<Node> &nodes,
+                                                     Ray3f *rays, Intersection *its, uint32_t count) const;
+    void traverseStream(Ray3f *rays, Intersection *its, bool *hits, uint32_t count, bool shadowRays) const;
+    template <bool ShadowRays, typename Node> void traverseStream(const std::vector<Node> &nodes, Ray3f *rays,
+                                                                  Intersection *its, bool *hits, uint32_t count) const;
+
+    /// Map a global triangle index to the index of its mesh and the local triangle index
+    uint32_t findMesh(uint32_t &idx) const {
+        auto it = std::upper_bound(m_meshOffset.begin(), m_meshOffset.end(), idx);
+        uint32_t meshIdx = (uint32_t) (it - m_meshOffset.begin() - 1);
+        idx -= m_meshOffset[meshIdx];
+        return meshIdx;
+    }
+
+    std::vector<uint32_t> m_meshOffset; ///< Global index of the first triangle of each mesh
+    std::vector<BvhNode> m_nodes;   ///< Flattened tree of bounding volume hierarchies
+    std::vector<uint32_t> m_primIndices; ///< Global triangle indices referenced by the leaves ((uint32_t) -1 for padding)
+    std::vector<TriangleGroup> m_triGroups; ///< Packed triangles, one group per \ref TriGroupSize entries of \ref m_primIndices
+    std::vector<WideBvhNode<4>> m_bvh4; ///< Collapsed 4-wide tree (if \ref m_bvhWidth == 4)
+    std::vector<WideBvhNode<8>> m_bvh8; ///< Collapsed 8-wide tree (if \ref m_bvhWidth == 8)
+    std::vector<QuantizedBvhNode<4>> m_qbvh4; ///< Compressed 4-wide tree (replaces \ref m_bvh4 if \ref m_compressNodes is set)
+    std::vector<QuantizedBvhNode<8>> m_qbvh8; ///< Compressed 8-wide tree (replaces \ref m_bvh8 if \ref m_compressNodes is set)
+    std::vector<std::unique_ptr<BVH>> m_blas; ///< Bottom-level BVHs of the instanced meshes
+    std::vector<InstanceRecord> m_instanceRecords; ///< Instances in the order referenced by \ref m_topNodes
+    std::vector<BvhNode> m_topNodes; ///< Top-level tree over the instances
+
+    PropertyList m_propList;        ///< Build parameters (reused for the bottom-level BVHs)
+    std::string m_cacheDir;         ///< Directory of the on-disk BVH cache (disabled if empty)
+    std::string m_statisticsFile;   ///< JSON file that receives the statistics report (disabled if empty)
+    std::vector<std::pair<const char *, double>> m_buildPhases; ///< Names and durations (ms) of the phases of the last build
+
+    EBuilder m_builder;             ///< Splitting strategy
+    int      m_sahBins;             ///< Number of SAH bins per axis
+    float    m_traversalCost;       ///< SAH cost of traversing an interior node
+    float    m_intersectionCost;    ///< SAH cost of a ray-triangle test
+    uint32_t m_maxLeafSize;         ///< Largest leaf the SAH builder may create
+    int      m_bvhWidth;            ///< Branching factor of the traversed tree
+    bool     m_compressNodes;       ///< Store the wide tree with quantized bounds
+    ENodeLayout m_nodeLayout;       ///< Memory layout of the wide tree nodes
+    size_t   m_layoutTopSize;       ///< Bytes of the tree top stored breadth-first
+    size_t   m_layoutPageSize;      ///< Bytes filled by one treelet of the treelet layout
+    float    m_spatialSplitAlpha;   ///< Relative child overlap that triggers a spatial split search
+    float    m_duplicationBudget;   ///< Relative number of references the SBVH builder may add
+    int      m_treeletPasses;       ///< Number of treelet optimization passes of the LBVH builder
+    uint32_t m_duplicatedRefs = 0;  ///< Number of references added by spatial splits
+    float    m_rebuildThreshold;    ///< SAH cost increase that triggers a rebuild in \ref update()
+    bool     m_printStatistics;     ///< Print a statistics report after the build
+    float    m_sahCost = 0.f;       ///< SAH cost of the current tree
+    float    m_builtSAHCost = 0.f;  ///< SAH cost of the tree right after it was last built
+};
+
+NORI_NAMESPACE_END
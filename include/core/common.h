@@ -112,6 +112,7 @@ class BlockGenerator;
 class Camera;
 class ImageBlock;
 class Integrator;
+struct Intersection;
 class Emitter;
 class Mesh;
 class NoriObject;
@@ -130,6 +131,7 @@ using std::endl;
 
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
+typedef Eigen::Matrix<uint32_t, 3, 1>                           Vector3u;
 
 /// Simple exception class, which stores a human-readable error description
 class NoriException : public std::runtime_error {
@@ -172,9 +174,20 @@ extern bool endsWith(const std::string &value, const std::string &ending);
 /// Convert a time value in milliseconds into a human-readable string
 extern std::string timeString(double time, bool precise = false);
 
+/// Return the CPU time (user and system, summed over all threads) used by the process in milliseconds
+extern double getProcessCPUTime();
+
 /// Convert a memory amount in bytes into a human-readable string
 extern std::string memString(size_t size, bool precise = false);
 
+/// Compute a 64-bit hash of a block of memory (large blocks are hashed in parallel)
+extern uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
+
+/// Compute a 64-bit hash of a single value
+template <typename T> uint64_t hashValue(const T &value, uint64_t seed = 0) {
+    return hashBytes(&value, sizeof(T), seed);
+}
+
 /// Measures associated with probability distributions
 enum EMeasure {
     EUnknownMeasure = 0,
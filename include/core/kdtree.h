@@ -0,0 +1,111 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <core/accel.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief SAH kd-tree over the triangles of all registered meshes
+ *
+ * Alternative acceleration data structure (\c "kdtree"). Every interior
+ * node splits space by an axis-aligned plane, and triangles that straddle
+ * the plane are referenced by both children. The split planes are placed
+ * at the bounding box edges of the triangles that minimize the surface
+ * area heuristic, which is evaluated exactly by sweeping over the sorted
+ * edges along all three axes. Subtrees are built in parallel. Traversal
+ * visits the leaves along the ray from front to back and stops at the
+ * first leaf that contains an intersection within its extent.
+ *
+ * The following properties control the build:
+ *
+ * - \c traversalCost: relative cost of traversing an interior node (1)
+ * - \c intersectionCost: relative cost of a ray-triangle test (80)
+ * - \c emptyBonus: relative cost reduction of splits that cut off empty space (0.5)
+ * - \c maxLeafSize: largest number of triangles stored without trying to split (1)
+ * - \c maxDepth: maximum depth of the tree (8 + 1.3 log2(triangle count), at most 64)
+ *
+ * Mesh instances are not supported, and \ref update() rebuilds the tree.
+ */
+class KDTree : public Accel {
+public:
+    /// Create an empty kd-tree using the given build parameters
+    KDTree(const PropertyList &propList);
+
+    /// Instances are not supported by the kd-tree (throws an exception)
+    void addInstance(const Instance *instance);
+
+    /// Build the kd-tree
+    void build();
+
+    /// Rebuild the kd-tree after the vertex positions of the meshes have changed
+    void update() { build(); }
+
+    /// Intersect a ray against all triangles stored in the scene (see \ref Accel::rayIntersect())
+    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+
+    /// Check whether a ray segment is blocked by any triangle
+    bool occluded(const Ray3f &ray) const;
+
+    /// Return a brief string summary of the build parameters
+    std::string toString() const;
+
+private:
+    /// Maximum depth of the tree, which bounds the size of the traversal stack
+    static const int MaxTreeDepth = 64;
+
+    /**
+     * \brief Node of the flattened tree (8 bytes)
+     *
+     * Nodes are stored in depth-first order, hence the child below the
+     * split plane immediately follows its parent. The two lowest bits of
+     * \c flags hold the split axis (3 for leaves), the remaining ones the
+     * index of the child above the split plane or the number of triangles
+     * of a leaf.
+     */
+    struct KDNode {
+        union {
+            float split;            ///< Interior: position of the split plane
+            uint32_t primOffset;    ///< Leaf: first entry in \ref m_triRefs
+        };
+        uint32_t flags;
+
+        bool isLeaf() const { return (flags & 3) == 3; }
+        int axis() const { return (int) (flags & 3); }
+        uint32_t aboveChild() const { return flags >> 2; }
+        uint32_t primCount() const { return flags >> 2; }
+    };
+
+    /// Triangle referenced by a leaf
+    struct TriangleRef {
+        uint32_t meshIdx;           ///< Index of the mesh
+        uint32_t triIdx;            ///< Local index of the triangle in its mesh
+    };
+
+    /// Subtree produced by \ref buildTree() (node and triangle indices are local)
+    struct Subtree {
+        std::vector<KDNode> nodes;
+        std::vector<uint32_t> prims;    ///< Global triangle indices referenced by the leaves
+    };
+
+    void buildTree(Subtree &tree, const std::vector<BoundingBox3f> &primBounds, const BoundingBox3f &bounds,
+                   std::vector<uint32_t> &prims, int depth, int badRefines) const;
+    template <bool ShadowRay> bool traverse(Ray3f &ray, Intersection *its) const;
+
+    std::vector<KDNode> m_nodes;        ///< Flattened tree
+    std::vector<TriangleRef> m_triRefs; ///< Triangles referenced by the leaves
+
+    float m_traversalCost;          ///< SAH cost of traversing an interior node
+    float m_intersectionCost;       ///< SAH cost of a ray-triangle test
+    float m_emptyBonus;             ///< Cost reduction of splits with an empty child
+    uint32_t m_maxLeafSize;         ///< Largest number of triangles stored without trying to split
+    int m_maxDepth;                 ///< Maximum depth (-1: derived from the triangle count)
+    int m_builtDepth = 0;           ///< Maximum depth used by the last build
+};
+
+NORI_NAMESPACE_END
@@ -26,18 +26,18 @@ struct BSDFQueryRecord {
     float eta;
 
     /// Reference to the underlying surface interaction
-    const Intersection &its;
+    const SurfaceInteraction &its;
 
     /// Measure associated with the sample
     EMeasure measure;
 
     /// Create a new record for sampling the BSDF
-    BSDFQueryRecord(const Vector3f &wi, const Intersection &its)
+    BSDFQueryRecord(const Vector3f &wi, const SurfaceInteraction &its)
         : wi(wi), eta(1.f), measure(EUnknownMeasure), its(its) { }
 
     /// Create a new record for querying the BSDF
     BSDFQueryRecord(const Vector3f &wi,
-            const Vector3f &wo, EMeasure measure, const Intersection &its)
+            const Vector3f &wo, EMeasure measure, const SurfaceInteraction &its)
         : wi(wi), wo(wo), eta(1.f), measure(measure), its(its) { }
 };
 
@@ -18,7 +18,7 @@ struct EmitterQueryRecord {
     /// Intersection point (emitted ray and mesh)
     Point3f p;
     /// Intersection info (emitted ray and mesh)
-    Intersection its;
+    SurfaceInteraction its;
     /// Direction from p to s (mesh local frame)
     Vector3f wo;
     /// Direction from s to p (emitter local frame)
@@ -28,8 +28,8 @@ struct EmitterQueryRecord {
     /// Measure associated with the sample
     EMeasure measure;
 
-    EmitterQueryRecord(const Intersection &its, const Mesh *mesh) 
-        : its(its), mesh(mesh), measure(EUnknownMeasure) { p = its.p; }
+    EmitterQueryRecord(const SurfaceInteraction &its, const Mesh *mesh) 
+        : its(its), mesh(mesh), measure(EUnknownMeasure) { p = its.getPosition(); }
 
     EmitterQueryRecord(const Point3f &p, const Mesh *mesh) 
         : p(p), mesh(mesh), measure(EUnknownMeasure) { }
@@ -0,0 +1,63 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <objects/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Placement of a shared mesh in the scene
+ *
+ * An instance references a mesh that was declared elsewhere in the scene
+ * (using its \c id attribute) and places another copy of it using the
+ * \c toWorld transform:
+ *
+ * \code
+ * <mesh type="obj" id="chair"> ... </mesh>
+ * <instance ref="chair">
+ *     <transform name="toWorld"> ... </transform>
+ * </instance>
+ * \endcode
+ *
+ * All instances of a mesh share a single bottom-level BVH, which is
+ * intersected in the object space of the instance. The declared mesh is
+ * rendered through an implicit identity instance of the same BVH, so that
+ * its geometry is not stored a second time in the top-level tree. Meshes
+ * with an attached emitter cannot be instanced.
+ */
+class Instance : public NoriObject {
+public:
+    /// Create an instance with the given \c toWorld transform
+    Instance(const PropertyList &propList);
+
+    /// Register the referenced mesh (called once by the XML parser)
+    virtual void addChild(NoriObject *child);
+
+    /// Check that a mesh was referenced
+    virtual void activate();
+
+    /// Return the referenced mesh
+    const Mesh *getMesh() const { return m_mesh; }
+
+    /// Return the object-to-world transform
+    const Transform &getTransform() const { return m_toWorld; }
+
+    /// Return an axis-aligned box that bounds the instance in world space
+    BoundingBox3f getBoundingBox() const;
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+    EClassType getClassType() const { return EInstance; }
+
+private:
+    Mesh     *m_mesh = nullptr;     ///< Referenced mesh
+    Transform m_toWorld;            ///< Object-to-world transform
+};
+
+NORI_NAMESPACE_END
@@ -6,7 +6,7 @@
 
 #pragma once
 
-#include <objects/object.h>
+#include <objects/mesh.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -41,6 +41,47 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a camera ray whose closest
+     * intersection is already known
+     *
+     * The renderer traces the camera rays of an image block in packets
+     * (see \ref Scene::rayIntersectPacket()) and continues each of them
+     * here. The default implementation discards the intersection and calls
+     * \ref Li(), integrators that start by intersecting \c ray should
+     * override it.
+     *
+     * \param its
+     *    The closest intersection along \c ray (only valid if \c hit is set)
+     * \param hit
+     *    Whether \c ray intersects the scene
+     */
+    virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                              const Intersection &its, bool hit) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /**
+     * \brief Sample the incident radiance along a batch of camera rays whose
+     * closest intersections are already known
+     *
+     * The renderer collects the camera rays of an image block and continues
+     * them here, so that integrators can trace their secondary rays together
+     * (see \ref Scene::occludedStream()). The default implementation calls
+     * \ref LiPrimary() for every ray.
+     *
+     * \param hits
+     *    Whether the rays intersect the scene
+     * \param values
+     *    Array of \c count radiance estimates (output)
+     */
+    virtual void LiPrimaryStream(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+                                 const Intersection *its, const bool *hits, Color3f *values,
+                                 size_t count) const {
+        for (size_t r = 0; r < count; ++r)
+            values[r] = LiPrimary(scene, sampler, rays[r], its[r], hits[r]);
+    }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
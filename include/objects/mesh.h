@@ -17,42 +17,95 @@ NORI_NAMESPACE_BEGIN
 /**
  * \brief Intersection data structure
  *
- * This data structure records local information about a ray-triangle intersection.
- * This includes the position, traveled ray distance, uv coordinates, as well
- * as well as two local coordinate frames (one that corresponds to the true
- * geometry, and one that is used for shading computations).
+ * This compact record is all that is produced by ray traversal: the mesh
+ * and triangle that were hit, the traveled ray distance and the barycentric
+ * coordinates of the hit. Surface attributes (position, texture coordinates,
+ * local frames) are computed on demand by \ref SurfaceInteraction. Hits on
+ * instanced meshes also record the transform of the instance, since the
+ * mesh data is stored in object space.
  */
 struct Intersection {
-    /// Position of the surface intersection
-    Point3f p;
     /// Unoccluded distance along the ray
     float t;
-    /// UV coordinates, if any
+    /// Barycentric coordinates of the hit with respect to the second and third vertex
     Point2f uv;
-    /// Shading frame (based on the shading normal)
-    Frame shFrame;
-    /// Geometric frame (based on the true geometry)
-    Frame geoFrame;
     /// Pointer to the associated mesh
     const Mesh *mesh;
     /// Triangle index of the closest intersection
     uint32_t f;
+    /// Object-to-world transform if the mesh was hit through an instance (\c nullptr otherwise)
+    const Transform *toWorld;
 
     /// Create an uninitialized intersection record
-    Intersection() : mesh(nullptr) { }
+    Intersection() : mesh(nullptr), toWorld(nullptr) { }
+
+    /// Return a human-readable summary of the intersection record
+    std::string toString() const;
+};
+
+/**
+ * \brief Surface attributes at a ray-triangle intersection
+ *
+ * Wraps an \ref Intersection record and computes the attributes of the
+ * surface at the hit only when they are requested for the first time, so
+ * that integrators only pay for what they actually use. Records without
+ * a mesh (e.g. those used by the BSDF tests) return a zero position and
+ * texture coordinates and frames aligned with the Z axis.
+ */
+class SurfaceInteraction {
+public:
+    /// Create a record that does not refer to any surface
+    SurfaceInteraction() { }
+
+    /// Create a record for the given intersection
+    explicit SurfaceInteraction(const Intersection &its) : m_its(its) { }
+
+    /// Return the underlying intersection record
+    const Intersection &getIntersection() const { return m_its; }
+
+    /// Return a pointer to the intersected mesh
+    const Mesh *getMesh() const { return m_its.mesh; }
+
+    /// Return the position of the intersection
+    const Point3f &getPosition() const;
+
+    /// Return the interpolated texture coordinates (zero if the mesh has none)
+    const Point2f &getTexCoords() const;
+
+    /// Return the frame of the true geometry
+    const Frame &getGeometricFrame() const;
+
+    /// Return the shading frame (based on the interpolated shading normal, if any)
+    const Frame &getShadingFrame() const;
 
     /// Transform a direction vector into the local shading frame
     Vector3f toLocal(const Vector3f &d) const {
-        return shFrame.toLocal(d);
+        return getShadingFrame().toLocal(d);
     }
 
     /// Transform a direction vector from local to world coordinates
     Vector3f toWorld(const Vector3f &d) const {
-        return shFrame.toWorld(d);
+        return getShadingFrame().toWorld(d);
     }
 
-    /// Return a human-readable summary of the intersection record
+    /// Return a human-readable summary of the surface interaction
     std::string toString() const;
+
+private:
+    /// Attributes that have already been computed
+    enum EAttribute {
+        EPosition       = 0x01,
+        ETexCoords      = 0x02,
+        EGeometricFrame = 0x04,
+        EShadingFrame   = 0x08
+    };
+
+    Intersection m_its;              ///< Compact hit record
+    mutable int m_valid = 0;         ///< Bit mask of the computed attributes
+    mutable Point3f m_p;             ///< Position
+    mutable Point2f m_uv;            ///< Texture coordinates
+    mutable Frame m_geoFrame;        ///< Geometric frame
+    mutable Frame m_shFrame;         ///< Shading frame
 };
 
 /**
@@ -62,6 +115,22 @@ struct Intersection {
  * for querying the individual triangles. Subclasses of \c Mesh implement
  * the specifics of how to create its contents (e.g. by loading from an
  * external file)
+ *
+ * Meshes can optionally be stored in a compact form once they have been
+ * loaded, which is selected by the following properties:
+ *
+ * - \c compact: store the normals octahedron-encoded in 2x16 bits and the
+ *   texture coordinates as half-precision floats (\c false)
+ * - \c compactIndices: store the vertex indices of every group of
+ *   \ref MeshletSize triangles as 16-bit offsets to the smallest index of
+ *   the group (same as \c compact). Meshes whose groups span more than
+ *   65536 vertices keep 32-bit indices.
+ *
+ * The vertex positions are always stored with full precision. The arrays
+ * that were replaced by compact versions are empty, and the attributes
+ * should be accessed through \ref getTriangleIndices(),
+ * \ref getVertexNormal() and \ref getVertexTexCoord(), which decode both
+ * representations.
  */
 class Mesh : public NoriObject {
 public:
@@ -72,7 +141,9 @@ public:
     virtual void activate();
 
     /// Return the total number of triangles in this shape
-    uint32_t getTriangleCount() const { return (uint32_t) m_F.cols(); }
+    uint32_t getTriangleCount() const {
+        return (uint32_t) (m_meshletBase.empty() ? (size_t) m_F.cols() : m_localF.size() / 3);
+    }
 
     /// Return the total number of vertices in this shape
     uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
@@ -119,15 +190,49 @@ public:
     /// Return a pointer to the vertex positions
     const MatrixXf &getVertexPositions() const { return m_V; }
 
-    /// Return a pointer to the vertex normals (or \c nullptr if there are none)
+    /**
+     * \brief Replace the vertex positions, e.g. to animate the mesh
+     *
+     * The number of vertices must not change. The vertex normals (if any)
+     * are not updated and should be replaced by the caller if the surface
+     * was rotated or deformed. Acceleration data structures containing the
+     * mesh must be updated afterwards (see \ref Accel::update()).
+     */
+    void setVertexPositions(const MatrixXf &V);
+
+    /// Return a pointer to the vertex normals (empty if there are none or they are stored in compact form)
     const MatrixXf &getVertexNormals() const { return m_N; }
 
-    /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
+    /// Return a pointer to the texture coordinates (empty if there are none or they are stored in compact form)
     const MatrixXf &getVertexTexCoords() const { return m_UV; }
 
-    /// Return a pointer to the triangle vertex index list
+    /// Return a pointer to the triangle vertex index list (empty if the indices are stored in compact form)
     const MatrixXu &getIndices() const { return m_F; }
 
+    /// Return the vertex indices of the given triangle
+    Vector3u getTriangleIndices(uint32_t index) const {
+        if (m_meshletBase.empty())
+            return m_F.col(index);
+        const uint16_t *local = &m_localF[3 * (size_t) index];
+        uint32_t base = m_meshletBase[index / MeshletSize];
+        return Vector3u(base + local[0], base + local[1], base + local[2]);
+    }
+
+    /// Does the mesh provide vertex normals?
+    bool hasVertexNormals() const { return m_N.size() > 0 || !m_octN.empty(); }
+
+    /// Does the mesh provide texture coordinates?
+    bool hasVertexTexCoords() const { return m_UV.size() > 0 || !m_halfUV.empty(); }
+
+    /// Return the normal of the given vertex (which must exist, see \ref hasVertexNormals())
+    Normal3f getVertexNormal(uint32_t index) const;
+
+    /// Return the texture coordinates of the given vertex (which must exist, see \ref hasVertexTexCoords())
+    Point2f getVertexTexCoord(uint32_t index) const;
+
+    /// Return the number of bytes used by the vertex and index arrays
+    size_t getStorageSize() const;
+
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
 
@@ -166,12 +271,42 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /**
+     * \brief Load the mesh arrays and bounding box from a binary mesh
+     * file (see nmesh.cpp)
+     *
+     * Throws a \ref NoriException if the file is damaged or, unless
+     * \c key is zero, was stored with a different key
+     */
+    void loadBinaryMesh(const std::string &filename, uint64_t key = 0);
+
+    /// Store the mesh arrays and bounding box in a binary mesh file
+    void saveBinaryMesh(const std::string &filename, uint64_t key) const;
+
+    /// Transform the vertex positions and normals (e.g. by \c toWorld after loading a binary mesh)
+    void applyTransform(const Transform &trafo);
+
+    /// Read the \c compact and \c compactIndices properties (called by the loaders)
+    void setStorageOptions(const PropertyList &propList);
+
+    /// Replace the normals, texture coordinates and indices by their compact versions
+    void compact();
+
 protected:
+    /// Number of consecutive triangles whose indices share a base index in compact form
+    static const uint32_t MeshletSize = 64;
+
     std::string   m_name;                ///< Identifying name
     MatrixXf      m_V;                   ///< Vertex positions
     MatrixXf      m_N;                   ///< Vertex normals
     MatrixXf      m_UV;                  ///< Vertex texture coordinates
     MatrixXu      m_F;                   ///< Faces
+    std::vector<uint32_t> m_octN;        ///< Octahedron-encoded vertex normals (compact form)
+    std::vector<uint16_t> m_halfUV;      ///< Half-precision texture coordinates (compact form)
+    std::vector<uint16_t> m_localF;      ///< Faces relative to their meshlet base (compact form)
+    std::vector<uint32_t> m_meshletBase; ///< Smallest vertex index of every meshlet (compact form)
+    bool          m_compact = false;     ///< Store normals and texture coordinates in compact form?
+    bool          m_compactIndices = false; ///< Store the indices in compact form?
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
     DiscretePDF   m_areaDP;              ///< Distribution of surface area
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
@@ -32,6 +32,8 @@ public:
         ETexture,
         EReconstructionFilter,
         ETextureFilter,
+        EInstance,
+        EAccel,
         EClassTypeCount
     };
 
@@ -89,6 +91,8 @@ public:
             case ESampler:    return "sampler";
             case ETest:       return "test";
             case ETexture:    return "texture";
+            case EInstance:   return "instance";
+            case EAccel:      return "accel";
             default:          return "<unknown>";
         }
     }
@@ -7,7 +7,9 @@
 #pragma once
 
 #include <core/accel.h>
+#include <objects/instance.h>
 #include <tools/dpdf.h>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
@@ -26,7 +28,7 @@ public:
     /// Release all memory
     virtual ~Scene();
 
-    /// Return a pointer to the scene's kd-tree
+    /// Return a pointer to the scene's acceleration data structure
     const Accel *getAccel() const { return m_accel; }
 
     /// Return a pointer to the scene's integrator
@@ -47,6 +49,9 @@ public:
     /// Return a reference to an array containing all meshes
     const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
 
+    /// Return a reference to an array containing all mesh instances
+    const std::vector<Instance *> &getInstances() const { return m_instances; }
+
     /// Return a reference to an array containing all lights
     const std::vector<Mesh *> &getLights() const { return m_lights; }
 
@@ -55,15 +60,16 @@ public:
 
     /**
      * \brief Intersect a ray against all triangles stored in the scene
-     * and return detailed intersection information
+     * and return the closest intersection
      *
      * \param ray
      *    A 3-dimensional ray data structure with minimum/maximum
      *    extent information
      *
      * \param its
-     *    A detailed intersection record, which will be filled by the
-     *    intersection query
+     *    A compact intersection record, which will be filled by the
+     *    intersection query. Wrap it into a \ref SurfaceInteraction
+     *    to access the surface attributes at the hit.
      *
      * \return \c true if an intersection was found
      */
@@ -87,8 +93,46 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        return m_accel->occluded(ray);
+    }
+
+    /**
+     * \brief Intersect a packet of coherent rays against all triangles
+     * stored in the scene and return their closest intersections
+     *
+     * \param rays
+     *    Array of \c count rays (at most \ref Accel::MaxPacketSize)
+     *
+     * \param its
+     *    Array of \c count intersection records
+     *
+     * \return A bit mask of the rays for which an intersection was found
+     */
+    uint32_t rayIntersectPacket(const Ray3f *rays, Intersection *its, uint32_t count) const {
+        return m_accel->rayIntersectPacket(rays, its, count);
+    }
+
+    /**
+     * \brief Intersect a stream of incoherent rays against all triangles
+     * stored in the scene and return their closest intersections
+     *
+     * \param rays
+     *    Array of \c count rays
+     *
+     * \param its
+     *    Array of \c count intersection records
+     *
+     * \param hits
+     *    Array of \c count flags, which will be set for the rays
+     *    that intersect the scene
+     */
+    void rayIntersectStream(const Ray3f *rays, Intersection *its, bool *hits, size_t count) const {
+        m_accel->rayIntersectStream(rays, its, hits, count);
+    }
+
+    /// \brief Check a stream of ray segments for occlusion (see \ref Accel::occludedStream())
+    void occludedStream(const Ray3f *rays, bool *occluded, size_t count) const {
+        m_accel->occludedStream(rays, occluded, count);
     }
 
     /// \brief Return an axis-aligned box that bounds the scene
@@ -99,11 +143,18 @@ public:
     /**
      * \brief Inherited from \ref NoriObject::activate()
      *
-     * Initializes the internal data structures (kd-tree,
-     * emitter sampling data structures, etc.)
+     * Builds the acceleration data structure (a BVH configured by the
+     * properties of the scene unless an \c accel child was specified) and
+     * initializes the emitter sampling data structures
      */
     void activate();
 
+    /**
+     * \brief Update the acceleration data structure after the vertex
+     * positions of meshes were changed using \ref Mesh::setVertexPositions()
+     */
+    void update() { m_accel->update(); }
+
     /// Add a child object to the scene (meshes, integrators etc.)
     void addChild(NoriObject *obj);
 
@@ -115,11 +166,14 @@ public:
 private:
     std::vector<Mesh *> m_meshes;
     std::vector<Mesh *> m_lights;
+    std::vector<Instance *> m_instances;
+    std::vector<std::unique_ptr<Instance>> m_implicitInstances; ///< Identity instances of the referenced meshes
 
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
+    PropertyList m_propList;
 };
 
 NORI_NAMESPACE_END
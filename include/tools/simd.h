@@ -0,0 +1,17 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+/**
+ * SSE/AVX intrinsics used by the SIMD kernels of the acceleration data
+ * structure. \c NORI_SSE is defined when they are available, otherwise
+ * the kernels fall back to scalar code.
+ */
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define NORI_SSE 1
+#endif
@@ -4,152 +4,699 @@
     Copyright (c) 2015 by Wenzel Jakob
 */
 
-#include <core/accel.h>
+#include <core/bvh.h>
+#include <tools/timer.h>
 #include <Eigen/Geometry>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_arena.h>
 
 NORI_NAMESPACE_BEGIN
 
-void Accel::addMesh(Mesh *mesh) {
-    m_meshes.push_back(mesh);
-    m_bbox.expandBy(mesh->getBoundingBox());
+/// Subtrees with fewer triangles than this are built on the calling thread
+static const uint32_t ParallelBuildThreshold = 4096;
+
+BVH::BVH(const PropertyList &propList) {
+    m_propList = propList;
+
+    std::string builder = propList.getString("bvhBuilder", "sah");
+    if (builder == "sah")
+        m_builder = ESAHBuilder;
+    else if (builder == "sbvh")
+        m_builder = ESBVHBuilder;
+    else if (builder == "lbvh")
+        m_builder = ELBVHBuilder;
+    else if (builder == "median")
+        m_builder = EMedianBuilder;
+    else
+        throw NoriException("BVH: unknown builder \"%s\"!", builder);
+
+    m_sahBins = propList.getInteger("sahBins", 16);
+    m_traversalCost = propList.getFloat("traversalCost", 1.f);
+    m_intersectionCost = propList.getFloat("intersectionCost", 1.f);
+    int maxLeafSize = propList.getInteger("maxLeafSize", 8);
+
+    if (m_sahBins < 2 || m_sahBins > 256)
+        throw NoriException("BVH: the number of SAH bins must be in [2, 256]!");
+    if (m_traversalCost < 0.f || m_intersectionCost <= 0.f)
+        throw NoriException("BVH: invalid SAH traversal/intersection costs!");
+    if (maxLeafSize < 1 || maxLeafSize > 0xFFFF)
+        throw NoriException("BVH: the maximum leaf size must be in [1, 65535]!");
+    m_maxLeafSize = (uint32_t) maxLeafSize;
+
+    m_bvhWidth = propList.getInteger("bvhWidth", 4);
+    if (m_bvhWidth != 2 && m_bvhWidth != 4 && m_bvhWidth != 8)
+        throw NoriException("BVH: the BVH width must be 2, 4 or 8!");
+    m_compressNodes = propList.getBoolean("compressNodes", false);
+    if (m_compressNodes && m_bvhWidth == 2)
+        throw NoriException("BVH: compressed nodes require a BVH width of 4 or 8!");
+
+    std::string layout = propList.getString("nodeLayout", "depthfirst");
+    if (layout == "depthfirst")
+        m_nodeLayout = EDepthFirstLayout;
+    else if (layout == "breadthfirst")
+        m_nodeLayout = EBreadthFirstLayout;
+    else if (layout == "treelet")
+        m_nodeLayout = ETreeletLayout;
+    else
+        throw NoriException("BVH: unknown node layout \"%s\"!", layout);
+    int layoutTopSize = propList.getInteger("layoutTopSize", 64 * 1024);
+    int layoutPageSize = propList.getInteger("layoutPageSize", 4096);
+    if (layoutTopSize <= 0 || layoutPageSize <= 0)
+        throw NoriException("BVH: the node layout sizes must be positive!");
+    m_layoutTopSize = (size_t) layoutTopSize;
+    m_layoutPageSize = (size_t) layoutPageSize;
+
+    m_spatialSplitAlpha = propList.getFloat("spatialSplitAlpha", 1e-5f);
+    m_duplicationBudget = propList.getFloat("duplicationBudget", 0.3f);
+    if (m_spatialSplitAlpha < 0.f || m_duplicationBudget < 0.f)
+        throw NoriException("BVH: invalid spatial split parameters!");
+
+    m_treeletPasses = propList.getInteger("treeletPasses", 0);
+    if (m_treeletPasses < 0)
+        throw NoriException("BVH: the number of treelet passes must be nonnegative!");
+
+    m_cacheDir = propList.getString("bvhCache", "");
+    m_printStatistics = propList.getBoolean("bvhStatistics", false);
+    m_statisticsFile = propList.getString("bvhStatisticsFile", "");
+
+    m_rebuildThreshold = propList.getFloat("rebuildThreshold", 1.5f);
+    if (m_rebuildThreshold < 1.f)
+        throw NoriException("BVH: the rebuild threshold must be at least 1!");
 }
 
-void Accel::build() {
-    std::vector<TriInfo> tris;
-    for (auto mesh : m_meshes) {
-        uint32_t count = mesh->getTriangleCount();
+BVH::~BVH() { }
 
-        for (uint32_t i = 0; i < count; ++i)
-            tris.push_back(TriInfo(i, mesh));
+void BVH::build() {
+    uint32_t triCount = 0;
+    for (const Mesh *mesh : m_meshes)
+        triCount += mesh->getTriangleCount();
+    if (triCount == 0 && m_instances.empty()) {
+        buildBvh();
+        return;
     }
-    
-    m_bvhTree = buildBvhTree(tris, 0, uint32_t(tris.size() - 1));
+
+    const char *builderNames[] = { "median", "sah", "sbvh", "lbvh" };
+    cout << "Building BVH" << m_bvhWidth << " (" << builderNames[m_builder] << ", "
+         << tbb::this_task_arena::max_concurrency() << " threads) .. ";
+    cout.flush();
+    Timer timer;
+    double cpuStart = getProcessCPUTime();
+
+    bool cached = buildOrLoadBvh();
+    Timer instanceTimer;
+    buildInstances();
+    if (!m_instances.empty())
+        m_buildPhases.emplace_back("instances", instanceTimer.elapsed());
+
+    double elapsed = timer.elapsed();
+    double cpuTime = getProcessCPUTime() - cpuStart;
+
+    cout << "done. (";
+    if (cached)
+        cout << "loaded from cache, ";
+    if (m_compressNodes) {
+        size_t nodeCount = m_qbvh4.size() + m_qbvh8.size();
+        size_t fullSize = m_bvhWidth == 4 ? sizeof(WideBvhNode<4>) : sizeof(WideBvhNode<8>);
+        size_t compressedSize = m_bvhWidth == 4 ? sizeof(QuantizedBvhNode<4>) : sizeof(QuantizedBvhNode<8>);
+        cout << nodeCount << " compressed nodes = " << memString(nodeCount * compressedSize)
+             << " instead of " << memString(nodeCount * fullSize) << ", ";
+    } else {
+        cout << m_nodes.size() << " nodes, ";
+    }
+    if (m_builder == ESBVHBuilder)
+        cout << m_duplicatedRefs << " duplicated references, ";
+    if (!m_instances.empty())
+        cout << m_instances.size() << " instances of " << m_blas.size() << " meshes, ";
+    cout << "SAH cost = " << m_sahCost
+         << ", took " << timeString(elapsed) << ", "
+         << tfm::format("%.1fx", elapsed > 0 ? cpuTime / elapsed : 1.0)
+         << " parallel speedup, "
+         << memString(getMemoryUsage())
+         << ")" << endl;
+
+    if (m_printStatistics || !m_statisticsFile.empty())
+        reportStatistics();
 }
 
-Accel::BvhNode *Accel::buildBvhTree(std::vector<TriInfo> &tris, uint32_t begin, uint32_t end) {
+void BVH::buildBvh() {
+    m_meshOffset.assign(m_meshes.size() + 1, 0);
+    for (size_t i = 0; i < m_meshes.size(); ++i)
+        m_meshOffset[i + 1] = m_meshOffset[i] + m_meshes[i]->getTriangleCount();
+    m_nodes.clear();
+    m_primIndices.clear();
+    m_triGroups.clear();
+    m_bvh4.clear();
+    m_bvh8.clear();
+    m_qbvh4.clear();
+    m_qbvh8.clear();
+    m_sahCost = m_builtSAHCost = 0.f;
+    m_duplicatedRefs = 0;
+    m_buildPhases.clear();
+    if (m_meshOffset.back() == 0)
+        return;
+    Timer timer;
+
+    /* Precompute the bounds and centroids of all triangles in parallel */
+    std::vector<TriInfo> tris(m_meshOffset.back());
+    for (size_t i = 0; i < m_meshes.size(); ++i) {
+        const Mesh *mesh = m_meshes[i];
+        uint32_t offset = m_meshOffset[i];
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, mesh->getTriangleCount(), 1024),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t f = range.begin(); f != range.end(); ++f)
+                    tris[offset + f] = TriInfo(offset + f, mesh, f);
+            }
+        );
+    }
+    m_buildPhases.emplace_back("triangle bounds", timer.lap());
+
+    BuildNode *root;
+    if (m_builder == ESBVHBuilder)
+        root = buildSBVH(tris);
+    else if (m_builder == ELBVHBuilder)
+        root = buildLBVH(tris);
+    else if (m_builder == ESAHBuilder)
+        root = buildSAHTree(tris, 0, (uint32_t) tris.size(), 0);
+    else
+        root = buildBvhTree(tris, 0, uint32_t(tris.size() - 1));
+    m_buildPhases.emplace_back("hierarchy", timer.lap());
+
+    /* Convert the tree into its linear depth-first representation */
+    m_primIndices.reserve(tris.size());
+    flattenBvhTree(root, tris);
+    releaseBvhTree(root);
+    m_buildPhases.emplace_back("flattening", timer.lap());
+
+    /* Copy the leaf triangles into packed groups for the SIMD leaf test */
+    buildTriangleGroups();
+    m_buildPhases.emplace_back("triangle groups", timer.lap());
+
+    /* Collapse the binary tree into a wider one for SIMD traversal */
+    if (m_bvhWidth > 2) {
+        buildWideBvh();
+        m_buildPhases.emplace_back("wide tree", timer.lap());
+    }
+
+    /* Remember the quality of the fresh tree for later updates */
+    m_sahCost = m_builtSAHCost = computeSAHCost();
+
+    /* The compressed tree is all that is needed for the traversal */
+    if (m_compressNodes)
+        std::vector<BvhNode>().swap(m_nodes);
+}
+
+size_t BVH::getMemoryUsage() const {
+    size_t size = m_nodes.size() * sizeof(BvhNode) + m_primIndices.size() * sizeof(uint32_t) +
+                  m_triGroups.size() * sizeof(TriangleGroup) +
+                  m_bvh4.size() * sizeof(WideBvhNode<4>) + m_bvh8.size() * sizeof(WideBvhNode<8>) +
+                  m_qbvh4.size() * sizeof(QuantizedBvhNode<4>) + m_qbvh8.size() * sizeof(QuantizedBvhNode<8>) +
+                  m_topNodes.size() * sizeof(BvhNode) + m_instanceRecords.size() * sizeof(InstanceRecord);
+    for (const auto &blas : m_blas)
+        size += blas->getMemoryUsage();
+    return size;
+}
+
+BVH::BuildNode *BVH::buildBvhTree(std::vector<TriInfo> &tris, uint32_t begin, uint32_t end) {
 
     /* Build bbox for every node */
-    BvhNode *parent = new BvhNode;
     BoundingBox3f bbox;
     for (uint32_t i = begin; i <= end; ++i)
-        bbox.expandBy(tris[i].mesh->getBoundingBox(tris[i].f));
-    parent->bbox = bbox;
+        bbox.expandBy(tris[i].bbox);
 
-    /* Fill the triangle list of leaf node */
-    if (end - begin  < 10) {
-        for (uint32_t i = begin; i <= end; ++i)
-            parent->tri_list.push_back(tris[i]);
-        return parent;
-    }
+    /* Leaf nodes reference their range of the triangle list */
+    if (end - begin  < 10)
+        return makeLeaf(begin, end + 1, bbox);
+
+    BuildNode *parent = new BuildNode;
+    parent->bbox = bbox;
 
     /* Split the node accroding to the position of middle triangle. 
        Ensure numbers of triangles are the same in both child nodes */
-    int axis = bbox.getLargestAxis();
+    int axis = parent->axis = bbox.getLargestAxis();
     uint32_t mid = (begin + end) / 2;
-    std::sort(
+    std::nth_element(
         tris.begin() + begin,
+        tris.begin() + mid,
         tris.begin() + end + 1,
-        [&](TriInfo a, TriInfo b) {
-            return a.mesh->getCentroid(a.f)[axis] < b.mesh->getCentroid(b.f)[axis];
+        [&](const TriInfo &a, const TriInfo &b) {
+            return a.centroid[axis] < b.centroid[axis];
         }
     );
-    
-    parent->lchild = buildBvhTree(tris, begin, mid);
-    parent->rchild = buildBvhTree(tris, mid + 1, end);
+
+    /* Large subtrees are built concurrently */
+    if (end - begin >= ParallelBuildThreshold) {
+        tbb::parallel_invoke(
+            [&] { parent->lchild = buildBvhTree(tris, begin, mid); },
+            [&] { parent->rchild = buildBvhTree(tris, mid + 1, end); }
+        );
+    } else {
+        parent->lchild = buildBvhTree(tris, begin, mid);
+        parent->rchild = buildBvhTree(tris, mid + 1, end);
+    }
     return parent;
 }
 
-void Accel::traverseBvhTree(Ray3f &ray, Intersection &its, bool &intersected, BvhNode *node, bool shadowRay) const {
-    if (!node || !node->bbox.rayIntersect(ray))
-        return;
-    
-    if (!node->lchild && !node->rchild) {
-        float u, v, t;
-        for (auto ti : node->tri_list) {
-            if (ti.mesh->rayIntersect(ti.f, ray, u, v, t) && t < its.t) {
-                /* For shadow ray we don't need to record */
-                if (shadowRay) {
-                    intersected = true;
-                    return;
+BVH::BuildNode *BVH::makeLeaf(uint32_t begin, uint32_t end, const BoundingBox3f &bbox) {
+    BuildNode *leaf = new BuildNode;
+    leaf->bbox = bbox;
+    leaf->offset = begin;
+    leaf->count = end - begin;
+    return leaf;
+}
+
+namespace {
+    /// SAH bins along all three axes, along with the bounds of the binned triangles
+    struct SAHBins {
+        struct Bin {
+            BoundingBox3f bbox;
+            uint32_t count = 0;
+        };
+
+        std::vector<Bin> bins[3];
+
+        SAHBins(int nBins) {
+            for (int axis = 0; axis < 3; ++axis)
+                bins[axis].resize(nBins);
+        }
+
+        void merge(const SAHBins &other) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (size_t i = 0; i < bins[axis].size(); ++i) {
+                    bins[axis][i].bbox.expandBy(other.bins[axis][i].bbox);
+                    bins[axis][i].count += other.bins[axis][i].count;
                 }
-                /* Record the intersection */
-                ray.maxt = its.t = t;
-                its.uv = Point2f(u, v);
-                its.mesh = ti.mesh;
-                its.f = ti.f;
+            }
+        }
+    };
+}
+
+int BVH::binIndex(const Point3f &p, const BoundingBox3f &centroidBox, int axis) const {
+    int idx = (int) (m_sahBins * (p[axis] - centroidBox.min[axis]) /
+                     (centroidBox.max[axis] - centroidBox.min[axis]));
+    return std::min(std::max(idx, 0), m_sahBins - 1);
+}
+
+float BVH::findSAHSplit(const std::vector<TriInfo> &tris, uint32_t begin, uint32_t end,
+                          const BoundingBox3f &bbox, const BoundingBox3f &centroidBox,
+                          int &bestAxis, int &bestSplit) const {
+    /* Bin the centroids along every axis (in parallel at the top levels
+       of the tree) and sweep over the bin boundaries to find the cheapest
+       split candidate */
+    const int nBins = m_sahBins;
+    Vector3f extents = centroidBox.getExtents();
+    tbb::blocked_range<uint32_t> range(begin, end, ParallelBuildThreshold);
+
+    auto fillBins = [&](const tbb::blocked_range<uint32_t> &range, SAHBins bins) {
+        for (uint32_t i = range.begin(); i != range.end(); ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                if (extents[axis] <= 0.f)
+                    continue;
+                int idx = binIndex(tris[i].centroid, centroidBox, axis);
+                bins.bins[axis][idx].bbox.expandBy(tris[i].bbox);
+                bins.bins[axis][idx].count++;
+            }
+        }
+        return bins;
+    };
+
+    SAHBins bins = end - begin >= ParallelBuildThreshold
+        ? tbb::parallel_reduce(range, SAHBins(nBins), fillBins,
+            [](SAHBins a, const SAHBins &b) { a.merge(b); return a; })
+        : fillBins(range, SAHBins(nBins));
+
+    float invArea = 1.f / bbox.getSurfaceArea();
+    float bestCost = std::numeric_limits<float>::infinity();
+    std::vector<float> rightArea(nBins);
+    std::vector<uint32_t> rightCount(nBins);
+    bestAxis = bestSplit = -1;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (extents[axis] <= 0.f)
+            continue;
+        const std::vector<SAHBins::Bin> &axisBins = bins.bins[axis];
+
+        /* Sweep from the right to accumulate the areas of all suffixes */
+        BoundingBox3f right;
+        uint32_t nRight = 0;
+        for (int i = nBins - 1; i > 0; --i) {
+            right.expandBy(axisBins[i].bbox);
+            nRight += axisBins[i].count;
+            rightArea[i] = nRight > 0 ? right.getSurfaceArea() : 0.f;
+            rightCount[i] = nRight;
+        }
+
+        /* .. and from the left to evaluate the cost of every split */
+        BoundingBox3f left;
+        uint32_t nLeft = 0;
+        for (int i = 0; i < nBins - 1; ++i) {
+            left.expandBy(axisBins[i].bbox);
+            nLeft += axisBins[i].count;
+            if (nLeft == 0 || rightCount[i + 1] == 0)
+                continue;
+            float cost = m_traversalCost + m_intersectionCost * invArea *
+                (nLeft * left.getSurfaceArea() + rightCount[i + 1] * rightArea[i + 1]);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+
+    return bestCost;
+}
+
+BVH::BuildNode *BVH::buildSAHTree(std::vector<TriInfo> &tris, uint32_t begin, uint32_t end, int depth) {
+    uint32_t count = end - begin;
+    bool parallel = count >= ParallelBuildThreshold;
+
+    /* Bounds of the triangles and of their centroids */
+    typedef std::pair<BoundingBox3f, BoundingBox3f> BoundsPair;
+    auto computeBounds = [&](const tbb::blocked_range<uint32_t> &range, BoundsPair bounds) {
+        for (uint32_t i = range.begin(); i != range.end(); ++i) {
+            bounds.first.expandBy(tris[i].bbox);
+            bounds.second.expandBy(tris[i].centroid);
+        }
+        return bounds;
+    };
+    auto mergeBounds = [](const BoundsPair &a, const BoundsPair &b) {
+        return BoundsPair(BoundingBox3f::merge(a.first, b.first),
+                          BoundingBox3f::merge(a.second, b.second));
+    };
+
+    tbb::blocked_range<uint32_t> range(begin, end, ParallelBuildThreshold);
+    BoundsPair bounds = parallel
+        ? tbb::parallel_reduce(range, BoundsPair(), computeBounds, mergeBounds)
+        : computeBounds(range, BoundsPair());
+    const BoundingBox3f &bbox = bounds.first, &centroidBox = bounds.second;
+
+    if (count == 1)
+        return makeLeaf(begin, end, bbox);
+
+    /* Beyond a certain depth, split at the median so that the
+       tree stays shallow enough for the traversal stack */
+    int bestAxis = -1, bestSplit = -1;
+    float bestCost = std::numeric_limits<float>::infinity();
+    if (depth < MaxSAHDepth)
+        bestCost = findSAHSplit(tris, begin, end, bbox, centroidBox, bestAxis, bestSplit);
+
+    float leafCost = m_intersectionCost * count;
+    int axis = bestAxis;
+    uint32_t mid;
+    if (bestAxis < 0) {
+        /* No SAH split is available, e.g. because all centroids coincide */
+        if (count <= m_maxLeafSize)
+            return makeLeaf(begin, end, bbox);
+        axis = centroidBox.getLargestAxis();
+        mid = begin + count / 2;
+        std::nth_element(
+            tris.begin() + begin,
+            tris.begin() + mid,
+            tris.begin() + end,
+            [&](const TriInfo &a, const TriInfo &b) {
+                return a.centroid[axis] < b.centroid[axis];
+            }
+        );
+    } else {
+        if (count <= m_maxLeafSize && leafCost <= bestCost)
+            return makeLeaf(begin, end, bbox);
+
+        mid = (uint32_t) (std::partition(
+            tris.begin() + begin,
+            tris.begin() + end,
+            [&](const TriInfo &ti) {
+                return binIndex(ti.centroid, centroidBox, bestAxis) <= bestSplit;
+            }
+        ) - tris.begin());
+    }
+
+    BuildNode *parent = new BuildNode;
+    parent->bbox = bbox;
+    parent->axis = axis;
+    if (parallel) {
+        tbb::parallel_invoke(
+            [&] { parent->lchild = buildSAHTree(tris, begin, mid, depth + 1); },
+            [&] { parent->rchild = buildSAHTree(tris, mid, end, depth + 1); }
+        );
+    } else {
+        parent->lchild = buildSAHTree(tris, begin, mid, depth + 1);
+        parent->rchild = buildSAHTree(tris, mid, end, depth + 1);
+    }
+    return parent;
+}
+
+uint32_t BVH::flattenBvhTree(const BuildNode *node, const std::vector<TriInfo> &tris) {
+    static_assert(sizeof(BvhNode) == 32, "BVH nodes are expected to be 32 bytes large");
+
+    uint32_t idx = (uint32_t) m_nodes.size();
+    m_nodes.emplace_back();
+    m_nodes[idx].bbox = node->bbox;
+    m_nodes[idx].axis = (uint8_t) node->axis;
+    m_nodes[idx].pad = 0;
+
+    if (!node->lchild) {
+        /* Pad the index list so that the leaf starts a new triangle group */
+        while (m_primIndices.size() % TriGroupSize != 0)
+            m_primIndices.push_back((uint32_t) -1);
+        m_nodes[idx].primOffset = (uint32_t) m_primIndices.size();
+        m_nodes[idx].primCount = (uint16_t) node->count;
+        for (uint32_t i = node->offset; i < node->offset + node->count; ++i)
+            m_primIndices.push_back(tris[i].index);
+    } else {
+        m_nodes[idx].primCount = 0;
+        flattenBvhTree(node->lchild, tris);
+        uint32_t rightChild = flattenBvhTree(node->rchild, tris);
+        m_nodes[idx].rightChild = rightChild;
+    }
+    return idx;
+}
+
+void BVH::releaseBvhTree(BuildNode *node) {
+    if (!node)
+        return;
+    releaseBvhTree(node->lchild);
+    releaseBvhTree(node->rchild);
+    delete node;
+}
+
+float BVH::computeSAHCost() const {
+    if (m_nodes.empty())
+        return 0.f;
+
+    /* Accumulate the expected cost of every node weighted by the
+       probability that a ray hitting the root also hits the node */
+    float invRootArea = 1.f / m_nodes[0].bbox.getSurfaceArea();
+    double cost = 0.0;
+    for (const BvhNode &node : m_nodes) {
+        float prob = node.bbox.getSurfaceArea() * invRootArea;
+        if (node.isLeaf())
+            cost += m_intersectionCost * node.primCount * prob;
+        else
+            cost += m_traversalCost * prob;
+    }
+    return (float) cost;
+}
+
+bool BVH::traverseBvhTree(Ray3f &ray, Intersection &its) const {
+    struct StackEntry {
+        uint32_t node;
+        float nearT;
+    };
+    StackEntry stack[TraversalStackSize];
+    int stackSize = 0;
+
+    int dirIsNeg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+    bool intersected = false;
+    uint32_t nodeIdx = 0;
+    float nearT;
+
+    NORI_TRAVERSAL_COUNT(boxTests, 1);
+    if (!intersectSlabs(m_nodes[0].bbox, ray, dirIsNeg, nearT))
+        return false;
+
+    while (true) {
+        const BvhNode &node = m_nodes[nodeIdx];
+
+        if (node.isLeaf()) {
+            if (intersectLeaf(node.primOffset, node.primCount, ray, its))
                 intersected = true;
+        } else {
+            /* Visit the child on the near side of the split plane first
+               and defer the other one together with its entry distance */
+            uint32_t first = nodeIdx + 1, second = node.rightChild;
+            if (dirIsNeg[node.axis])
+                std::swap(first, second);
+
+            float nearFirst, nearSecond;
+            NORI_TRAVERSAL_COUNT(nodes, 1);
+            NORI_TRAVERSAL_COUNT(boxTests, 2);
+            bool hitFirst = intersectSlabs(m_nodes[first].bbox, ray, dirIsNeg, nearFirst);
+            bool hitSecond = intersectSlabs(m_nodes[second].bbox, ray, dirIsNeg, nearSecond);
+
+            if (hitFirst) {
+                if (hitSecond)
+                    stack[stackSize++] = { second, nearSecond };
+                nodeIdx = first;
+                continue;
+            } else if (hitSecond) {
+                nodeIdx = second;
+                continue;
+            }
+        }
+
+        /* Pop the next subtree that may still contain a closer intersection */
+        while (true) {
+            if (stackSize == 0)
+                return intersected;
+            const StackEntry &entry = stack[--stackSize];
+            if (entry.nearT <= ray.maxt) {
+                nodeIdx = entry.node;
+                break;
             }
         }
     }
-    traverseBvhTree(ray, its, intersected, node->lchild, shadowRay);
-    traverseBvhTree(ray, its, intersected, node->rchild, shadowRay);
-    return;
 }
 
-bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
+bool BVH::occludedBvhTree(const Ray3f &ray) const {
+    uint32_t stack[TraversalStackSize];
+    int stackSize = 0;
+
+    int dirIsNeg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+    uint32_t nodeIdx = 0;
+    float nearT;
+
+    NORI_TRAVERSAL_COUNT(boxTests, 1);
+    if (!intersectSlabs(m_nodes[0].bbox, ray, dirIsNeg, nearT))
+        return false;
+
+    while (true) {
+        const BvhNode &node = m_nodes[nodeIdx];
+
+        if (node.isLeaf()) {
+            /* Any intersection along the segment terminates the query */
+            if (occludedLeaf(node.primOffset, node.primCount, ray))
+                return true;
+        } else {
+            /* Entry distances are irrelevant here, but the sign of the
+               ray direction along the split axis is a cheap guess of
+               which child lies in front */
+            uint32_t first = nodeIdx + 1, second = node.rightChild;
+            if (dirIsNeg[node.axis])
+                std::swap(first, second);
+
+            NORI_TRAVERSAL_COUNT(nodes, 1);
+            NORI_TRAVERSAL_COUNT(boxTests, 2);
+            bool hitFirst = intersectSlabs(m_nodes[first].bbox, ray, dirIsNeg, nearT);
+            bool hitSecond = intersectSlabs(m_nodes[second].bbox, ray, dirIsNeg, nearT);
+
+            if (hitFirst) {
+                if (hitSecond)
+                    stack[stackSize++] = second;
+                nodeIdx = first;
+                continue;
+            } else if (hitSecond) {
+                nodeIdx = second;
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+            return false;
+        nodeIdx = stack[--stackSize];
+    }
+}
+
+bool BVH::traverse(Ray3f &ray, Intersection &its) const {
+    if (m_bvhWidth > 2)
+        return traverseWideBvh(ray, its);
+    else
+        return !m_nodes.empty() && traverseBvhTree(ray, its);
+}
+
+bool BVH::occludedMeshes(const Ray3f &ray) const {
+    if (m_bvhWidth > 2)
+        return occludedWideBvh(ray);
+    else
+        return !m_nodes.empty() && occludedBvhTree(ray);
+}
+
+bool BVH::occluded(const Ray3f &ray) const {
+    NORI_TRAVERSAL_COUNT(rays, 1);
+    return occludedMeshes(ray) || (!m_topNodes.empty() && occludedInstances(ray));
+}
+
+bool BVH::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
+    if (shadowRay)
+        return occluded(ray_);
+    NORI_TRAVERSAL_COUNT(rays, 1);
+
     bool intersected = false;        // Was an intersection found so far?
     its.f = (uint32_t) - 1;          // Triangle index of the closest intersection
     its.t = std::numeric_limits<float>::infinity();
+    its.toWorld = nullptr;
 
     Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
 
-    traverseBvhTree(ray, its, intersected, m_bvhTree, shadowRay);
-
-    if (intersected && !shadowRay) {
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..) */
-
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1 - its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, its.f), idx1 = F(1, its.f), idx2 = F(2, its.f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
-        else 
-            its.uv = Point2f(0.f, 0.f);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
-        } else {
-            its.shFrame = its.geoFrame;
+    intersected = traverse(ray, its);
+    if (!m_topNodes.empty() && traverseInstances(ray, its))
+        intersected = true;
+
+    return intersected;
+}
+
+uint32_t BVH::rayIntersectPacket(const Ray3f *rays_, Intersection *its, uint32_t count) const {
+    if (count > MaxPacketSize)
+        throw NoriException("BVH: packets hold at most %i rays!", (int) MaxPacketSize);
+    NORI_TRAVERSAL_COUNT(rays, count);
+
+    /* Make a copy of the rays (we will need to update their '.maxt' values) */
+    Ray3f rays[MaxPacketSize];
+    for (uint32_t r = 0; r < count; ++r) {
+        rays[r] = rays_[r];
+        its[r].f = (uint32_t) -1;
+        its[r].t = std::numeric_limits<float>::infinity();
+        its[r].toWorld = nullptr;
+    }
+
+    uint32_t hits = 0;
+    if (m_bvhWidth > 2 && count > 0) {
+        hits = traversePacket(rays, its, count);
+    } else {
+        for (uint32_t r = 0; r < count; ++r) {
+            if (traverse(rays[r], its[r]))
+                hits |= 1u << r;
         }
     }
 
-    return intersected;
+    /* The instances are traversed by every ray on its own */
+    if (!m_topNodes.empty()) {
+        for (uint32_t r = 0; r < count; ++r) {
+            if (traverseInstances(rays[r], its[r]))
+                hits |= 1u << r;
+        }
+    }
+
+    return hits;
+}
+
+std::string BVH::toString() const {
+    const char *builderNames[] = { "median", "sah", "sbvh", "lbvh" };
+    return tfm::format(
+        "BVH[\n"
+        "  builder = %s,\n"
+        "  width = %i,\n"
+        "  compressNodes = %s,\n"
+        "  meshes = %i,\n"
+        "  instances = %i\n"
+        "]",
+        builderNames[m_builder], m_bvhWidth, m_compressNodes ? "true" : "false",
+        m_meshes.size(), m_instances.size()
+    );
 }
 
+NORI_REGISTER_CLASS(BVH, "bvh");
 NORI_NAMESPACE_END
 
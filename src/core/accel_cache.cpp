@@ -0,0 +1,236 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <tools/mmap.h>
+#include <tools/timer.h>
+#include <filesystem/path.h>
+#include <tbb/parallel_for.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+NORI_NAMESPACE_BEGIN
+
+/// Version of the cache file format (bump whenever the node layout changes)
+static const uint32_t BvhCacheVersion = 1;
+
+/// Alignment of the arrays stored in a cache file
+static const size_t BvhCacheAlignment = 64;
+
+namespace {
+    /// Header of a BVH cache file, followed by the arrays listed in \c counts
+    struct BvhCacheHeader {
+        char magic[8];          ///< "NORIBVH"
+        uint32_t version;       ///< File format version
+        uint32_t triCount;      ///< Number of triangles of the meshes
+        uint64_t hash;          ///< Hash of the meshes and build parameters
+        uint64_t checksum;      ///< Hash of the stored arrays
+        uint64_t counts[6];     ///< Sizes of the binary, 4/8-wide and compressed 4/8-wide trees and the triangle list
+        float sahCost;
+        float builtSAHCost;
+        uint32_t duplicatedRefs;
+        uint32_t pad;
+    };
+
+    inline size_t alignOffset(size_t offset) {
+        return (offset + BvhCacheAlignment - 1) / BvhCacheAlignment * BvhCacheAlignment;
+    }
+}
+
+bool BVH::buildOrLoadBvh() {
+    uint32_t triCount = 0;
+    for (const Mesh *mesh : m_meshes)
+        triCount += mesh->getTriangleCount();
+
+    if (m_cacheDir.empty() || triCount == 0) {
+        buildBvh();
+        return false;
+    }
+
+    uint64_t hash = hashBuildInput();
+    filesystem::path dir(m_cacheDir);
+    std::string filename = (dir / tfm::format("%016x.bvh", hash)).str();
+
+    Timer timer;
+    if (loadBvh(filename, hash)) {
+        m_buildPhases.assign(1, std::make_pair("cache load", timer.elapsed()));
+        return true;
+    }
+
+    buildBvh();
+    timer.reset();
+    if (!dir.exists())
+        filesystem::create_directories(dir);
+    saveBvh(filename, hash);
+    m_buildPhases.emplace_back("cache save", timer.elapsed());
+    return false;
+}
+
+uint64_t BVH::hashBuildInput() const {
+    /* Everything that affects the result of buildBvh() */
+    uint64_t h = hashValue(BvhCacheVersion, 0);
+    h = hashValue((int) m_builder, h);
+    h = hashValue(m_sahBins, h);
+    h = hashValue(m_traversalCost, h);
+    h = hashValue(m_intersectionCost, h);
+    h = hashValue(m_maxLeafSize, h);
+    h = hashValue(m_bvhWidth, h);
+    h = hashValue(m_compressNodes, h);
+    h = hashValue((int) m_nodeLayout, h);
+    h = hashValue(m_layoutTopSize, h);
+    h = hashValue(m_layoutPageSize, h);
+    h = hashValue(m_spatialSplitAlpha, h);
+    h = hashValue(m_duplicationBudget, h);
+    h = hashValue(m_treeletPasses, h);
+
+    for (const Mesh *mesh : m_meshes) {
+        const MatrixXf &V = mesh->getVertexPositions();
+        h = hashBytes(V.data(), sizeof(float) * V.size(), h);
+
+        /* Hash the decoded indices of compact meshes, so that the key
+           does not depend on how the indices are stored */
+        const MatrixXu &F = mesh->getIndices();
+        if (F.cols() == mesh->getTriangleCount()) {
+            h = hashBytes(F.data(), sizeof(uint32_t) * F.size(), h);
+        } else {
+            MatrixXu decoded(3, mesh->getTriangleCount());
+            tbb::parallel_for(uint32_t(0), mesh->getTriangleCount(), [&](uint32_t f) {
+                decoded.col(f) = mesh->getTriangleIndices(f);
+            });
+            h = hashBytes(decoded.data(), sizeof(uint32_t) * decoded.size(), h);
+        }
+    }
+    return h;
+}
+
+bool BVH::loadBvh(const std::string &filename, uint64_t hash) {
+    if (!filesystem::path(filename).exists())
+        return false;
+
+    try {
+        MemoryMappedFile file(filename);
+        const uint8_t *data = file.getData();
+
+        /* Check that the file belongs to the current input and is complete */
+        BvhCacheHeader header;
+        if (file.getSize() < sizeof(BvhCacheHeader))
+            throw NoriException("truncated header");
+        memcpy(&header, data, sizeof(BvhCacheHeader));
+        if (strncmp(header.magic, "NORIBVH", 8) != 0 || header.version != BvhCacheVersion)
+            throw NoriException("unknown file format");
+        if (header.hash != hash)
+            throw NoriException("hash mismatch");
+
+        const size_t elementSizes[6] = {
+            sizeof(BvhNode), sizeof(WideBvhNode<4>), sizeof(WideBvhNode<8>),
+            sizeof(QuantizedBvhNode<4>), sizeof(QuantizedBvhNode<8>), sizeof(uint32_t)
+        };
+        size_t offsets[6], offset = sizeof(BvhCacheHeader);
+        for (int i = 0; i < 6; ++i) {
+            offsets[i] = offset = alignOffset(offset);
+            offset += header.counts[i] * elementSizes[i];
+        }
+        if (file.getSize() != offset)
+            throw NoriException("unexpected file size");
+
+        uint64_t checksum = hash;
+        for (int i = 0; i < 6; ++i)
+            checksum = hashBytes(data + offsets[i], header.counts[i] * elementSizes[i], checksum);
+        if (checksum != header.checksum)
+            throw NoriException("checksum mismatch");
+
+        /* Copy the arrays out of the mapping */
+        auto readArray = [&](auto &array, int i) {
+            array.resize(header.counts[i]);
+            if (!array.empty())
+                memcpy((void *) array.data(), data + offsets[i], header.counts[i] * elementSizes[i]);
+        };
+
+        m_meshOffset.assign(m_meshes.size() + 1, 0);
+        for (size_t i = 0; i < m_meshes.size(); ++i)
+            m_meshOffset[i + 1] = m_meshOffset[i] + m_meshes[i]->getTriangleCount();
+        if (header.triCount != m_meshOffset.back())
+            throw NoriException("triangle count mismatch");
+
+        readArray(m_nodes, 0);
+        readArray(m_bvh4, 1);
+        readArray(m_bvh8, 2);
+        readArray(m_qbvh4, 3);
+        readArray(m_qbvh8, 4);
+        readArray(m_primIndices, 5);
+        m_sahCost = header.sahCost;
+        m_builtSAHCost = header.builtSAHCost;
+        m_duplicatedRefs = header.duplicatedRefs;
+    } catch (const NoriException &e) {
+        cerr << "BVH: ignoring cache \"" << filename << "\" (" << e.what() << ")" << endl;
+        return false;
+    }
+
+    /* The packed triangles are derived from the meshes */
+    buildTriangleGroups();
+    return true;
+}
+
+void BVH::saveBvh(const std::string &filename, uint64_t hash) const {
+    BvhCacheHeader header;
+    memset(&header, 0, sizeof(BvhCacheHeader));
+    memcpy(header.magic, "NORIBVH", 8);
+    header.version = BvhCacheVersion;
+    header.triCount = m_meshOffset.back();
+    header.hash = hash;
+    header.counts[0] = m_nodes.size();
+    header.counts[1] = m_bvh4.size();
+    header.counts[2] = m_bvh8.size();
+    header.counts[3] = m_qbvh4.size();
+    header.counts[4] = m_qbvh8.size();
+    header.counts[5] = m_primIndices.size();
+    header.sahCost = m_sahCost;
+    header.builtSAHCost = m_builtSAHCost;
+    header.duplicatedRefs = m_duplicatedRefs;
+
+    const void *arrays[6] = {
+        m_nodes.data(), m_bvh4.data(), m_bvh8.data(),
+        m_qbvh4.data(), m_qbvh8.data(), m_primIndices.data()
+    };
+    const size_t sizes[6] = {
+        m_nodes.size() * sizeof(BvhNode), m_bvh4.size() * sizeof(WideBvhNode<4>),
+        m_bvh8.size() * sizeof(WideBvhNode<8>), m_qbvh4.size() * sizeof(QuantizedBvhNode<4>),
+        m_qbvh8.size() * sizeof(QuantizedBvhNode<8>), m_primIndices.size() * sizeof(uint32_t)
+    };
+
+    header.checksum = hash;
+    for (int i = 0; i < 6; ++i)
+        header.checksum = hashBytes(arrays[i], sizes[i], header.checksum);
+
+    /* Write to a temporary file first, so that concurrent renders
+       never observe a partially written cache file */
+    std::string tmpFilename = tfm::format("%s.%x.tmp", filename,
+        (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count());
+    {
+        std::ofstream os(tmpFilename, std::ios::binary);
+        const char zeros[BvhCacheAlignment] = { 0 };
+        size_t offset = sizeof(BvhCacheHeader);
+        os.write((const char *) &header, sizeof(BvhCacheHeader));
+        for (int i = 0; i < 6; ++i) {
+            os.write(zeros, alignOffset(offset) - offset);
+            offset = alignOffset(offset) + sizes[i];
+            os.write((const char *) arrays[i], sizes[i]);
+        }
+        if (!os.good()) {
+            cerr << "BVH: unable to write cache \"" << tmpFilename << "\"" << endl;
+            os.close();
+            std::remove(tmpFilename.c_str());
+            return;
+        }
+    }
+
+    if (std::rename(tmpFilename.c_str(), filename.c_str()) != 0)
+        std::remove(tmpFilename.c_str());
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,230 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+/// Largest number of instances stored in a leaf of the top-level tree
+static const uint32_t MaxInstancesPerLeaf = 2;
+
+void BVH::buildInstances() {
+    m_blas.clear();
+    m_instanceRecords.clear();
+    m_topNodes.clear();
+    if (m_instances.empty())
+        return;
+
+    /* Create one bottom-level BVH per distinct mesh .. */
+    std::map<const Mesh *, const BVH *> blasMap;
+    for (const Instance *instance : m_instances) {
+        if (blasMap.find(instance->getMesh()) != blasMap.end())
+            continue;
+        m_blas.emplace_back(new BVH(m_propList));
+        m_blas.back()->addMesh(instance->getMesh());
+        blasMap[instance->getMesh()] = m_blas.back().get();
+    }
+
+    /* .. and build them concurrently */
+    tbb::parallel_for(size_t(0), m_blas.size(), [&](size_t i) {
+        m_blas[i]->buildOrLoadBvh();
+    });
+
+    /* Build the top-level tree over the world-space bounds of the instances */
+    std::vector<TriInfo> infos(m_instances.size());
+    for (uint32_t i = 0; i < (uint32_t) m_instances.size(); ++i) {
+        infos[i].index = i;
+        infos[i].bbox = m_instances[i]->getBoundingBox();
+        infos[i].centroid = infos[i].bbox.getCenter();
+    }
+    buildInstanceTree(infos, 0, (uint32_t) infos.size());
+
+    /* Store the instances in the order referenced by the leaves */
+    m_instanceRecords.reserve(infos.size());
+    for (const TriInfo &info : infos) {
+        const Instance *instance = m_instances[info.index];
+        m_instanceRecords.push_back({ blasMap[instance->getMesh()], &instance->getTransform(),
+                                      instance->getTransform().inverse() });
+    }
+}
+
+uint32_t BVH::buildInstanceTree(std::vector<TriInfo> &infos, uint32_t begin, uint32_t end) {
+    BoundingBox3f bbox, centroidBox;
+    for (uint32_t i = begin; i < end; ++i) {
+        bbox.expandBy(infos[i].bbox);
+        centroidBox.expandBy(infos[i].centroid);
+    }
+
+    uint32_t idx = (uint32_t) m_topNodes.size();
+    m_topNodes.emplace_back();
+    m_topNodes[idx].bbox = bbox;
+    m_topNodes[idx].pad = 0;
+
+    if (end - begin <= MaxInstancesPerLeaf) {
+        m_topNodes[idx].primOffset = begin;
+        m_topNodes[idx].primCount = (uint16_t) (end - begin);
+        m_topNodes[idx].axis = 0;
+        return idx;
+    }
+
+    /* Split at the median centroid along the largest axis */
+    int axis = centroidBox.getLargestAxis();
+    uint32_t mid = begin + (end - begin) / 2;
+    std::nth_element(
+        infos.begin() + begin,
+        infos.begin() + mid,
+        infos.begin() + end,
+        [&](const TriInfo &a, const TriInfo &b) {
+            return a.centroid[axis] < b.centroid[axis];
+        }
+    );
+
+    buildInstanceTree(infos, begin, mid);
+    uint32_t rightChild = buildInstanceTree(infos, mid, end);
+    m_topNodes[idx].primCount = 0;
+    m_topNodes[idx].axis = (uint8_t) axis;
+    m_topNodes[idx].rightChild = rightChild;
+    return idx;
+}
+
+uint32_t BVH::refitInstances() {
+    if (m_topNodes.empty())
+        return 0;
+
+    /* Refit (or rebuild) the bottom-level BVHs concurrently .. */
+    std::vector<uint8_t> rebuilt(m_blas.size());
+    tbb::parallel_for(size_t(0), m_blas.size(), [&](size_t i) {
+        BVH *blas = m_blas[i].get();
+        rebuilt[i] = blas->refitBvh() ? 1 : 0;
+        blas->m_bbox = blas->m_meshes[0]->getBoundingBox();
+    });
+
+    /* .. and update the top-level tree with their transformed bounds */
+    refitInstanceTree(0);
+    return (uint32_t) std::count(rebuilt.begin(), rebuilt.end(), 1);
+}
+
+BoundingBox3f BVH::refitInstanceTree(uint32_t nodeIdx) {
+    BvhNode &node = m_topNodes[nodeIdx];
+
+    if (node.isLeaf()) {
+        BoundingBox3f bbox;
+        for (uint32_t i = node.primOffset; i < node.primOffset + node.primCount; ++i) {
+            const InstanceRecord &instance = m_instanceRecords[i];
+            const BoundingBox3f &localBBox = instance.accel->getBoundingBox();
+            for (int j = 0; j < 8; ++j)
+                bbox.expandBy(*instance.toWorld * localBBox.getCorner(j));
+        }
+        node.bbox = bbox;
+    } else {
+        node.bbox = BoundingBox3f::merge(refitInstanceTree(nodeIdx + 1),
+                                         refitInstanceTree(node.rightChild));
+    }
+    return node.bbox;
+}
+
+bool BVH::traverseInstances(Ray3f &ray, Intersection &its) const {
+    struct StackEntry {
+        uint32_t node;
+        float nearT;
+    };
+    StackEntry stack[TraversalStackSize];
+    int stackSize = 0;
+
+    int dirIsNeg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+    bool intersected = false;
+    uint32_t nodeIdx = 0;
+    float nearT;
+
+    NORI_TRAVERSAL_COUNT(boxTests, 1);
+    if (!intersectSlabs(m_topNodes[0].bbox, ray, dirIsNeg, nearT))
+        return false;
+
+    while (true) {
+        const BvhNode &node = m_topNodes[nodeIdx];
+
+        if (node.isLeaf()) {
+            for (uint32_t i = node.primOffset; i < node.primOffset + node.primCount; ++i) {
+                /* Intersect the bottom-level BVH in object space. The ray
+                   direction is not renormalized, hence distances along
+                   the ray remain comparable to those in world space */
+                const InstanceRecord &instance = m_instanceRecords[i];
+                Ray3f localRay = instance.toLocal * ray;
+                if (instance.accel->traverse(localRay, its)) {
+                    ray.maxt = its.t;
+                    its.toWorld = instance.toWorld;
+                    intersected = true;
+                }
+            }
+        } else {
+            uint32_t first = nodeIdx + 1, second = node.rightChild;
+            if (dirIsNeg[node.axis])
+                std::swap(first, second);
+
+            float nearFirst, nearSecond;
+            NORI_TRAVERSAL_COUNT(nodes, 1);
+            NORI_TRAVERSAL_COUNT(boxTests, 2);
+            bool hitFirst = intersectSlabs(m_topNodes[first].bbox, ray, dirIsNeg, nearFirst);
+            bool hitSecond = intersectSlabs(m_topNodes[second].bbox, ray, dirIsNeg, nearSecond);
+
+            if (hitFirst) {
+                if (hitSecond)
+                    stack[stackSize++] = { second, nearSecond };
+                nodeIdx = first;
+                continue;
+            } else if (hitSecond) {
+                nodeIdx = second;
+                continue;
+            }
+        }
+
+        while (true) {
+            if (stackSize == 0)
+                return intersected;
+            const StackEntry &entry = stack[--stackSize];
+            if (entry.nearT <= ray.maxt) {
+                nodeIdx = entry.node;
+                break;
+            }
+        }
+    }
+}
+
+bool BVH::occludedInstances(const Ray3f &ray) const {
+    uint32_t stack[TraversalStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    int dirIsNeg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+    float nearT;
+
+    while (stackSize > 0) {
+        uint32_t nodeIdx = stack[--stackSize];
+        const BvhNode &node = m_topNodes[nodeIdx];
+        NORI_TRAVERSAL_COUNT(boxTests, 1);
+        if (!intersectSlabs(node.bbox, ray, dirIsNeg, nearT))
+            continue;
+
+        if (node.isLeaf()) {
+            for (uint32_t i = node.primOffset; i < node.primOffset + node.primCount; ++i) {
+                const InstanceRecord &instance = m_instanceRecords[i];
+                if (instance.accel->occludedMeshes(instance.toLocal * ray))
+                    return true;
+            }
+        } else {
+            NORI_TRAVERSAL_COUNT(nodes, 1);
+            stack[stackSize++] = node.rightChild;
+            stack[stackSize++] = nodeIdx + 1;
+        }
+    }
+
+    return false;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,126 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <queue>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+    /// Return whether slot \c i of a wide node references an interior node
+    template <typename Node> bool isInteriorChild(const Node &node, int i) {
+        /* Empty slots have inverted bounds */
+        return node.primCount[i] == 0 && node.bounds[0][0][i] <= node.bounds[1][0][i];
+    }
+
+    /// Surface area of the bounds of slot \c i, i.e. the relative probability that it is visited
+    template <typename Node> float childArea(const Node &node, int i) {
+        float dx = node.bounds[1][0][i] - node.bounds[0][0][i];
+        float dy = node.bounds[1][1][i] - node.bounds[0][1][i];
+        float dz = node.bounds[1][2][i] - node.bounds[0][2][i];
+        return 2.f * (dx * dy + dy * dz + dz * dx);
+    }
+
+    /// Append the subtree below \c root to \c order in depth-first order
+    template <typename Node> void appendDepthFirst(const std::vector<Node> &nodes, uint32_t root,
+                                                   std::vector<uint32_t> &order) {
+        std::vector<uint32_t> stack(1, root);
+        while (!stack.empty()) {
+            uint32_t idx = stack.back();
+            stack.pop_back();
+            order.push_back(idx);
+            for (int i = Node::ChildCount - 1; i >= 0; --i) {
+                if (isInteriorChild(nodes[idx], i))
+                    stack.push_back(nodes[idx].child[i]);
+            }
+        }
+    }
+}
+
+template <int Width> void BVH::reorderWideBvh(std::vector<WideBvhNode<Width>> &nodes, size_t nodeSize) const {
+    if (m_nodeLayout == EDepthFirstLayout || nodes.empty())
+        return;
+
+    /* Compute the new order of the nodes (always starting with the root) */
+    std::vector<uint32_t> order;
+    order.reserve(nodes.size());
+
+    if (m_nodeLayout == EBreadthFirstLayout) {
+        /* Store the top levels breadth-first until they fill 'm_layoutTopSize'
+           bytes, followed by the remaining subtrees in depth-first order */
+        size_t topCount = std::max(m_layoutTopSize / nodeSize, (size_t) 1);
+        std::queue<uint32_t> queue;
+        queue.push(0);
+        while (!queue.empty() && order.size() < topCount) {
+            uint32_t idx = queue.front();
+            queue.pop();
+            order.push_back(idx);
+            for (int i = 0; i < Width; ++i) {
+                if (isInteriorChild(nodes[idx], i))
+                    queue.push(nodes[idx].child[i]);
+            }
+        }
+        for (; !queue.empty(); queue.pop())
+            appendDepthFirst(nodes, queue.front(), order);
+    } else {
+        /* Cut the tree into treelets that fill a page each. A treelet grows
+           greedily by the child with the largest surface area, i.e. the one
+           most likely to be visited by a random ray that enters the treelet.
+           The nodes below a treelet are the roots of the next treelets, which
+           are laid out recursively right after their parent (van Emde Boas
+           style), starting with the largest one */
+        size_t treeletCount = std::max(m_layoutPageSize / nodeSize, (size_t) 1);
+        typedef std::pair<float, uint32_t> Candidate;
+        std::vector<uint32_t> roots(1, 0);
+        while (!roots.empty()) {
+            uint32_t root = roots.back();
+            roots.pop_back();
+
+            std::priority_queue<Candidate> candidates;
+            candidates.push(Candidate(std::numeric_limits<float>::infinity(), root));
+            for (size_t n = 0; n < treeletCount && !candidates.empty(); ++n) {
+                uint32_t idx = candidates.top().second;
+                candidates.pop();
+                order.push_back(idx);
+                for (int i = 0; i < Width; ++i) {
+                    if (isInteriorChild(nodes[idx], i))
+                        candidates.push(Candidate(childArea(nodes[idx], i), nodes[idx].child[i]));
+                }
+            }
+
+            /* The largest remaining candidate ends up on top of the stack */
+            std::vector<Candidate> rest;
+            for (; !candidates.empty(); candidates.pop())
+                rest.push_back(candidates.top());
+            for (auto it = rest.rbegin(); it != rest.rend(); ++it)
+                roots.push_back(it->second);
+        }
+    }
+
+    if (order.size() != nodes.size() || order[0] != 0)
+        throw NoriException("BVH: internal error while reordering the nodes!");
+
+    /* Move the nodes and update the references to their children */
+    std::vector<uint32_t> newIndex(nodes.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        newIndex[order[i]] = (uint32_t) i;
+
+    std::vector<WideBvhNode<Width>> reordered(nodes.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        WideBvhNode<Width> node = nodes[order[i]];
+        for (int j = 0; j < Width; ++j) {
+            if (isInteriorChild(node, j))
+                node.child[j] = newIndex[node.child[j]];
+        }
+        reordered[i] = node;
+    }
+    nodes.swap(reordered);
+}
+
+template void BVH::reorderWideBvh(std::vector<WideBvhNode<4>> &nodes, size_t nodeSize) const;
+template void BVH::reorderWideBvh(std::vector<WideBvhNode<8>> &nodes, size_t nodeSize) const;
+
+NORI_NAMESPACE_END
@@ -0,0 +1,406 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/blocked_range.h>
+#include <functional>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Subtrees with fewer triangles than this are processed on the calling thread
+static const uint32_t ParallelLBVHThreshold = 4096;
+
+/// Number of leaves of the treelets reorganized by \ref BVH::optimizeTreelets()
+static const int TreeletSize = 5;
+
+namespace {
+    /// Number of leading zero bits of a 64-bit integer
+    inline int clz64(uint64_t value) {
+#if defined(_MSC_VER)
+        unsigned long idx;
+        return _BitScanReverse64(&idx, value) ? 63 - (int) idx : 64;
+#else
+        return value == 0 ? 64 : __builtin_clzll(value);
+#endif
+    }
+
+    /// Insert two zero bits after each of the 21 lowest bits of \c x
+    inline uint64_t expandBits(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8)  & 0x100f00f00f00f00full;
+        x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2)  & 0x1249249249249249ull;
+        return x;
+    }
+
+    /**
+     * \brief Parallel least-significant-digit radix sort of 64-bit keys
+     * along with their values
+     *
+     * Every pass sorts 8 bits: the keys are split into blocks, which are
+     * histogrammed and scattered concurrently. Passes over digits that
+     * are identical for all keys are skipped.
+     */
+    void radixSort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values, int bits) {
+        const size_t blockSize = 1 << 16, n = keys.size();
+        const size_t nBlocks = (n + blockSize - 1) / blockSize;
+        std::vector<uint64_t> keysTmp(n);
+        std::vector<uint32_t> valuesTmp(n);
+        std::vector<size_t> offsets(nBlocks * 256);
+
+        for (int shift = 0; shift < bits; shift += 8) {
+            std::fill(offsets.begin(), offsets.end(), 0);
+            tbb::parallel_for(size_t(0), nBlocks, [&](size_t b) {
+                size_t *hist = &offsets[b * 256];
+                for (size_t i = b * blockSize; i < std::min(n, (b + 1) * blockSize); ++i)
+                    hist[(keys[i] >> shift) & 0xFF]++;
+            });
+
+            /* Turn the histograms into scatter offsets (digit-major, then block) */
+            size_t sum = 0;
+            bool trivial = false;
+            for (int digit = 0; digit < 256; ++digit) {
+                size_t digitCount = 0;
+                for (size_t b = 0; b < nBlocks; ++b) {
+                    size_t count = offsets[b * 256 + digit];
+                    offsets[b * 256 + digit] = sum;
+                    sum += count;
+                    digitCount += count;
+                }
+                if (digitCount == n)
+                    trivial = true;
+            }
+            if (trivial)
+                continue;
+
+            tbb::parallel_for(size_t(0), nBlocks, [&](size_t b) {
+                size_t *offset = &offsets[b * 256];
+                for (size_t i = b * blockSize; i < std::min(n, (b + 1) * blockSize); ++i) {
+                    size_t dst = offset[(keys[i] >> shift) & 0xFF]++;
+                    keysTmp[dst] = keys[i];
+                    valuesTmp[dst] = values[i];
+                }
+            });
+            keys.swap(keysTmp);
+            values.swap(valuesTmp);
+        }
+    }
+
+    /// Interior node of the hierarchy emitted from the sorted Morton codes
+    struct LBVHNode {
+        uint32_t child[2];      ///< Index of the children (interior nodes or triangles)
+        bool childIsLeaf[2];    ///< Whether the children are triangles
+        uint32_t count;         ///< Number of triangles below the node
+    };
+}
+
+BVH::BuildNode *BVH::buildLBVH(std::vector<TriInfo> &tris) {
+    uint32_t n = (uint32_t) tris.size();
+
+    /* Quantize the centroids to a 2^21 grid and compute their 63-bit Morton codes */
+    BoundingBox3f centroidBox = tbb::parallel_reduce(
+        tbb::blocked_range<uint32_t>(0, n, ParallelLBVHThreshold), BoundingBox3f(),
+        [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f bbox) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                bbox.expandBy(tris[i].centroid);
+            return bbox;
+        },
+        [](const BoundingBox3f &a, const BoundingBox3f &b) { return BoundingBox3f::merge(a, b); }
+    );
+
+    Vector3f extents = centroidBox.getExtents();
+    std::vector<uint64_t> codes(n);
+    std::vector<uint32_t> order(n);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, n, ParallelLBVHThreshold),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                uint64_t code = 0;
+                for (int axis = 0; axis < 3; ++axis) {
+                    float rel = extents[axis] > 0.f
+                        ? (tris[i].centroid[axis] - centroidBox.min[axis]) / extents[axis] : 0.f;
+                    uint64_t q = (uint64_t) std::min(std::max(rel * 2097152.f, 0.f), 2097151.f);
+                    code |= expandBits(q) << (2 - axis);
+                }
+                codes[i] = code;
+                order[i] = i;
+            }
+        }
+    );
+
+    radixSort(codes, order, 63);
+
+    std::vector<TriInfo> sorted(n);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, n, ParallelLBVHThreshold),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                sorted[i] = tris[order[i]];
+        }
+    );
+    tris.swap(sorted);
+
+    /* Emit all interior nodes independently. The length of the common
+       prefix of two codes (extended by their indices to make all keys
+       distinct) determines the range covered by a node and its split */
+    auto delta = [&](int64_t i, int64_t j) -> int {
+        if (j < 0 || j >= (int64_t) n)
+            return -1;
+        if (codes[i] == codes[j])
+            return 64 + clz64((uint64_t) (i ^ j));
+        return clz64(codes[i] ^ codes[j]);
+    };
+
+    std::vector<LBVHNode> nodes(n > 1 ? n - 1 : 0);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) nodes.size(), 1024),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t idx = range.begin(); idx != range.end(); ++idx) {
+                int64_t i = idx;
+
+                /* Direction and other end of the range */
+                int d = delta(i, i + 1) - delta(i, i - 1) > 0 ? 1 : -1;
+                int deltaMin = delta(i, i - d);
+                int64_t lMax = 2;
+                while (delta(i, i + lMax * d) > deltaMin)
+                    lMax *= 2;
+                int64_t l = 0;
+                for (int64_t t = lMax / 2; t >= 1; t /= 2) {
+                    if (delta(i, i + (l + t) * d) > deltaMin)
+                        l += t;
+                }
+                int64_t j = i + l * d;
+
+                /* Binary search for the split position */
+                int deltaNode = delta(i, j);
+                int64_t s = 0;
+                for (int64_t div = 2; ; div *= 2) {
+                    int64_t t = (l + div - 1) / div;
+                    if (delta(i, i + (s + t) * d) > deltaNode)
+                        s += t;
+                    if (t == 1)
+                        break;
+                }
+                int64_t gamma = i + s * d + std::min(d, 0);
+
+                LBVHNode &node = nodes[idx];
+                node.child[0] = (uint32_t) gamma;
+                node.child[1] = (uint32_t) gamma + 1;
+                node.childIsLeaf[0] = std::min(i, j) == gamma;
+                node.childIsLeaf[1] = std::max(i, j) == gamma + 1;
+                node.count = (uint32_t) (l + 1);
+            }
+        }
+    );
+
+    /* Convert the hierarchy into build nodes, computing bounds and SAH costs bottom-up */
+    std::function<BuildNode *(uint32_t, bool)> convert = [&](uint32_t idx, bool isLeaf) -> BuildNode * {
+        if (isLeaf) {
+            BuildNode *leaf = makeLeaf(idx, idx + 1, tris[idx].bbox);
+            leaf->cost = m_intersectionCost * leaf->bbox.getSurfaceArea();
+            return leaf;
+        }
+        const LBVHNode &node = nodes[idx];
+        BuildNode *parent = new BuildNode;
+        if (node.count >= ParallelLBVHThreshold) {
+            tbb::parallel_invoke(
+                [&] { parent->lchild = convert(node.child[0], node.childIsLeaf[0]); },
+                [&] { parent->rchild = convert(node.child[1], node.childIsLeaf[1]); }
+            );
+        } else {
+            parent->lchild = convert(node.child[0], node.childIsLeaf[0]);
+            parent->rchild = convert(node.child[1], node.childIsLeaf[1]);
+        }
+        parent->bbox = BoundingBox3f::merge(parent->lchild->bbox, parent->rchild->bbox);
+        parent->count = parent->lchild->count + parent->rchild->count;
+
+        /* Store the child with the lower center along the axis that separates
+           the children best on the left (see optimizeTreelets()) */
+        Vector3f diff = parent->rchild->bbox.getCenter() - parent->lchild->bbox.getCenter();
+        diff.cwiseAbs().maxCoeff(&parent->axis);
+        if (diff[parent->axis] < 0)
+            std::swap(parent->lchild, parent->rchild);
+        parent->cost = m_traversalCost * parent->bbox.getSurfaceArea() + parent->lchild->cost + parent->rchild->cost;
+        return parent;
+    };
+    BuildNode *root = convert(0, n == 1);
+
+    if (m_treeletPasses > 0) {
+        for (int pass = 0; pass < m_treeletPasses; ++pass)
+            optimizeTreelets(root);
+
+        /* Reorganized treelets may be deeper than the original tree. Fall
+           back to the latter if the result is too deep for the traversal */
+        std::function<int(const BuildNode *)> depth = [&](const BuildNode *node) -> int {
+            return node->lchild ? 1 + std::max(depth(node->lchild), depth(node->rchild)) : 1;
+        };
+        if (depth(root) > TraversalStackSize) {
+            releaseBvhTree(root);
+            root = convert(0, n == 1);
+        }
+    }
+
+    /* Merge small subtrees into leaves where this reduces the SAH cost. This
+       reorders the triangles, so that every leaf references a contiguous range */
+    std::vector<TriInfo> refs;
+    refs.reserve(n);
+    collapseLBVH(root, tris, refs);
+    tris.swap(refs);
+    return root;
+}
+
+void BVH::optimizeTreelets(BuildNode *node) {
+    if (!node->lchild)
+        return;
+
+    /* Process the tree bottom-up */
+    if (node->count >= ParallelLBVHThreshold) {
+        tbb::parallel_invoke(
+            [&] { optimizeTreelets(node->lchild); },
+            [&] { optimizeTreelets(node->rchild); }
+        );
+    } else {
+        optimizeTreelets(node->lchild);
+        optimizeTreelets(node->rchild);
+    }
+
+    /* The subtrees may have been restructured, refresh the cost of this node */
+    node->cost = m_traversalCost * node->bbox.getSurfaceArea() + node->lchild->cost + node->rchild->cost;
+
+    /* Form a treelet by repeatedly expanding its leaf with the largest surface area */
+    BuildNode *leaves[TreeletSize], *interior[TreeletSize - 1];
+    int leafCount = 2, interiorCount = 1;
+    leaves[0] = node->lchild;
+    leaves[1] = node->rchild;
+    interior[0] = node;
+    while (leafCount < TreeletSize) {
+        int best = -1;
+        float bestArea = -1.f;
+        for (int i = 0; i < leafCount; ++i) {
+            float area = leaves[i]->bbox.getSurfaceArea();
+            if (leaves[i]->lchild && area > bestArea) {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if (best < 0)
+            break;
+        BuildNode *expanded = leaves[best];
+        interior[interiorCount++] = expanded;
+        leaves[best] = expanded->lchild;
+        leaves[leafCount++] = expanded->rchild;
+    }
+    if (leafCount < 3)
+        return;
+
+    /* Find the cheapest binary tree over the treelet leaves by dynamic
+       programming over all subsets (every proper subset of a set has a
+       smaller bit mask, hence they are processed first) */
+    const uint32_t fullSet = (1u << leafCount) - 1;
+    float subsetCost[1 << TreeletSize];
+    uint32_t subsetSplit[1 << TreeletSize];
+    for (uint32_t set = 1; set <= fullSet; ++set) {
+        BoundingBox3f bbox;
+        int bits = 0;
+        for (int i = 0; i < leafCount; ++i) {
+            if (set & (1u << i)) {
+                bbox.expandBy(leaves[i]->bbox);
+                subsetCost[set] = leaves[i]->cost;
+                bits++;
+            }
+        }
+        if (bits < 2)
+            continue;
+
+        /* Only enumerate partitions whose first part contains the lowest
+           element, since both orders of the children are equivalent */
+        uint32_t lowest = set & (~set + 1);
+        float bestCost = std::numeric_limits<float>::infinity();
+        for (uint32_t part = (set - 1) & set; part != 0; part = (part - 1) & set) {
+            if (!(part & lowest))
+                continue;
+            float cost = subsetCost[part] + subsetCost[set ^ part];
+            if (cost < bestCost) {
+                bestCost = cost;
+                subsetSplit[set] = part;
+            }
+        }
+        subsetCost[set] = m_traversalCost * bbox.getSurfaceArea() + bestCost;
+    }
+
+    if (subsetCost[fullSet] >= node->cost * (1.f - 1e-5f))
+        return;
+
+    /* Rebuild the treelet with its existing interior nodes */
+    int nextInterior = 0;
+    std::function<BuildNode *(uint32_t)> rebuild = [&](uint32_t set) -> BuildNode * {
+        if ((set & (set - 1)) == 0) {
+            int i = 0;
+            while (!(set & (1u << i)))
+                ++i;
+            return leaves[i];
+        }
+        BuildNode *parent = interior[nextInterior++];
+        BuildNode *left = rebuild(subsetSplit[set]), *right = rebuild(set ^ subsetSplit[set]);
+
+        /* Store the child with the lower center along the axis that
+           separates the children best on the left, as expected by the
+           traversal when deciding which child to visit first */
+        Vector3f diff = right->bbox.getCenter() - left->bbox.getCenter();
+        diff.cwiseAbs().maxCoeff(&parent->axis);
+        if (diff[parent->axis] < 0)
+            std::swap(left, right);
+
+        parent->lchild = left;
+        parent->rchild = right;
+        parent->bbox = BoundingBox3f::merge(left->bbox, right->bbox);
+        parent->count = left->count + right->count;
+        parent->cost = m_traversalCost * parent->bbox.getSurfaceArea() + left->cost + right->cost;
+        return parent;
+    };
+    rebuild(fullSet);
+}
+
+void BVH::collapseLBVH(BuildNode *node, const std::vector<TriInfo> &tris, std::vector<TriInfo> &refs) {
+    if (!node->lchild) {
+        uint32_t offset = (uint32_t) refs.size();
+        refs.insert(refs.end(), tris.begin() + node->offset, tris.begin() + node->offset + node->count);
+        node->offset = offset;
+        return;
+    }
+
+    float leafCost = m_intersectionCost * node->count * node->bbox.getSurfaceArea();
+    if (node->count <= m_maxLeafSize && leafCost <= node->cost) {
+        uint32_t offset = (uint32_t) refs.size();
+        gatherLeafRefs(node, tris, refs);
+        releaseBvhTree(node->lchild);
+        releaseBvhTree(node->rchild);
+        node->lchild = node->rchild = nullptr;
+        node->offset = offset;
+        node->cost = leafCost;
+        return;
+    }
+
+    collapseLBVH(node->lchild, tris, refs);
+    collapseLBVH(node->rchild, tris, refs);
+}
+
+void BVH::gatherLeafRefs(const BuildNode *node, const std::vector<TriInfo> &tris, std::vector<TriInfo> &refs) {
+    if (node->lchild) {
+        gatherLeafRefs(node->lchild, tris, refs);
+        gatherLeafRefs(node->rchild, tris, refs);
+    } else {
+        refs.insert(refs.end(), tris.begin() + node->offset, tris.begin() + node->offset + node->count);
+    }
+}
+
+NORI_NAMESPACE_END
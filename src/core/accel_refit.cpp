@@ -0,0 +1,99 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <tools/timer.h>
+#include <tbb/parallel_invoke.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Subtrees with fewer nodes than this are refit on the calling thread
+static const uint32_t ParallelRefitThreshold = 2048;
+
+void BVH::update() {
+    if (m_triGroups.empty() && m_topNodes.empty())
+        return;
+
+    cout << "Refitting BVH" << m_bvhWidth << " .. ";
+    cout.flush();
+    Timer timer;
+
+    float oldCost = m_sahCost;
+    uint32_t rebuilt = refitBvh() ? 1 : 0;
+    rebuilt += refitInstances();
+
+    m_bbox.reset();
+    for (const Mesh *mesh : m_meshes)
+        m_bbox.expandBy(mesh->getBoundingBox());
+    for (const Instance *instance : m_instances)
+        m_bbox.expandBy(instance->getBoundingBox());
+
+    cout << "done. (SAH cost " << oldCost << " -> " << m_sahCost << ", ";
+    if (rebuilt > 0)
+        cout << rebuilt << " of " << (m_blas.size() + (m_triGroups.empty() ? 0 : 1)) << " trees rebuilt, ";
+    cout << "took " << timeString(timer.elapsed()) << ")" << endl;
+}
+
+bool BVH::refitBvh() {
+    if (m_triGroups.empty())
+        return false;
+
+    /* Without the binary tree, there is nothing to refit */
+    if (m_compressNodes) {
+        buildBvh();
+        return true;
+    }
+
+    /* Recompute all bounds and check how much the tree degraded */
+    refitBvhTree(0);
+    m_sahCost = computeSAHCost();
+
+    if (m_sahCost > m_rebuildThreshold * m_builtSAHCost) {
+        buildBvh();
+        return true;
+    }
+
+    /* Update the derived representations, which store copies of
+       the vertex positions and node bounds */
+    buildTriangleGroups();
+    m_bvh4.clear();
+    m_bvh8.clear();
+    buildWideBvh();
+    return false;
+}
+
+BoundingBox3f BVH::refitBvhTree(uint32_t nodeIdx) {
+    BvhNode &node = m_nodes[nodeIdx];
+
+    if (node.isLeaf()) {
+        BoundingBox3f bbox;
+        for (uint32_t i = node.primOffset; i < node.primOffset + node.primCount; ++i) {
+            uint32_t f = m_primIndices[i];
+            uint32_t meshIdx = findMesh(f);
+            bbox.expandBy(m_meshes[meshIdx]->getBoundingBox(f));
+        }
+        node.bbox = bbox;
+        return bbox;
+    }
+
+    /* Both subtrees are disjoint ranges of the node array (the left one
+       has 'rightChild - nodeIdx - 1' nodes), hence large ones can be
+       refit concurrently */
+    BoundingBox3f left, right;
+    if (node.rightChild - nodeIdx >= ParallelRefitThreshold) {
+        tbb::parallel_invoke(
+            [&] { left = refitBvhTree(nodeIdx + 1); },
+            [&] { right = refitBvhTree(node.rightChild); }
+        );
+    } else {
+        left = refitBvhTree(nodeIdx + 1);
+        right = refitBvhTree(node.rightChild);
+    }
+    node.bbox = BoundingBox3f::merge(left, right);
+    return node.bbox;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,363 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <tbb/concurrent_vector.h>
+#include <atomic>
+
+NORI_NAMESPACE_BEGIN
+
+/// Nodes with fewer references than this are built on the calling thread
+static const uint32_t ParallelSplitThreshold = 4096;
+
+/// State shared by all recursive invocations of \ref BVH::buildSBVHTree()
+struct BVH::SBVHContext {
+    tbb::concurrent_vector<TriInfo> leafRefs;   ///< References of all leaves created so far
+    std::atomic<int64_t> budget;                ///< Remaining number of references that may be added
+    float rootArea;                             ///< Surface area of the root node
+};
+
+namespace {
+    /// Surface area of a bounding box that may be empty
+    inline float area(const BoundingBox3f &bbox) {
+        return bbox.isValid() ? bbox.getSurfaceArea() : 0.f;
+    }
+
+    /// Spatial bins along all three axes
+    struct SpatialBins {
+        struct Bin {
+            BoundingBox3f bbox;
+            uint32_t enter = 0;     ///< Number of references starting in this bin
+            uint32_t exit = 0;      ///< Number of references ending in this bin
+        };
+
+        std::vector<Bin> bins[3];
+
+        SpatialBins(int nBins) {
+            for (int axis = 0; axis < 3; ++axis)
+                bins[axis].resize(nBins);
+        }
+
+        void merge(const SpatialBins &other) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (size_t i = 0; i < bins[axis].size(); ++i) {
+                    bins[axis][i].bbox.expandBy(other.bins[axis][i].bbox);
+                    bins[axis][i].enter += other.bins[axis][i].enter;
+                    bins[axis][i].exit += other.bins[axis][i].exit;
+                }
+            }
+        }
+    };
+}
+
+BVH::BuildNode *BVH::buildSBVH(std::vector<TriInfo> &tris) {
+    uint32_t triCount = (uint32_t) tris.size();
+
+    SBVHContext ctx;
+    ctx.budget = (int64_t) (m_duplicationBudget * triCount);
+    BoundingBox3f bbox;
+    for (const TriInfo &tri : tris)
+        bbox.expandBy(tri.bbox);
+    ctx.rootArea = area(bbox);
+
+    BuildNode *root = buildSBVHTree(ctx, tris, 0);
+
+    /* The leaves reference ranges of the collected references */
+    tris.assign(ctx.leafRefs.begin(), ctx.leafRefs.end());
+    m_duplicatedRefs = (uint32_t) tris.size() - triCount;
+    return root;
+}
+
+void BVH::splitReference(const TriInfo &ref, int axis, float pos, TriInfo &left, TriInfo &right) const {
+    uint32_t f = ref.index;
+    const Mesh *mesh = m_meshes[findMesh(f)];
+    const MatrixXf &V = mesh->getVertexPositions();
+    Vector3u idx = mesh->getTriangleIndices(f);
+
+    /* Bound the parts of the triangle on both sides of the plane, including
+       the points where its edges cross the plane, and clip them to the
+       (possibly already clipped) bounds of the reference */
+    BoundingBox3f leftBox, rightBox;
+    for (int i = 0; i < 3; ++i) {
+        Point3f v0 = V.col(idx[i]), v1 = V.col(idx[(i + 1) % 3]);
+        float c0 = v0[axis], c1 = v1[axis];
+
+        if (c0 <= pos)
+            leftBox.expandBy(v0);
+        if (c0 >= pos)
+            rightBox.expandBy(v0);
+
+        if ((c0 < pos && c1 > pos) || (c0 > pos && c1 < pos)) {
+            Point3f p = v0 + (v1 - v0) * ((pos - c0) / (c1 - c0));
+            p[axis] = pos;
+            leftBox.expandBy(p);
+            rightBox.expandBy(p);
+        }
+    }
+    leftBox.clip(ref.bbox);
+    rightBox.clip(ref.bbox);
+
+    left.index = right.index = ref.index;
+    left.bbox = leftBox;
+    right.bbox = rightBox;
+    left.centroid = leftBox.getCenter();
+    right.centroid = rightBox.getCenter();
+}
+
+float BVH::findSpatialSplit(const std::vector<TriInfo> &refs, const BoundingBox3f &bbox,
+                              int &bestAxis, float &bestPos, uint32_t &duplicates) const {
+    /* Bin the clipped parts of every reference along all axes, counting
+       where the references enter and leave the binned range */
+    const int nBins = m_sahBins;
+    Vector3f extents = bbox.getExtents();
+    tbb::blocked_range<size_t> range(0, refs.size(), ParallelSplitThreshold);
+
+    auto fillBins = [&](const tbb::blocked_range<size_t> &range, SpatialBins bins) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            const TriInfo &ref = refs[i];
+            for (int axis = 0; axis < 3; ++axis) {
+                if (extents[axis] <= 0.f)
+                    continue;
+                float binSize = extents[axis] / nBins;
+                auto binOf = [&](float p) {
+                    int idx = (int) ((p - bbox.min[axis]) / binSize);
+                    return std::min(std::max(idx, 0), nBins - 1);
+                };
+                int first = binOf(ref.bbox.min[axis]), last = binOf(ref.bbox.max[axis]);
+
+                TriInfo current = ref, left, right;
+                for (int b = first; b < last; ++b) {
+                    splitReference(current, axis, bbox.min[axis] + (b + 1) * binSize, left, right);
+                    bins.bins[axis][b].bbox.expandBy(left.bbox);
+                    current = right;
+                }
+                bins.bins[axis][last].bbox.expandBy(current.bbox);
+                bins.bins[axis][first].enter++;
+                bins.bins[axis][last].exit++;
+            }
+        }
+        return bins;
+    };
+
+    SpatialBins bins = refs.size() >= ParallelSplitThreshold
+        ? tbb::parallel_reduce(range, SpatialBins(nBins), fillBins,
+            [](SpatialBins a, const SpatialBins &b) { a.merge(b); return a; })
+        : fillBins(range, SpatialBins(nBins));
+
+    float invArea = 1.f / bbox.getSurfaceArea();
+    float bestCost = std::numeric_limits<float>::infinity();
+    std::vector<float> rightArea(nBins);
+    std::vector<uint32_t> rightCount(nBins);
+    bestAxis = -1;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (extents[axis] <= 0.f)
+            continue;
+        const std::vector<SpatialBins::Bin> &axisBins = bins.bins[axis];
+
+        BoundingBox3f right;
+        uint32_t nRight = 0;
+        for (int i = nBins - 1; i > 0; --i) {
+            right.expandBy(axisBins[i].bbox);
+            nRight += axisBins[i].exit;
+            rightArea[i] = area(right);
+            rightCount[i] = nRight;
+        }
+
+        BoundingBox3f left;
+        uint32_t nLeft = 0;
+        for (int i = 0; i < nBins - 1; ++i) {
+            left.expandBy(axisBins[i].bbox);
+            nLeft += axisBins[i].enter;
+            if (nLeft == 0 || rightCount[i + 1] == 0)
+                continue;
+            float cost = m_traversalCost + m_intersectionCost * invArea *
+                (nLeft * area(left) + rightCount[i + 1] * rightArea[i + 1]);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestPos = bbox.min[axis] + (i + 1) * (extents[axis] / nBins);
+                duplicates = nLeft + rightCount[i + 1] - (uint32_t) refs.size();
+            }
+        }
+    }
+
+    return bestCost;
+}
+
+BVH::BuildNode *BVH::buildSBVHTree(SBVHContext &ctx, std::vector<TriInfo> &refs, int depth) {
+    uint32_t count = (uint32_t) refs.size();
+
+    BoundingBox3f bbox, centroidBox;
+    for (const TriInfo &ref : refs) {
+        bbox.expandBy(ref.bbox);
+        centroidBox.expandBy(ref.centroid);
+    }
+
+    auto makeSBVHLeaf = [&]() {
+        uint32_t offset = (uint32_t) (ctx.leafRefs.grow_by(refs.begin(), refs.end()) - ctx.leafRefs.begin());
+        return makeLeaf(offset, offset + count, bbox);
+    };
+
+    if (count == 1)
+        return makeSBVHLeaf();
+
+    /* Find the best object split and check how much its children overlap */
+    int objectAxis = -1, objectSplit = -1;
+    float objectCost = std::numeric_limits<float>::infinity();
+    BoundingBox3f overlap;
+    if (depth < MaxSAHDepth) {
+        objectCost = findSAHSplit(refs, 0, count, bbox, centroidBox, objectAxis, objectSplit);
+        if (objectAxis >= 0) {
+            BoundingBox3f leftBox, rightBox;
+            for (const TriInfo &ref : refs) {
+                if (binIndex(ref.centroid, centroidBox, objectAxis) <= objectSplit)
+                    leftBox.expandBy(ref.bbox);
+                else
+                    rightBox.expandBy(ref.bbox);
+            }
+            overlap = leftBox;
+            overlap.clip(rightBox);
+        }
+    }
+
+    /* Only consider spatial splits when the children overlap significantly
+       compared to the whole scene and the duplication budget permits it */
+    int spatialAxis = -1;
+    float spatialPos = 0.f, spatialCost = std::numeric_limits<float>::infinity();
+    uint32_t duplicates = 0;
+    if (depth < MaxSAHDepth && ctx.budget > 0 &&
+        (objectAxis < 0 || area(overlap) > m_spatialSplitAlpha * ctx.rootArea))
+        spatialCost = findSpatialSplit(refs, bbox, spatialAxis, spatialPos, duplicates);
+
+    float leafCost = m_intersectionCost * count;
+    if (count <= m_maxLeafSize && leafCost <= std::min(objectCost, spatialCost))
+        return makeSBVHLeaf();
+
+    std::vector<TriInfo> left, right;
+    int axis = -1;
+
+    if (spatialAxis >= 0 && spatialCost < objectCost) {
+        /* Reserve the estimated number of duplicates from the budget */
+        if (ctx.budget.fetch_sub(duplicates) >= (int64_t) duplicates) {
+            axis = spatialAxis;
+
+            BoundingBox3f leftBox, rightBox;
+            std::vector<TriInfo> straddling;
+            for (const TriInfo &ref : refs) {
+                if (ref.bbox.max[axis] <= spatialPos) {
+                    left.push_back(ref);
+                    leftBox.expandBy(ref.bbox);
+                } else if (ref.bbox.min[axis] >= spatialPos) {
+                    right.push_back(ref);
+                    rightBox.expandBy(ref.bbox);
+                } else {
+                    straddling.push_back(ref);
+                }
+            }
+
+            /* Split the straddling references, unless moving them
+               entirely into one of the children is cheaper */
+            for (const TriInfo &ref : straddling) {
+                TriInfo leftRef, rightRef;
+                splitReference(ref, axis, spatialPos, leftRef, rightRef);
+                float nLeft = (float) left.size(), nRight = (float) right.size();
+
+                if (!leftRef.bbox.isValid() || !rightRef.bbox.isValid()) {
+                    if (leftRef.bbox.isValid()) {
+                        left.push_back(leftRef);
+                        leftBox.expandBy(leftRef.bbox);
+                    } else {
+                        right.push_back(rightRef);
+                        rightBox.expandBy(rightRef.bbox);
+                    }
+                    continue;
+                }
+
+                float splitCost = area(BoundingBox3f::merge(leftBox, leftRef.bbox)) * (nLeft + 1) +
+                                  area(BoundingBox3f::merge(rightBox, rightRef.bbox)) * (nRight + 1);
+                float leftCost = area(BoundingBox3f::merge(leftBox, ref.bbox)) * (nLeft + 1) +
+                                 area(rightBox) * nRight;
+                float rightCost = area(leftBox) * nLeft +
+                                  area(BoundingBox3f::merge(rightBox, ref.bbox)) * (nRight + 1);
+
+                if (splitCost <= leftCost && splitCost <= rightCost) {
+                    left.push_back(leftRef);
+                    right.push_back(rightRef);
+                    leftBox.expandBy(leftRef.bbox);
+                    rightBox.expandBy(rightRef.bbox);
+                } else if (leftCost <= rightCost) {
+                    left.push_back(ref);
+                    leftBox.expandBy(ref.bbox);
+                } else {
+                    right.push_back(ref);
+                    rightBox.expandBy(ref.bbox);
+                }
+            }
+
+            /* Return what was not used to the budget */
+            int64_t added = (int64_t) (left.size() + right.size()) - count;
+            ctx.budget += (int64_t) duplicates - added;
+
+            if (left.empty() || right.empty()) {
+                ctx.budget += added;
+                left.clear();
+                right.clear();
+                axis = -1;
+            }
+        } else {
+            ctx.budget += duplicates;
+        }
+    }
+
+    if (axis < 0 && objectAxis >= 0) {
+        axis = objectAxis;
+        for (const TriInfo &ref : refs) {
+            if (binIndex(ref.centroid, centroidBox, axis) <= objectSplit)
+                left.push_back(ref);
+            else
+                right.push_back(ref);
+        }
+    } else if (axis < 0) {
+        /* No split is available, e.g. because all centroids coincide */
+        if (count <= m_maxLeafSize)
+            return makeSBVHLeaf();
+        axis = centroidBox.getLargestAxis();
+        uint32_t mid = count / 2;
+        std::nth_element(
+            refs.begin(),
+            refs.begin() + mid,
+            refs.end(),
+            [&](const TriInfo &a, const TriInfo &b) {
+                return a.centroid[axis] < b.centroid[axis];
+            }
+        );
+        left.assign(refs.begin(), refs.begin() + mid);
+        right.assign(refs.begin() + mid, refs.end());
+    }
+
+    /* The references of this node are no longer needed */
+    std::vector<TriInfo>().swap(refs);
+
+    BuildNode *parent = new BuildNode;
+    parent->bbox = bbox;
+    parent->axis = axis;
+    if (count >= ParallelSplitThreshold) {
+        tbb::parallel_invoke(
+            [&] { parent->lchild = buildSBVHTree(ctx, left, depth + 1); },
+            [&] { parent->rchild = buildSBVHTree(ctx, right, depth + 1); }
+        );
+    } else {
+        parent->lchild = buildSBVHTree(ctx, left, depth + 1);
+        parent->rchild = buildSBVHTree(ctx, right, depth + 1);
+    }
+    return parent;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,309 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <fstream>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+/// Number of leaf size buckets (bucket k counts the leaves with 2^(k-1) < size <= 2^k triangles)
+static const int LeafSizeBuckets = 17;
+
+/// Quality and footprint of the traversed tree
+struct BVH::BvhStatistics {
+    uint32_t interiorCount = 0;     ///< Number of interior nodes
+    uint32_t leafCount = 0;         ///< Number of leaves
+    uint32_t maxDepth = 0;          ///< Largest depth of a leaf (the root has depth 0)
+    uint64_t leafDepthSum = 0;      ///< Sum of the depths of all leaves
+    uint64_t leafPrimSum = 0;       ///< Sum of the triangle counts of all leaves
+    uint32_t leafSizes[LeafSizeBuckets] = { 0 }; ///< Histogram of the leaf sizes
+    double sahCost = 0.0;           ///< SAH cost of the traversed tree
+    double overlapArea = 0.0;       ///< Surface area shared by sibling boxes
+    double childArea = 0.0;         ///< Surface area of all child boxes
+    size_t nodeBytes = 0;           ///< Memory used by the nodes of all trees
+    size_t primBytes = 0;           ///< Memory used by the triangle references and packed triangles
+    size_t instanceBytes = 0;       ///< Memory used by the top-level tree and the bottom-level BVHs
+
+    void addLeaf(uint32_t primCount, uint32_t depth, float prob, float intersectionCost) {
+        int bucket = 0;
+        while (bucket < LeafSizeBuckets - 1 && (1u << bucket) < primCount)
+            ++bucket;
+        ++leafSizes[bucket];
+        ++leafCount;
+        leafDepthSum += depth;
+        leafPrimSum += primCount;
+        maxDepth = std::max(maxDepth, depth);
+        sahCost += intersectionCost * primCount * prob;
+    }
+
+    /// Account for the boxes of the children of an interior node
+    void addChildren(const BoundingBox3f *boxes, int count) {
+        for (int i = 0; i < count; ++i) {
+            childArea += boxes[i].getSurfaceArea();
+            for (int j = i + 1; j < count; ++j) {
+                if (!boxes[i].overlaps(boxes[j]))
+                    continue;
+                BoundingBox3f overlap(boxes[i]);
+                overlap.clip(boxes[j]);
+                overlapArea += overlap.getSurfaceArea();
+            }
+        }
+    }
+};
+
+namespace {
+    /// Traversal counters of all threads (never released, since threads may outlive any Accel)
+    std::mutex threadStatisticsMutex;
+    std::vector<std::unique_ptr<Accel::TraversalStatistics>> threadStatistics;
+}
+
+Accel::TraversalStatistics &Accel::getThreadStatistics() {
+    thread_local TraversalStatistics *stats = nullptr;
+    if (!stats) {
+        std::lock_guard<std::mutex> guard(threadStatisticsMutex);
+        threadStatistics.emplace_back(new TraversalStatistics());
+        stats = threadStatistics.back().get();
+    }
+    return *stats;
+}
+
+void Accel::printTraversalStatistics() {
+    std::lock_guard<std::mutex> guard(threadStatisticsMutex);
+    if (threadStatistics.empty())
+        return;
+
+    auto print = [](const std::string &name, const TraversalStatistics &stats) {
+        double invRays = stats.rays > 0 ? 1.0 / stats.rays : 0.0;
+        cout << tfm::format("  %-9s: %llu rays, %llu nodes (%.1f per ray), %llu box tests (%.1f per ray), "
+                            "%llu triangle tests (%.1f per ray)", name,
+                            (unsigned long long) stats.rays,
+                            (unsigned long long) stats.nodes, stats.nodes * invRays,
+                            (unsigned long long) stats.boxTests, stats.boxTests * invRays,
+                            (unsigned long long) stats.triangleTests, stats.triangleTests * invRays) << endl;
+    };
+
+    cout << "Traversal statistics:" << endl;
+    TraversalStatistics total;
+    for (size_t i = 0; i < threadStatistics.size(); ++i) {
+        const TraversalStatistics &stats = *threadStatistics[i];
+        if (stats.rays == 0)
+            continue;
+        print(tfm::format("Thread %i", (int) i), stats);
+        total.rays += stats.rays;
+        total.nodes += stats.nodes;
+        total.boxTests += stats.boxTests;
+        total.triangleTests += stats.triangleTests;
+    }
+    print("Total", total);
+}
+
+template <typename Node> void BVH::gatherStatistics(const std::vector<Node> &nodes,
+                                                      BvhStatistics &stats) const {
+    const int Width = Node::ChildCount;
+    struct StackEntry {
+        uint32_t idx;
+        uint32_t depth;
+        float prob;
+    };
+    std::vector<StackEntry> stack(1, StackEntry { 0, 0, 1.f });
+
+    /* The probabilities are relative to the union of the children of the root */
+    float invRootArea = 0.f;
+    {
+        alignas(32) typename Node::Bounds storage;
+        const typename Node::Bounds &bounds = nodes[0].getBounds(storage);
+        BoundingBox3f rootBox;
+        for (int i = 0; i < Width; ++i)
+            rootBox.expandBy(BoundingBox3f(
+                Point3f(bounds[0][0][i], bounds[0][1][i], bounds[0][2][i]),
+                Point3f(bounds[1][0][i], bounds[1][1][i], bounds[1][2][i])));
+        if (rootBox.isValid() && rootBox.getSurfaceArea() > 0)
+            invRootArea = 1.f / rootBox.getSurfaceArea();
+    }
+
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+        const Node &node = nodes[entry.idx];
+        alignas(32) typename Node::Bounds storage;
+        const typename Node::Bounds &bounds = node.getBounds(storage);
+
+        ++stats.interiorCount;
+        stats.sahCost += m_traversalCost * entry.prob;
+
+        BoundingBox3f boxes[Width];
+        int count = 0;
+        for (int i = 0; i < Width; ++i) {
+            BoundingBox3f box(Point3f(bounds[0][0][i], bounds[0][1][i], bounds[0][2][i]),
+                              Point3f(bounds[1][0][i], bounds[1][1][i], bounds[1][2][i]));
+            /* Empty slots have inverted bounds */
+            if (!box.isValid())
+                continue;
+            boxes[count++] = box;
+
+            float prob = box.getSurfaceArea() * invRootArea;
+            if (node.primCount[i] > 0)
+                stats.addLeaf(node.primCount[i], entry.depth + 1, prob, m_intersectionCost);
+            else
+                stack.push_back({ node.child[i], entry.depth + 1, prob });
+        }
+        stats.addChildren(boxes, count);
+    }
+}
+
+void BVH::computeStatistics(BvhStatistics &stats) const {
+    if (m_bvhWidth > 2) {
+        if (!m_qbvh4.empty())
+            gatherStatistics(m_qbvh4, stats);
+        else if (!m_qbvh8.empty())
+            gatherStatistics(m_qbvh8, stats);
+        else if (!m_bvh4.empty())
+            gatherStatistics(m_bvh4, stats);
+        else if (!m_bvh8.empty())
+            gatherStatistics(m_bvh8, stats);
+    } else if (!m_nodes.empty()) {
+        float invRootArea = 1.f / m_nodes[0].bbox.getSurfaceArea();
+        std::vector<std::pair<uint32_t, uint32_t>> stack(1, std::make_pair(0u, 0u));
+        while (!stack.empty()) {
+            uint32_t idx = stack.back().first, depth = stack.back().second;
+            stack.pop_back();
+            const BvhNode &node = m_nodes[idx];
+            float prob = node.bbox.getSurfaceArea() * invRootArea;
+            if (node.isLeaf()) {
+                stats.addLeaf(node.primCount, depth, prob, m_intersectionCost);
+            } else {
+                ++stats.interiorCount;
+                stats.sahCost += m_traversalCost * prob;
+                BoundingBox3f boxes[2] = { m_nodes[idx + 1].bbox, m_nodes[node.rightChild].bbox };
+                stats.addChildren(boxes, 2);
+                stack.push_back(std::make_pair(idx + 1, depth + 1));
+                stack.push_back(std::make_pair(node.rightChild, depth + 1));
+            }
+        }
+    }
+
+    stats.nodeBytes = m_nodes.size() * sizeof(BvhNode) +
+                      m_bvh4.size() * sizeof(WideBvhNode<4>) + m_bvh8.size() * sizeof(WideBvhNode<8>) +
+                      m_qbvh4.size() * sizeof(QuantizedBvhNode<4>) + m_qbvh8.size() * sizeof(QuantizedBvhNode<8>);
+    stats.primBytes = m_primIndices.size() * sizeof(uint32_t) + m_triGroups.size() * sizeof(TriangleGroup);
+    stats.instanceBytes = m_topNodes.size() * sizeof(BvhNode) + m_instanceRecords.size() * sizeof(InstanceRecord);
+    for (const auto &blas : m_blas)
+        stats.instanceBytes += blas->getMemoryUsage();
+}
+
+void BVH::reportStatistics() const {
+    BvhStatistics stats;
+    computeStatistics(stats);
+
+    /* Instanced meshes are only stored in their bottom-level BVHs, which
+       are reported separately */
+    std::vector<BvhStatistics> blasStats(m_blas.size());
+    for (size_t i = 0; i < m_blas.size(); ++i)
+        m_blas[i]->computeStatistics(blasStats[i]);
+    bool hasTopLevel = stats.interiorCount + stats.leafCount > 0 || m_blas.empty();
+
+    auto lastBucket = [](const BvhStatistics &stats) {
+        int k = LeafSizeBuckets - 1;
+        while (k > 0 && stats.leafSizes[k] == 0)
+            --k;
+        return k;
+    };
+    auto avgDepth = [](const BvhStatistics &stats) {
+        return stats.leafCount > 0 ? (float) stats.leafDepthSum / stats.leafCount : 0.f;
+    };
+    auto avgLeafSize = [](const BvhStatistics &stats) {
+        return stats.leafCount > 0 ? (float) stats.leafPrimSum / stats.leafCount : 0.f;
+    };
+    auto overlapRatio = [](const BvhStatistics &stats) {
+        return stats.childArea > 0 ? (float) (stats.overlapArea / stats.childArea) : 0.f;
+    };
+
+    if (m_printStatistics) {
+        auto printTree = [&](const BvhStatistics &stats, float binarySAHCost) {
+            std::string histogram;
+            for (int k = 0; k <= lastBucket(stats); ++k) {
+                uint32_t lo = k > 1 ? (1u << (k - 1)) + 1 : 1u << k, hi = 1u << k;
+                histogram += lo == hi ? tfm::format("%s%u: %u", k > 0 ? ", " : "", hi, stats.leafSizes[k])
+                                      : tfm::format(", %u-%u: %u", lo, hi, stats.leafSizes[k]);
+            }
+            cout << "  Nodes         : " << stats.interiorCount << " interior nodes, " << stats.leafCount
+                 << " leaves (" << m_bvhWidth << "-wide)" << endl
+                 << "  Depth         : " << stats.maxDepth << " max, "
+                 << tfm::format("%.1f", avgDepth(stats)) << " average leaf depth" << endl
+                 << "  Leaf sizes    : " << histogram
+                 << tfm::format(" (%.2f triangles on average)", avgLeafSize(stats)) << endl
+                 << "  SAH cost      : " << stats.sahCost << " (binary tree: " << binarySAHCost << ")" << endl
+                 << "  Overlap ratio : " << overlapRatio(stats) << endl;
+        };
+
+        std::string phases;
+        for (const auto &phase : m_buildPhases)
+            phases += tfm::format("%s%s %s", phases.empty() ? "" : ", ", phase.first, timeString(phase.second));
+
+        cout << "BVH statistics:" << endl;
+        if (hasTopLevel)
+            printTree(stats, m_sahCost);
+        cout << "  Memory        : " << memString(stats.nodeBytes) << " nodes, "
+             << memString(stats.primBytes) << " triangle references";
+        if (!m_blas.empty())
+            cout << ", " << memString(stats.instanceBytes) << " instances";
+        cout << endl;
+        if (!phases.empty())
+            cout << "  Build phases  : " << phases << endl;
+
+        for (size_t i = 0; i < m_blas.size(); ++i) {
+            cout << "Bottom-level BVH statistics of \"" << m_blas[i]->m_meshes[0]->getName() << "\":" << endl;
+            printTree(blasStats[i], m_blas[i]->m_sahCost);
+            cout << "  Memory        : " << memString(blasStats[i].nodeBytes) << " nodes, "
+                 << memString(blasStats[i].primBytes) << " triangle references" << endl;
+        }
+    }
+
+    if (!m_statisticsFile.empty()) {
+        auto writeTree = [&](std::ostream &os, const BvhStatistics &stats, float binarySAHCost,
+                             const std::string &indent) {
+            os << indent << "\"interiorNodes\": " << stats.interiorCount << "," << endl
+               << indent << "\"leaves\": " << stats.leafCount << "," << endl
+               << indent << "\"maxDepth\": " << stats.maxDepth << "," << endl
+               << indent << "\"averageLeafDepth\": " << avgDepth(stats) << "," << endl
+               << indent << "\"averageLeafSize\": " << avgLeafSize(stats) << "," << endl
+               << indent << "\"leafSizeHistogram\": [";
+            for (int k = 0; k <= lastBucket(stats); ++k)
+                os << (k > 0 ? ", " : "") << "{ \"maxSize\": " << (1u << k) << ", \"count\": " << stats.leafSizes[k] << " }";
+            os << "]," << endl
+               << indent << "\"sahCost\": " << stats.sahCost << "," << endl
+               << indent << "\"binarySAHCost\": " << binarySAHCost << "," << endl
+               << indent << "\"overlapRatio\": " << overlapRatio(stats) << "," << endl
+               << indent << "\"nodeBytes\": " << stats.nodeBytes << "," << endl
+               << indent << "\"primitiveBytes\": " << stats.primBytes;
+        };
+
+        std::ofstream os(m_statisticsFile);
+        os << "{" << endl
+           << "  \"width\": " << m_bvhWidth << "," << endl;
+        writeTree(os, stats, m_sahCost, "  ");
+        os << "," << endl
+           << "  \"instanceBytes\": " << stats.instanceBytes << "," << endl
+           << "  \"bottomLevel\": [";
+        for (size_t i = 0; i < m_blas.size(); ++i) {
+            os << (i > 0 ? ", {" : "{") << endl
+               << "    \"mesh\": \"" << m_blas[i]->m_meshes[0]->getName() << "\"," << endl;
+            writeTree(os, blasStats[i], m_blas[i]->m_sahCost, "    ");
+            os << endl << "  }";
+        }
+        os << "]," << endl
+           << "  \"buildPhases\": {";
+        for (size_t i = 0; i < m_buildPhases.size(); ++i)
+            os << (i > 0 ? ", " : " ") << "\"" << m_buildPhases[i].first << "\": " << m_buildPhases[i].second;
+        os << (m_buildPhases.empty() ? "}" : " }") << endl
+           << "}" << endl;
+        if (!os.good())
+            cerr << "BVH: unable to write statistics \"" << m_statisticsFile << "\"" << endl;
+    }
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,108 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <tbb/parallel_for.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Resolution of the grid over the scene bounds that bins the ray origins
+static const int StreamGridSize = 4;
+
+/// Number of distinct bins (8 direction octants times the origin cells)
+static const int StreamBinCount = 8 * StreamGridSize * StreamGridSize * StreamGridSize;
+
+void BVH::rayIntersectStream(const Ray3f *rays, Intersection *its, bool *hits, size_t count) const {
+    traceStream(rays, its, hits, count, false);
+}
+
+void BVH::occludedStream(const Ray3f *rays, bool *occluded, size_t count) const {
+    traceStream(rays, nullptr, occluded, count, true);
+}
+
+void BVH::traceStream(const Ray3f *rays, Intersection *its, bool *hits, size_t count, bool shadowRays) const {
+    if (count == 0)
+        return;
+    NORI_TRAVERSAL_COUNT(rays, count);
+
+    /* Sort the rays by the octant of their direction and the grid cell
+       of their origin, so that the rays of a block are roughly coherent */
+    Vector3f extents = m_bbox.getExtents();
+    Vector3f scale = Vector3f::Zero();
+    for (int i = 0; i < 3; ++i) {
+        if (extents[i] > 0)
+            scale[i] = StreamGridSize / extents[i];
+    }
+
+    std::vector<uint16_t> keys(count);
+    uint32_t binSize[StreamBinCount + 1] = { 0 };
+    for (size_t r = 0; r < count; ++r) {
+        const Ray3f &ray = rays[r];
+        int key = (ray.d.x() < 0) | ((ray.d.y() < 0) << 1) | ((ray.d.z() < 0) << 2);
+        for (int i = 0; i < 3; ++i) {
+            int cell = (int) ((ray.o[i] - m_bbox.min[i]) * scale[i]);
+            key = key * StreamGridSize + std::min(std::max(cell, 0), StreamGridSize - 1);
+        }
+        keys[r] = (uint16_t) key;
+        ++binSize[key + 1];
+    }
+    for (int i = 0; i < StreamBinCount; ++i)
+        binSize[i + 1] += binSize[i];
+
+    std::vector<uint32_t> order(count);
+    for (size_t r = 0; r < count; ++r)
+        order[binSize[keys[r]]++] = (uint32_t) r;
+
+    /* Trace consecutive blocks of the sorted rays in parallel */
+    size_t blockCount = (count + StreamBlockSize - 1) / StreamBlockSize;
+    tbb::parallel_for(size_t(0), blockCount, [&](size_t block) {
+        const uint32_t *ids = order.data() + block * StreamBlockSize;
+        uint32_t n = (uint32_t) std::min((size_t) StreamBlockSize, count - block * StreamBlockSize);
+
+        /* Gather the rays (we will need to update their '.maxt' values) */
+        std::vector<Ray3f> blockRays;
+        blockRays.reserve(n);
+        std::vector<Intersection> blockIts(shadowRays ? 0 : n);
+        std::unique_ptr<bool[]> blockHits(new bool[n]);
+        for (uint32_t r = 0; r < n; ++r) {
+            blockRays.push_back(rays[ids[r]]);
+            blockHits[r] = false;
+            if (!shadowRays) {
+                blockIts[r].f = (uint32_t) -1;
+                blockIts[r].t = std::numeric_limits<float>::infinity();
+                blockIts[r].toWorld = nullptr;
+            }
+        }
+
+        if (m_bvhWidth > 2) {
+            traverseStream(blockRays.data(), blockIts.data(), blockHits.get(), n, shadowRays);
+        } else {
+            for (uint32_t r = 0; r < n; ++r)
+                blockHits[r] = shadowRays ? occludedMeshes(blockRays[r]) : traverse(blockRays[r], blockIts[r]);
+        }
+
+        /* The instances are traversed by every ray on its own */
+        if (!m_topNodes.empty()) {
+            for (uint32_t r = 0; r < n; ++r) {
+                if (shadowRays) {
+                    if (!blockHits[r] && occludedInstances(blockRays[r]))
+                        blockHits[r] = true;
+                } else if (traverseInstances(blockRays[r], blockIts[r])) {
+                    blockHits[r] = true;
+                }
+            }
+        }
+
+        /* Scatter the results back to the input order */
+        for (uint32_t r = 0; r < n; ++r) {
+            hits[ids[r]] = blockHits[r];
+            if (!shadowRays)
+                its[ids[r]] = blockIts[r];
+        }
+    });
+}
+
+NORI_NAMESPACE_END
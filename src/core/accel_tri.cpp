@@ -0,0 +1,171 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <tools/simd.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+NORI_NAMESPACE_BEGIN
+
+void BVH::buildTriangleGroups() {
+    m_triGroups.resize((m_primIndices.size() + TriGroupSize - 1) / TriGroupSize);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, m_triGroups.size(), 256),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t g = range.begin(); g != range.end(); ++g) {
+                TriangleGroup &group = m_triGroups[g];
+                for (uint32_t lane = 0; lane < TriGroupSize; ++lane) {
+                    size_t i = g * TriGroupSize + lane;
+                    uint32_t f = i < m_primIndices.size() ? m_primIndices[i] : (uint32_t) -1;
+
+                    Point3f p0 = Point3f::Zero();
+                    Vector3f e1 = Vector3f::Zero(), e2 = Vector3f::Zero();
+                    uint32_t meshIdx = (uint32_t) -1;
+                    if (f != (uint32_t) -1) {
+                        meshIdx = findMesh(f);
+                        const MatrixXf &V = m_meshes[meshIdx]->getVertexPositions();
+                        Vector3u idx = m_meshes[meshIdx]->getTriangleIndices(f);
+                        p0 = V.col(idx[0]);
+                        e1 = V.col(idx[1]) - p0;
+                        e2 = V.col(idx[2]) - p0;
+                    } else {
+                        f = 0;
+                    }
+
+                    for (int axis = 0; axis < 3; ++axis) {
+                        group.p0[axis][lane] = p0[axis];
+                        group.e1[axis][lane] = e1[axis];
+                        group.e2[axis][lane] = e2[axis];
+                    }
+                    group.meshIdx[lane] = meshIdx;
+                    group.triIdx[lane] = f;
+                }
+            }
+        }
+    );
+}
+
+namespace {
+    typedef float GroupVector[3][4];
+
+    /**
+     * \brief Moeller-Trumbore test of a ray segment against a group of four triangles
+     *
+     * Performs the same operations as \ref Mesh::rayIntersect() on all lanes
+     * at once. Triangles with (near-)zero determinant, including the empty
+     * lanes of a group, are never intersected.
+     *
+     * \return A bit mask of the intersected triangles. \c u, \c v and \c t
+     * receive the barycentric coordinates and distances of all lanes.
+     */
+    inline int intersectTriangles(const GroupVector &p0, const GroupVector &e1, const GroupVector &e2,
+            const Ray3f &ray, float *u, float *v, float *t) {
+#if defined(NORI_SSE)
+        const __m128 dx = _mm_set1_ps(ray.d.x()), dy = _mm_set1_ps(ray.d.y()), dz = _mm_set1_ps(ray.d.z());
+        const __m128 e1x = _mm_load_ps(e1[0]), e1y = _mm_load_ps(e1[1]), e1z = _mm_load_ps(e1[2]);
+        const __m128 e2x = _mm_load_ps(e2[0]), e2y = _mm_load_ps(e2[1]), e2z = _mm_load_ps(e2[2]);
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+
+        /* Begin calculating determinant - also used to calculate U parameter */
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 mask = _mm_or_ps(_mm_cmple_ps(det, _mm_set1_ps(-1e-8f)), _mm_cmpge_ps(det, _mm_set1_ps(1e-8f)));
+        __m128 invDet = _mm_div_ps(one, det);
+
+        /* Calculate distance from v[0] to ray origin */
+        __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.o.x()), _mm_load_ps(p0[0]));
+        __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.o.y()), _mm_load_ps(p0[1]));
+        __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.o.z()), _mm_load_ps(p0[2]));
+
+        /* Calculate U parameter and test bounds */
+        __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+
+        /* Calculate V parameter and test bounds */
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+
+        /* Compute t and test it against the ray segment */
+        __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(tt, _mm_set1_ps(ray.mint)),
+                                           _mm_cmple_ps(tt, _mm_set1_ps(ray.maxt))));
+
+        _mm_storeu_ps(u, uu);
+        _mm_storeu_ps(v, vv);
+        _mm_storeu_ps(t, tt);
+        return _mm_movemask_ps(mask);
+#else
+        int mask = 0;
+        for (int i = 0; i < 4; ++i) {
+            Vector3f edge1(e1[0][i], e1[1][i], e1[2][i]), edge2(e2[0][i], e2[1][i], e2[2][i]);
+            Vector3f pvec = ray.d.cross(edge2);
+            float det = edge1.dot(pvec);
+            if (det > -1e-8f && det < 1e-8f)
+                continue;
+            float invDet = 1.0f / det;
+            Vector3f tvec = ray.o - Point3f(p0[0][i], p0[1][i], p0[2][i]);
+            u[i] = tvec.dot(pvec) * invDet;
+            if (u[i] < 0.f || u[i] > 1.f)
+                continue;
+            Vector3f qvec = tvec.cross(edge1);
+            v[i] = ray.d.dot(qvec) * invDet;
+            if (v[i] < 0.f || u[i] + v[i] > 1.f)
+                continue;
+            t[i] = edge2.dot(qvec) * invDet;
+            if (t[i] >= ray.mint && t[i] <= ray.maxt)
+                mask |= 1 << i;
+        }
+        return mask;
+#endif
+    }
+}
+
+bool BVH::intersectLeaf(uint32_t primOffset, uint32_t primCount, Ray3f &ray, Intersection &its) const {
+    static_assert(TriGroupSize == 4, "The leaf kernel processes groups of four triangles");
+
+    bool intersected = false;
+    uint32_t groupEnd = (primOffset + primCount + TriGroupSize - 1) / TriGroupSize;
+    for (uint32_t g = primOffset / TriGroupSize; g < groupEnd; ++g) {
+        const TriangleGroup &group = m_triGroups[g];
+        float u[TriGroupSize], v[TriGroupSize], t[TriGroupSize];
+        NORI_TRAVERSAL_COUNT(triangleTests, TriGroupSize);
+        int mask = intersectTriangles(group.p0, group.e1, group.e2, ray, u, v, t);
+        if (mask == 0)
+            continue;
+
+        /* Record the closest intersection of the group */
+        for (uint32_t i = 0; i < TriGroupSize; ++i) {
+            if ((mask & (1 << i)) && t[i] < its.t) {
+                ray.maxt = its.t = t[i];
+                its.uv = Point2f(u[i], v[i]);
+                its.mesh = m_meshes[group.meshIdx[i]];
+                its.f = group.triIdx[i];
+                intersected = true;
+            }
+        }
+    }
+    return intersected;
+}
+
+bool BVH::occludedLeaf(uint32_t primOffset, uint32_t primCount, const Ray3f &ray) const {
+    uint32_t groupEnd = (primOffset + primCount + TriGroupSize - 1) / TriGroupSize;
+    for (uint32_t g = primOffset / TriGroupSize; g < groupEnd; ++g) {
+        const TriangleGroup &group = m_triGroups[g];
+        float u[TriGroupSize], v[TriGroupSize], t[TriGroupSize];
+        NORI_TRAVERSAL_COUNT(triangleTests, TriGroupSize);
+        if (intersectTriangles(group.p0, group.e1, group.e2, ray, u, v, t) != 0)
+            return true;
+    }
+    return false;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,828 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/bvh.h>
+#include <tools/simd.h>
+#include <tbb/parallel_for.h>
+#include <cmath>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+void BVH::buildWideBvh() {
+    if (m_nodes.empty())
+        return;
+
+    if (m_bvhWidth == 4) {
+        collapseBvhNode(m_bvh4, 0);
+        reorderWideBvh(m_bvh4, m_compressNodes ? sizeof(QuantizedBvhNode<4>) : sizeof(WideBvhNode<4>));
+    } else if (m_bvhWidth == 8) {
+        collapseBvhNode(m_bvh8, 0);
+        reorderWideBvh(m_bvh8, m_compressNodes ? sizeof(QuantizedBvhNode<8>) : sizeof(WideBvhNode<8>));
+    }
+
+    if (m_compressNodes) {
+        if (m_bvhWidth == 4) {
+            quantizeWideBvh(m_bvh4, m_qbvh4);
+            std::vector<WideBvhNode<4>>().swap(m_bvh4);
+        } else {
+            quantizeWideBvh(m_bvh8, m_qbvh8);
+            std::vector<WideBvhNode<8>>().swap(m_bvh8);
+        }
+    }
+}
+
+template <int Width> uint32_t BVH::collapseBvhNode(std::vector<WideBvhNode<Width>> &nodes, uint32_t nodeIdx) const {
+    /* Gather up to 'Width' children by repeatedly opening the
+       interior node with the largest surface area */
+    uint32_t children[Width];
+    int childCount = 0;
+    if (m_nodes[nodeIdx].isLeaf()) {
+        children[childCount++] = nodeIdx;
+    } else {
+        children[childCount++] = nodeIdx + 1;
+        children[childCount++] = m_nodes[nodeIdx].rightChild;
+    }
+
+    while (childCount < Width) {
+        int best = -1;
+        float bestArea = -1.f;
+        for (int i = 0; i < childCount; ++i) {
+            const BvhNode &child = m_nodes[children[i]];
+            if (!child.isLeaf() && child.bbox.getSurfaceArea() > bestArea) {
+                bestArea = child.bbox.getSurfaceArea();
+                best = i;
+            }
+        }
+        if (best < 0)
+            break;
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[childCount++] = m_nodes[opened].rightChild;
+    }
+
+    uint32_t idx = (uint32_t) nodes.size();
+    nodes.emplace_back();
+
+    WideBvhNode<Width> node;
+    for (int i = 0; i < Width; ++i) {
+        if (i < childCount) {
+            const BvhNode &child = m_nodes[children[i]];
+            for (int axis = 0; axis < 3; ++axis) {
+                node.bounds[0][axis][i] = child.bbox.min[axis];
+                node.bounds[1][axis][i] = child.bbox.max[axis];
+            }
+            if (child.isLeaf()) {
+                node.child[i] = child.primOffset;
+                node.primCount[i] = child.primCount;
+            } else {
+                node.child[i] = collapseBvhNode(nodes, children[i]);
+                node.primCount[i] = 0;
+            }
+        } else {
+            /* Empty slot: an invalid box is never intersected */
+            for (int axis = 0; axis < 3; ++axis) {
+                node.bounds[0][axis][i] =  std::numeric_limits<float>::infinity();
+                node.bounds[1][axis][i] = -std::numeric_limits<float>::infinity();
+            }
+            node.child[i] = 0;
+            node.primCount[i] = 0;
+        }
+    }
+    nodes[idx] = node;
+    return idx;
+}
+
+template <int Width> void BVH::quantizeWideBvh(const std::vector<WideBvhNode<Width>> &nodes,
+                                                 std::vector<QuantizedBvhNode<Width>> &qnodes) const {
+    static_assert(sizeof(QuantizedBvhNode<4>) == 64, "Compressed 4-wide nodes are expected to fill a cache line");
+
+    qnodes.resize(nodes.size());
+    tbb::parallel_for(size_t(0), nodes.size(), [&](size_t idx) {
+        const WideBvhNode<Width> &node = nodes[idx];
+        QuantizedBvhNode<Width> &qnode = qnodes[idx];
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float lo = std::numeric_limits<float>::infinity(), hi = -lo;
+            for (int i = 0; i < Width; ++i) {
+                lo = std::min(lo, node.bounds[0][axis][i]);
+                hi = std::max(hi, node.bounds[1][axis][i]);
+            }
+
+            /* Smallest power of two spacing whose 255 steps cover the node.
+               Since q * scale is exact, 'origin + q * scale' is rounded
+               only once, both here and in the SIMD decoder */
+            int exponent = -126;
+            if (hi > lo) {
+                std::frexp((hi - lo) / 255.f, &exponent);
+                exponent = std::min(std::max(exponent, -126), 127);
+                while (exponent < 127 && lo + 255.f * std::ldexp(1.f, exponent) < hi)
+                    ++exponent;
+            }
+            float scale = std::ldexp(1.f, exponent);
+            qnode.origin[axis] = lo;
+            qnode.exponent[axis] = (int8_t) exponent;
+
+            for (int i = 0; i < Width; ++i) {
+                float childLo = node.bounds[0][axis][i], childHi = node.bounds[1][axis][i];
+                if (childLo > childHi) {
+                    qnode.bounds[0][axis][i] = 255;
+                    qnode.bounds[1][axis][i] = 0;
+                    continue;
+                }
+
+                /* Round conservatively */
+                int qLo = (int) std::min(std::max(std::floor((childLo - lo) / scale), 0.f), 255.f);
+                int qHi = (int) std::min(std::max(std::ceil((childHi - lo) / scale), 0.f), 255.f);
+                while (qLo > 0 && lo + qLo * scale > childLo)
+                    --qLo;
+                while (qHi < 255 && lo + qHi * scale < childHi)
+                    ++qHi;
+                qnode.bounds[0][axis][i] = (uint8_t) qLo;
+                qnode.bounds[1][axis][i] = (uint8_t) qHi;
+            }
+        }
+        qnode.pad = 0;
+
+        for (int i = 0; i < Width; ++i) {
+            qnode.child[i] = node.child[i];
+            qnode.primCount[i] = node.primCount[i];
+        }
+    });
+}
+
+template <int Width> const typename BVH::QuantizedBvhNode<Width>::Bounds &
+BVH::QuantizedBvhNode<Width>::getBounds(Bounds &storage) const {
+    for (int axis = 0; axis < 3; ++axis) {
+#if defined(NORI_SSE)
+        __m128 o = _mm_set1_ps(origin[axis]);
+        __m128 scale = _mm_castsi128_ps(_mm_set1_epi32((exponent[axis] + 127) << 23));
+        const __m128i zero = _mm_setzero_si128();
+        for (int side = 0; side < 2; ++side) {
+            for (int k = 0; k < Width; k += 4) {
+                /* Widen four 8-bit values to 32-bit integers */
+                int32_t packed;
+                memcpy(&packed, &bounds[side][axis][k], sizeof(int32_t));
+                __m128i q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+                _mm_store_ps(storage[side][axis] + k,
+                             _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(q), scale)));
+            }
+        }
+#else
+        float scale = std::ldexp(1.f, exponent[axis]);
+        for (int side = 0; side < 2; ++side)
+            for (int i = 0; i < Width; ++i)
+                storage[side][axis][i] = origin[axis] + bounds[side][axis][i] * scale;
+#endif
+    }
+    return storage;
+}
+
+/* The node statistics (accel_stats.cpp) decode the bounds as well */
+template struct BVH::QuantizedBvhNode<4>;
+template struct BVH::QuantizedBvhNode<8>;
+
+namespace {
+    /// Ray data that is shared by the slab tests of all nodes
+    struct WideRay {
+        float o[3], dRcp[3];
+        int dirIsNeg[3];
+
+        WideRay(const Ray3f &ray) {
+            for (int i = 0; i < 3; ++i) {
+                o[i] = ray.o[i];
+                dRcp[i] = ray.dRcp[i];
+                dirIsNeg[i] = ray.dRcp[i] < 0 ? 1 : 0;
+            }
+        }
+    };
+
+    /**
+     * \brief Slab test of a ray segment against all children of a wide node
+     *
+     * Like the binary slab test, the near and far planes are selected by the
+     * sign of the ray direction and NaNs (rays parallel to a slab) are ignored
+     * by the min/max operations.
+     *
+     * \return A bit mask of the intersected children. \c nearT receives the
+     * entry distances.
+     */
+    template <int Width> inline int intersectChildren(const float (&bounds)[2][3][Width],
+            const WideRay &ray, float mint, float maxt, float *nearT) {
+        int mask = 0;
+#if defined(NORI_SSE)
+#if defined(__AVX__)
+        if (Width == 8) {
+            __m256 tNear = _mm256_set1_ps(mint), tFar = _mm256_set1_ps(maxt);
+            for (int axis = 0; axis < 3; ++axis) {
+                __m256 o = _mm256_set1_ps(ray.o[axis]), rcp = _mm256_set1_ps(ray.dRcp[axis]);
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(
+                    _mm256_load_ps(bounds[ray.dirIsNeg[axis]][axis]), o), rcp);
+                __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(
+                    _mm256_load_ps(bounds[1 - ray.dirIsNeg[axis]][axis]), o), rcp);
+                tNear = _mm256_max_ps(t0, tNear);
+                tFar = _mm256_min_ps(t1, tFar);
+            }
+            _mm256_storeu_ps(nearT, tNear);
+            return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+        }
+#endif
+        for (int k = 0; k < Width; k += 4) {
+            __m128 tNear = _mm_set1_ps(mint), tFar = _mm_set1_ps(maxt);
+            for (int axis = 0; axis < 3; ++axis) {
+                __m128 o = _mm_set1_ps(ray.o[axis]), rcp = _mm_set1_ps(ray.dRcp[axis]);
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(
+                    _mm_load_ps(bounds[ray.dirIsNeg[axis]][axis] + k), o), rcp);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(
+                    _mm_load_ps(bounds[1 - ray.dirIsNeg[axis]][axis] + k), o), rcp);
+                /* min/max return the second operand if either one is NaN, hence a NaN t0/t1 is discarded */
+                tNear = _mm_max_ps(t0, tNear);
+                tFar = _mm_min_ps(t1, tFar);
+            }
+            _mm_storeu_ps(nearT + k, tNear);
+            mask |= _mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) << k;
+        }
+#else
+        for (int i = 0; i < Width; ++i) {
+            float tNear = mint, tFar = maxt;
+            for (int axis = 0; axis < 3; ++axis) {
+                float t0 = (bounds[ray.dirIsNeg[axis]][axis][i] - ray.o[axis]) * ray.dRcp[axis];
+                float t1 = (bounds[1 - ray.dirIsNeg[axis]][axis][i] - ray.o[axis]) * ray.dRcp[axis];
+                tNear = t0 > tNear ? t0 : tNear;
+                tFar = t1 < tFar ? t1 : tFar;
+            }
+            nearT[i] = tNear;
+            if (tNear <= tFar)
+                mask |= 1 << i;
+        }
+#endif
+        return mask;
+    }
+}
+
+template <typename Node> bool BVH::traverseWideBvh(const std::vector<Node> &nodes,
+        Ray3f &ray, Intersection &its, uint32_t root) const {
+    const int Width = Node::ChildCount;
+
+    /* Every visited node pushes at most Width - 1 additional entries */
+    struct StackEntry {
+        uint32_t child;
+        uint32_t primCount;
+        float nearT;
+    };
+    StackEntry stack[TraversalStackSize * (Width - 1) + 1];
+    int stackSize = 0;
+
+    WideRay wideRay(ray);
+    bool intersected = false;
+    stack[stackSize++] = { root, 0, ray.mint };
+
+    while (stackSize > 0) {
+        const StackEntry entry = stack[--stackSize];
+
+        /* Skip subtrees that start beyond the closest intersection */
+        if (entry.nearT > ray.maxt)
+            continue;
+
+        if (entry.primCount > 0) {
+            if (intersectLeaf(entry.child, entry.primCount, ray, its))
+                intersected = true;
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+        alignas(32) typename Node::Bounds bounds;
+        float nearT[Width];
+        NORI_TRAVERSAL_COUNT(nodes, 1);
+        NORI_TRAVERSAL_COUNT(boxTests, Width);
+        int mask = intersectChildren<Width>(node.getBounds(bounds), wideRay, ray.mint, ray.maxt, nearT);
+        if (mask == 0)
+            continue;
+
+        /* Push the intersected children sorted by decreasing entry
+           distance, so that the nearest one is visited next */
+        int first = stackSize;
+        for (int i = 0; i < Width; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            StackEntry child = { node.child[i], node.primCount[i], nearT[i] };
+            int j = stackSize++;
+            while (j > first && stack[j - 1].nearT < child.nearT) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = child;
+        }
+    }
+
+    return intersected;
+}
+
+bool BVH::traverseWideBvh(Ray3f &ray, Intersection &its) const {
+    if (m_compressNodes) {
+        if (m_bvhWidth == 4)
+            return !m_qbvh4.empty() && traverseWideBvh(m_qbvh4, ray, its);
+        else
+            return !m_qbvh8.empty() && traverseWideBvh(m_qbvh8, ray, its);
+    }
+    if (m_bvhWidth == 4)
+        return !m_bvh4.empty() && traverseWideBvh(m_bvh4, ray, its);
+    else
+        return !m_bvh8.empty() && traverseWideBvh(m_bvh8, ray, its);
+}
+
+template <typename Node> bool BVH::occludedWideBvh(const std::vector<Node> &nodes,
+        const Ray3f &ray, uint32_t root) const {
+    const int Width = Node::ChildCount;
+
+    /* Children are visited in slot order, which requires no sorting */
+    struct StackEntry {
+        uint32_t child;
+        uint32_t primCount;
+    };
+    StackEntry stack[TraversalStackSize * (Width - 1) + 1];
+    int stackSize = 0;
+
+    WideRay wideRay(ray);
+    stack[stackSize++] = { root, 0 };
+
+    while (stackSize > 0) {
+        const StackEntry entry = stack[--stackSize];
+
+        if (entry.primCount > 0) {
+            /* Any intersection along the segment terminates the query */
+            if (occludedLeaf(entry.child, entry.primCount, ray))
+                return true;
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+        alignas(32) typename Node::Bounds bounds;
+        float nearT[Width];
+        NORI_TRAVERSAL_COUNT(nodes, 1);
+        NORI_TRAVERSAL_COUNT(boxTests, Width);
+        int mask = intersectChildren<Width>(node.getBounds(bounds), wideRay, ray.mint, ray.maxt, nearT);
+        for (int i = Width - 1; i >= 0; --i) {
+            if (mask & (1 << i))
+                stack[stackSize++] = { node.child[i], node.primCount[i] };
+        }
+    }
+
+    return false;
+}
+
+bool BVH::occludedWideBvh(const Ray3f &ray) const {
+    if (m_compressNodes) {
+        if (m_bvhWidth == 4)
+            return !m_qbvh4.empty() && occludedWideBvh(m_qbvh4, ray);
+        else
+            return !m_qbvh8.empty() && occludedWideBvh(m_qbvh8, ray);
+    }
+    if (m_bvhWidth == 4)
+        return !m_bvh4.empty() && occludedWideBvh(m_bvh4, ray);
+    else
+        return !m_bvh8.empty() && occludedWideBvh(m_bvh8, ray);
+}
+
+namespace {
+    /// Number of set bits of a ray mask
+    inline int countRays(uint32_t mask) {
+        int count = 0;
+        for (; mask != 0; mask &= mask - 1)
+            ++count;
+        return count;
+    }
+
+    /**
+     * \brief Rays of a packet in SoA form, along with the ranges of their
+     * origins and reciprocal directions
+     *
+     * An axis is coherent if all rays have a finite reciprocal direction
+     * of the same sign along it. Only coherent axes enter the interval
+     * test of \ref intersectFrustum().
+     */
+    struct PacketRays {
+        static const uint32_t Size = BVH::MaxPacketSize;
+
+        alignas(16) float o[3][Size];
+        alignas(16) float dRcp[3][Size];
+        alignas(16) uint32_t dirIsNeg[3][Size];     ///< All bits set for negative directions
+        alignas(16) float mint[Size];
+        alignas(16) float maxt[Size];
+
+        float oMin[3], oMax[3];         ///< Range of the ray origins
+        float rcpMin[3], rcpMax[3];     ///< Range of the reciprocal directions
+        int sign[3];                    ///< Direction sign of coherent axes (1 if negative)
+        bool coherent[3];               ///< Whether the axis is coherent
+        float minT;                     ///< Smallest start of the ray segments
+
+        PacketRays(const Ray3f *rays, uint32_t count) {
+            for (uint32_t r = 0; r < Size; ++r) {
+                /* Unused slots are never active, but should not produce NaNs either */
+                for (int axis = 0; axis < 3; ++axis) {
+                    o[axis][r] = r < count ? rays[r].o[axis] : 0.f;
+                    dRcp[axis][r] = r < count ? rays[r].dRcp[axis] : 1.f;
+                    dirIsNeg[axis][r] = dRcp[axis][r] < 0 ? (uint32_t) -1 : 0;
+                }
+                mint[r] = r < count ? rays[r].mint : 1.f;
+                maxt[r] = r < count ? rays[r].maxt : 0.f;
+            }
+
+            minT = std::numeric_limits<float>::infinity();
+            for (uint32_t r = 0; r < count; ++r)
+                minT = std::min(minT, mint[r]);
+
+            for (int axis = 0; axis < 3; ++axis) {
+                oMin[axis] = rcpMin[axis] = std::numeric_limits<float>::infinity();
+                oMax[axis] = rcpMax[axis] = -std::numeric_limits<float>::infinity();
+                sign[axis] = dirIsNeg[axis][0] ? 1 : 0;
+                coherent[axis] = true;
+                for (uint32_t r = 0; r < count; ++r) {
+                    oMin[axis] = std::min(oMin[axis], o[axis][r]);
+                    oMax[axis] = std::max(oMax[axis], o[axis][r]);
+                    rcpMin[axis] = std::min(rcpMin[axis], dRcp[axis][r]);
+                    rcpMax[axis] = std::max(rcpMax[axis], dRcp[axis][r]);
+                    if (dirIsNeg[axis][r] != dirIsNeg[axis][0] || !std::isfinite(dRcp[axis][r]))
+                        coherent[axis] = false;
+                }
+            }
+        }
+    };
+
+    /**
+     * \brief Conservative slab test of all rays of a packet against the
+     * children of a wide node
+     *
+     * Along a coherent axis, the distance at which any ray crosses a plane
+     * lies between the products of the ranges of the offsets to the plane
+     * and of the reciprocal directions. Float rounding is monotonic, so the
+     * bounds also hold for the distances computed by the exact tests. A
+     * child that fails the test is missed by all rays of the packet.
+     *
+     * \return A bit mask of the children that may be intersected. \c nearT
+     * receives lower bounds of the entry distances.
+     */
+    template <int Width> inline int intersectFrustum(const float (&bounds)[2][3][Width],
+            const PacketRays &packet, float maxt, float *nearT) {
+        int mask = 0;
+#if defined(NORI_SSE)
+        for (int k = 0; k < Width; k += 4) {
+            __m128 tNear = _mm_set1_ps(packet.minT), tFar = _mm_set1_ps(maxt);
+            for (int axis = 0; axis < 3; ++axis) {
+                if (!packet.coherent[axis])
+                    continue;
+                __m128 oMin = _mm_set1_ps(packet.oMin[axis]), oMax = _mm_set1_ps(packet.oMax[axis]);
+                __m128 rcpMin = _mm_set1_ps(packet.rcpMin[axis]), rcpMax = _mm_set1_ps(packet.rcpMax[axis]);
+                __m128 nearPlane = _mm_load_ps(bounds[packet.sign[axis]][axis] + k);
+                __m128 farPlane = _mm_load_ps(bounds[1 - packet.sign[axis]][axis] + k);
+                __m128 n0 = _mm_sub_ps(nearPlane, oMax), n1 = _mm_sub_ps(nearPlane, oMin);
+                __m128 f0 = _mm_sub_ps(farPlane, oMax), f1 = _mm_sub_ps(farPlane, oMin);
+                __m128 t0 = _mm_min_ps(_mm_min_ps(_mm_mul_ps(n0, rcpMin), _mm_mul_ps(n0, rcpMax)),
+                                       _mm_min_ps(_mm_mul_ps(n1, rcpMin), _mm_mul_ps(n1, rcpMax)));
+                __m128 t1 = _mm_max_ps(_mm_max_ps(_mm_mul_ps(f0, rcpMin), _mm_mul_ps(f0, rcpMax)),
+                                       _mm_max_ps(_mm_mul_ps(f1, rcpMin), _mm_mul_ps(f1, rcpMax)));
+                tNear = _mm_max_ps(t0, tNear);
+                tFar = _mm_min_ps(t1, tFar);
+            }
+            _mm_storeu_ps(nearT + k, tNear);
+            mask |= _mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) << k;
+        }
+#else
+        for (int i = 0; i < Width; ++i) {
+            float tNear = packet.minT, tFar = maxt;
+            for (int axis = 0; axis < 3; ++axis) {
+                if (!packet.coherent[axis])
+                    continue;
+                float n0 = bounds[packet.sign[axis]][axis][i] - packet.oMax[axis];
+                float n1 = bounds[packet.sign[axis]][axis][i] - packet.oMin[axis];
+                float f0 = bounds[1 - packet.sign[axis]][axis][i] - packet.oMax[axis];
+                float f1 = bounds[1 - packet.sign[axis]][axis][i] - packet.oMin[axis];
+                float t0 = std::min(std::min(n0 * packet.rcpMin[axis], n0 * packet.rcpMax[axis]),
+                                    std::min(n1 * packet.rcpMin[axis], n1 * packet.rcpMax[axis]));
+                float t1 = std::max(std::max(f0 * packet.rcpMin[axis], f0 * packet.rcpMax[axis]),
+                                    std::max(f1 * packet.rcpMin[axis], f1 * packet.rcpMax[axis]));
+                tNear = std::max(tNear, t0);
+                tFar = std::min(tFar, t1);
+            }
+            nearT[i] = tNear;
+            if (tNear <= tFar)
+                mask |= 1 << i;
+        }
+#endif
+        return mask;
+    }
+
+    /**
+     * \brief Exact slab test of the active rays of a packet against one child of a wide node
+     *
+     * Tests four rays at a time and skips groups without active rays. The near
+     * and far planes are selected per ray by the sign of its direction, so that
+     * NaNs are treated exactly like in \ref intersectChildren().
+     *
+     * \return A bit mask of the active rays that intersect the child. \c nearT
+     * receives the smallest entry distance among them.
+     */
+    template <int Width> inline uint32_t intersectPacket(const float (&bounds)[2][3][Width], int child,
+            const PacketRays &packet, uint32_t active, float &nearT) {
+        uint32_t mask = 0;
+        nearT = std::numeric_limits<float>::infinity();
+        for (uint32_t k = 0; k < PacketRays::Size; k += 4) {
+            int lanes = (int) (active >> k) & 0xF;
+            if (lanes == 0)
+                continue;
+
+            float tNear[4];
+#if defined(NORI_SSE)
+            __m128 near = _mm_load_ps(packet.mint + k), far = _mm_load_ps(packet.maxt + k);
+            for (int axis = 0; axis < 3; ++axis) {
+                __m128 lo = _mm_set1_ps(bounds[0][axis][child]), hi = _mm_set1_ps(bounds[1][axis][child]);
+                __m128 neg = _mm_castsi128_ps(_mm_load_si128((const __m128i *) (packet.dirIsNeg[axis] + k)));
+                __m128 o = _mm_load_ps(packet.o[axis] + k), rcp = _mm_load_ps(packet.dRcp[axis] + k);
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_or_ps(_mm_and_ps(neg, hi), _mm_andnot_ps(neg, lo)), o), rcp);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_or_ps(_mm_and_ps(neg, lo), _mm_andnot_ps(neg, hi)), o), rcp);
+                /* min/max return the second operand if either one is NaN, hence a NaN t0/t1 is discarded */
+                near = _mm_max_ps(t0, near);
+                far = _mm_min_ps(t1, far);
+            }
+            _mm_storeu_ps(tNear, near);
+            lanes &= _mm_movemask_ps(_mm_cmple_ps(near, far));
+#else
+            for (int j = 0; j < 4; ++j) {
+                uint32_t r = k + j;
+                float tFar = packet.maxt[r];
+                tNear[j] = packet.mint[r];
+                for (int axis = 0; axis < 3; ++axis) {
+                    int neg = packet.dirIsNeg[axis][r] ? 1 : 0;
+                    float t0 = (bounds[neg][axis][child] - packet.o[axis][r]) * packet.dRcp[axis][r];
+                    float t1 = (bounds[1 - neg][axis][child] - packet.o[axis][r]) * packet.dRcp[axis][r];
+                    tNear[j] = t0 > tNear[j] ? t0 : tNear[j];
+                    tFar = t1 < tFar ? t1 : tFar;
+                }
+                if (!(tNear[j] <= tFar))
+                    lanes &= ~(1 << j);
+            }
+#endif
+            for (int j = 0; j < 4; ++j) {
+                if (lanes & (1 << j))
+                    nearT = std::min(nearT, tNear[j]);
+            }
+            mask |= (uint32_t) lanes << k;
+        }
+        return mask;
+    }
+}
+
+template <typename Node> uint32_t BVH::traversePacket(const std::vector<Node> &nodes,
+        Ray3f *rays, Intersection *its, uint32_t count) const {
+    const int Width = Node::ChildCount;
+
+    /* Every visited node pushes at most Width - 1 additional entries */
+    struct StackEntry {
+        uint32_t child;
+        uint32_t primCount;
+        uint32_t mask;          ///< Rays that may intersect the subtree
+        float nearT;            ///< Entry distance used to order the children
+        float minT;             ///< Lower bound of the entry distances of all rays
+    };
+    StackEntry stack[TraversalStackSize * (Width - 1) + 1];
+    int stackSize = 0;
+
+    PacketRays packet(rays, count);
+    uint32_t hits = 0;
+    stack[stackSize++] = { 0, 0, (uint32_t) ((1ull << count) - 1), packet.minT, packet.minT };
+
+    while (stackSize > 0) {
+        const StackEntry entry = stack[--stackSize];
+
+        /* Skip subtrees that start beyond the closest intersection of all of their rays */
+        float maxT = -std::numeric_limits<float>::infinity();
+        for (uint32_t r = 0; r < count; ++r) {
+            if (entry.mask & (1u << r))
+                maxT = std::max(maxT, packet.maxt[r]);
+        }
+        if (entry.minT > maxT)
+            continue;
+
+        if (entry.primCount > 0) {
+            for (uint32_t r = 0; r < count; ++r) {
+                if ((entry.mask & (1u << r)) && intersectLeaf(entry.child, entry.primCount, rays[r], its[r])) {
+                    packet.maxt[r] = rays[r].maxt;
+                    hits |= 1u << r;
+                }
+            }
+            continue;
+        }
+
+        /* The packet has diverged: the remaining rays finish the subtree on their own */
+        if (countRays(entry.mask) < PacketSplitThreshold) {
+            for (uint32_t r = 0; r < count; ++r) {
+                if ((entry.mask & (1u << r)) && traverseWideBvh(nodes, rays[r], its[r], entry.child)) {
+                    packet.maxt[r] = rays[r].maxt;
+                    hits |= 1u << r;
+                }
+            }
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+        alignas(32) typename Node::Bounds storage;
+        const typename Node::Bounds &bounds = node.getBounds(storage);
+        NORI_TRAVERSAL_COUNT(nodes, 1);
+        NORI_TRAVERSAL_COUNT(boxTests, 2 * Width);
+
+        /* Test the first active ray exactly and the packet as a whole
+           conservatively. Interior children that are entered by the first
+           ray keep the mask of their parent, the masks of all other
+           children are computed ray by ray */
+        uint32_t first = 0;
+        while (!(entry.mask & (1u << first)))
+            ++first;
+        float firstNearT[Width], packetNearT[Width];
+        int firstMask = intersectChildren<Width>(bounds, WideRay(rays[first]),
+            packet.mint[first], packet.maxt[first], firstNearT);
+        int packetMask = intersectFrustum<Width>(bounds, packet, maxT, packetNearT);
+
+        /* Push the intersected children sorted by decreasing entry
+           distance, so that the nearest one is visited next */
+        int firstEntry = stackSize;
+        for (int i = 0; i < Width; ++i) {
+            if (!((firstMask | packetMask) & (1 << i)))
+                continue;
+
+            StackEntry child = { node.child[i], node.primCount[i], entry.mask, firstNearT[i], packetNearT[i] };
+            if (!(firstMask & (1 << i)) || node.primCount[i] > 0) {
+                child.mask = intersectPacket<Width>(bounds, i, packet, entry.mask, child.nearT);
+                NORI_TRAVERSAL_COUNT(boxTests, countRays(entry.mask));
+                if (child.mask == 0)
+                    continue;
+                child.minT = child.nearT;
+            }
+
+            int j = stackSize++;
+            while (j > firstEntry && stack[j - 1].nearT < child.nearT) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = child;
+        }
+    }
+
+    return hits;
+}
+
+uint32_t BVH::traversePacket(Ray3f *rays, Intersection *its, uint32_t count) const {
+    if (m_compressNodes) {
+        if (m_bvhWidth == 4)
+            return m_qbvh4.empty() ? 0 : traversePacket(m_qbvh4, rays, its, count);
+        else
+            return m_qbvh8.empty() ? 0 : traversePacket(m_qbvh8, rays, its, count);
+    }
+    if (m_bvhWidth == 4)
+        return m_bvh4.empty() ? 0 : traversePacket(m_bvh4, rays, its, count);
+    else
+        return m_bvh8.empty() ? 0 : traversePacket(m_bvh8, rays, its, count);
+}
+
+template <bool ShadowRays, typename Node> void BVH::traverseStream(const std::vector<Node> &nodes,
+        Ray3f *rays, Intersection *its, bool *hits, uint32_t count) const {
+    const int Width = Node::ChildCount;
+    if (nodes.empty() || count == 0)
+        return;
+
+    /* Every frame references the rays that entered its subtree by a range of
+       'ids'. The children of a node append their ranges right behind the one
+       of their parent, hence the ranges of the frames on the stack are
+       ordered and the range of the popped frame is always the last one */
+    struct Frame {
+        uint32_t child;
+        uint32_t primCount;
+        uint32_t begin, end;
+    };
+    std::vector<Frame> stack;
+    std::vector<uint32_t> ids(count * Width);
+    std::vector<uint8_t> masks(count);
+    std::vector<WideRay> wideRays;
+    wideRays.reserve(count);
+    for (uint32_t r = 0; r < count; ++r) {
+        ids[r] = r;
+        wideRays.emplace_back(rays[r]);
+    }
+    stack.push_back({ 0, 0, 0, count });
+
+    while (!stack.empty()) {
+        const Frame frame = stack.back();
+        stack.pop_back();
+
+        if (frame.primCount > 0) {
+            for (uint32_t k = frame.begin; k < frame.end; ++k) {
+                uint32_t r = ids[k];
+                if (ShadowRays) {
+                    if (!hits[r] && occludedLeaf(frame.child, frame.primCount, rays[r]))
+                        hits[r] = true;
+                } else if (intersectLeaf(frame.child, frame.primCount, rays[r], its[r])) {
+                    hits[r] = true;
+                }
+            }
+            continue;
+        }
+
+        /* Few rays remain: they finish the subtree on their own */
+        if (frame.end - frame.begin < StreamSplitThreshold) {
+            for (uint32_t k = frame.begin; k < frame.end; ++k) {
+                uint32_t r = ids[k];
+                if (ShadowRays) {
+                    if (!hits[r] && occludedWideBvh(nodes, rays[r], frame.child))
+                        hits[r] = true;
+                } else if (traverseWideBvh(nodes, rays[r], its[r], frame.child)) {
+                    hits[r] = true;
+                }
+            }
+            continue;
+        }
+
+        const Node &node = nodes[frame.child];
+        alignas(32) typename Node::Bounds storage;
+        const typename Node::Bounds &bounds = node.getBounds(storage);
+        NORI_TRAVERSAL_COUNT(nodes, 1);
+
+        /* Test every ray against all children and count the rays per child */
+        uint32_t childCount[Width] = { 0 };
+        float childNearT[Width] = { 0 };
+        for (uint32_t k = frame.begin; k < frame.end; ++k) {
+            uint32_t r = ids[k];
+            int mask = 0;
+            if (!ShadowRays || !hits[r]) {
+                float nearT[Width];
+                NORI_TRAVERSAL_COUNT(boxTests, Width);
+                mask = intersectChildren<Width>(bounds, wideRays[r], rays[r].mint, rays[r].maxt, nearT);
+                for (int i = 0; i < Width; ++i) {
+                    if (mask & (1 << i)) {
+                        ++childCount[i];
+                        childNearT[i] += nearT[i];
+                    }
+                }
+            }
+            masks[k - frame.begin] = (uint8_t) mask;
+        }
+
+        /* Visit the children sorted by increasing mean entry distance.
+           They are pushed in reverse order, and their ranges are laid out
+           in the same order to keep the ranges on the stack ordered */
+        int order[Width], n = 0;
+        for (int i = 0; i < Width; ++i) {
+            if (childCount[i] == 0)
+                continue;
+            childNearT[i] /= childCount[i];
+            int j = n++;
+            while (j > 0 && childNearT[order[j - 1]] < childNearT[i]) {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+
+        /* Distribute the rays among the children */
+        uint32_t childBegin[Width], childEnd[Width], offset = frame.end;
+        for (int j = 0; j < n; ++j) {
+            int i = order[j];
+            childBegin[i] = childEnd[i] = offset;
+            offset += childCount[i];
+        }
+        if (ids.size() < offset)
+            ids.resize(std::max(offset, (uint32_t) ids.size() * 2));
+        for (uint32_t k = frame.begin; k < frame.end; ++k) {
+            int mask = masks[k - frame.begin];
+            for (int i = 0; i < Width; ++i) {
+                if (mask & (1 << i))
+                    ids[childEnd[i]++] = ids[k];
+            }
+        }
+
+        for (int j = 0; j < n; ++j) {
+            int i = order[j];
+            stack.push_back({ node.child[i], node.primCount[i], childBegin[i], childEnd[i] });
+        }
+    }
+}
+
+void BVH::traverseStream(Ray3f *rays, Intersection *its, bool *hits, uint32_t count, bool shadowRays) const {
+    if (m_compressNodes) {
+        if (m_bvhWidth == 4)
+            shadowRays ? traverseStream<true>(m_qbvh4, rays, its, hits, count)
+                       : traverseStream<false>(m_qbvh4, rays, its, hits, count);
+        else
+            shadowRays ? traverseStream<true>(m_qbvh8, rays, its, hits, count)
+                       : traverseStream<false>(m_qbvh8, rays, its, hits, count);
+    } else if (m_bvhWidth == 4) {
+        shadowRays ? traverseStream<true>(m_bvh4, rays, its, hits, count)
+                   : traverseStream<false>(m_bvh4, rays, its, hits, count);
+    } else {
+        shadowRays ? traverseStream<true>(m_bvh8, rays, its, hits, count)
+                   : traverseStream<false>(m_bvh8, rays, its, hits, count);
+    }
+}
+
+NORI_NAMESPACE_END
@@ -109,7 +109,8 @@ public:
 
                 /* Generate many samples from the BSDF and create
                    a histogram / contingency table */
-                BSDFQueryRecord bRec(wi, Intersection());
+                SurfaceInteraction si;
+                BSDFQueryRecord bRec(wi, si);
                 for (int i=0; i<m_sampleCount; ++i) {
                     Point2f sample(random.nextFloat(), random.nextFloat());
                     Color3f result = bsdf->sample(bRec, sample);
@@ -150,7 +151,8 @@ public:
                                         (float) (sinTheta * sinPhi),
                                         (float) cosTheta);
 
-                            BSDFQueryRecord bRec(wi, wo, ESolidAngle, Intersection());
+                            SurfaceInteraction si;
+                            BSDFQueryRecord bRec(wi, wo, ESolidAngle, si);
                             return bsdf->pdf(bRec);
                         };
 
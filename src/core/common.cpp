@@ -8,6 +8,7 @@
 #include <Eigen/Geometry>
 #include <Eigen/LU>
 #include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
 #include <iomanip>
 
 #if defined(PLATFORM_LINUX)
@@ -22,6 +23,12 @@
 #include <sys/sysctl.h>
 #endif
 
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
 NORI_NAMESPACE_BEGIN
 
 std::string indent(const std::string &string, int amount) {
@@ -141,6 +148,25 @@ std::string timeString(double time, bool precise) {
     return os.str();
 }
 
+double getProcessCPUTime() {
+#if defined(_WIN32)
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+        return 0.0;
+    /* FILETIME values are given in units of 100 nanoseconds */
+    auto toMs = [](const FILETIME &t) {
+        return (((uint64_t) t.dwHighDateTime << 32) | t.dwLowDateTime) * 1e-4;
+    };
+    return toMs(kernelTime) + toMs(userTime);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0.0;
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-3;
+#endif
+}
+
 std::string memString(size_t size, bool precise) {
     double value = (double) size;
     const char *suffixes[] = {
@@ -158,6 +184,51 @@ std::string memString(size_t size, bool precise) {
     return os.str();
 }
 
+namespace {
+    /// Final mixing step of SplitMix64
+    inline uint64_t mix(uint64_t h) {
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebull;
+        h ^= h >> 31;
+        return h;
+    }
+
+    /// Hash a contiguous block of memory, 8 bytes at a time
+    uint64_t hashBlock(const uint8_t *data, size_t size) {
+        uint64_t h = 0;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            h = (((h << 23) | (h >> 41)) ^ word) * 0x9e3779b97f4a7c15ull;
+        }
+        if (i < size) {
+            uint64_t word = 0;
+            memcpy(&word, data + i, size - i);
+            h = (((h << 23) | (h >> 41)) ^ word) * 0x9e3779b97f4a7c15ull;
+        }
+        return mix(h ^ size);
+    }
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed) {
+    /* Blocks are hashed in parallel and combined in order */
+    const size_t blockSize = 1 << 20;
+    size_t nBlocks = (size + blockSize - 1) / blockSize;
+    std::vector<uint64_t> blockHashes(nBlocks);
+    tbb::parallel_for(size_t(0), nBlocks, [&](size_t b) {
+        size_t offset = b * blockSize;
+        blockHashes[b] = hashBlock((const uint8_t *) data + offset, std::min(blockSize, size - offset));
+    });
+
+    uint64_t h = mix(seed ^ size);
+    for (uint64_t blockHash : blockHashes)
+        h = mix(h ^ blockHash);
+    return h;
+}
+
 filesystem::resolver *getFileResolver() {
     static filesystem::resolver *resolver = new filesystem::resolver();
     return resolver;
@@ -0,0 +1,58 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <objects/instance.h>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &propList) {
+    m_toWorld = propList.getTransform("toWorld", Transform());
+}
+
+void Instance::addChild(NoriObject *obj) {
+    switch (obj->getClassType()) {
+        case EMesh:
+            if (m_mesh)
+                throw NoriException(
+                    "Instance: tried to reference multiple meshes!");
+            m_mesh = static_cast<Mesh *>(obj);
+            if (m_mesh->isEmitter())
+                throw NoriException(
+                    "Instance: meshes with an attached emitter cannot be instanced!");
+            break;
+
+        default:
+            throw NoriException("Instance::addChild(<%s>) is not supported!",
+                                classTypeName(obj->getClassType()));
+    }
+}
+
+void Instance::activate() {
+    if (!m_mesh)
+        throw NoriException("Instance: no mesh was referenced!");
+}
+
+BoundingBox3f Instance::getBoundingBox() const {
+    const BoundingBox3f &bbox = m_mesh->getBoundingBox();
+    BoundingBox3f result;
+    for (int i = 0; i < 8; ++i)
+        result.expandBy(m_toWorld * bbox.getCorner(i));
+    return result;
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  mesh = \"%s\",\n"
+        "  toWorld = %s\n"
+        "]",
+        m_mesh ? m_mesh->getName() : std::string("null"),
+        indent(m_toWorld.toString(), 12)
+    );
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
@@ -0,0 +1,351 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <core/kdtree.h>
+#include <tools/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/task_arena.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Subtrees with more triangle references than this build their two children in parallel
+static const size_t KDParallelBuildThreshold = 4096;
+
+namespace {
+    /// Start or end of the bounding box of a triangle along one axis
+    struct BoundEdge {
+        float t;
+        uint32_t prim;
+        bool start;
+
+        bool operator<(const BoundEdge &e) const {
+            /* Starting edges come first if the positions coincide */
+            if (t != e.t)
+                return t < e.t;
+            return start && !e.start;
+        }
+    };
+}
+
+KDTree::KDTree(const PropertyList &propList) {
+    m_traversalCost = propList.getFloat("traversalCost", 1.f);
+    m_intersectionCost = propList.getFloat("intersectionCost", 80.f);
+    m_emptyBonus = propList.getFloat("emptyBonus", 0.5f);
+    int maxLeafSize = propList.getInteger("maxLeafSize", 1);
+    m_maxDepth = propList.getInteger("maxDepth", -1);
+
+    if (m_traversalCost < 0.f || m_intersectionCost <= 0.f)
+        throw NoriException("KDTree: invalid SAH traversal/intersection costs!");
+    if (m_emptyBonus < 0.f || m_emptyBonus >= 1.f)
+        throw NoriException("KDTree: the empty bonus must be in [0, 1)!");
+    if (maxLeafSize < 1)
+        throw NoriException("KDTree: the maximum leaf size must be positive!");
+    if (m_maxDepth != -1 && (m_maxDepth < 0 || m_maxDepth > MaxTreeDepth))
+        throw NoriException("KDTree: the maximum depth must be in [0, %i]!", (int) MaxTreeDepth);
+    m_maxLeafSize = (uint32_t) maxLeafSize;
+}
+
+void KDTree::addInstance(const Instance *) {
+    throw NoriException("KDTree: mesh instances are not supported, use the \"bvh\" accelerator instead!");
+}
+
+void KDTree::build() {
+    m_nodes.clear();
+    m_triRefs.clear();
+
+    /* The meshes may have moved since they were registered (see \ref update()) */
+    m_bbox.reset();
+    for (const Mesh *mesh : m_meshes)
+        m_bbox.expandBy(mesh->getBoundingBox());
+
+    /* Global triangle indices are mapped back to (mesh, triangle) pairs */
+    std::vector<uint32_t> meshOffset(m_meshes.size() + 1, 0);
+    for (size_t i = 0; i < m_meshes.size(); ++i)
+        meshOffset[i + 1] = meshOffset[i] + m_meshes[i]->getTriangleCount();
+    uint32_t triCount = meshOffset.back();
+    if (triCount == 0)
+        return;
+
+    m_builtDepth = m_maxDepth;
+    if (m_builtDepth < 0)
+        m_builtDepth = std::min((int) std::round(8 + 1.3f * std::log2((float) triCount)), (int) MaxTreeDepth);
+
+    cout << "Building kd-tree (max. depth " << m_builtDepth << ", "
+         << tbb::this_task_arena::max_concurrency() << " threads) .. ";
+    cout.flush();
+    Timer timer;
+    double cpuStart = getProcessCPUTime();
+
+    std::vector<BoundingBox3f> primBounds(triCount);
+    std::vector<TriangleRef> triangles(triCount);
+    tbb::parallel_for(size_t(0), m_meshes.size(), [&](size_t i) {
+        const Mesh *mesh = m_meshes[i];
+        for (uint32_t f = 0; f < mesh->getTriangleCount(); ++f) {
+            primBounds[meshOffset[i] + f] = mesh->getBoundingBox(f);
+            triangles[meshOffset[i] + f] = { (uint32_t) i, f };
+        }
+    });
+
+    std::vector<uint32_t> prims(triCount);
+    for (uint32_t i = 0; i < triCount; ++i)
+        prims[i] = i;
+
+    Subtree tree;
+    buildTree(tree, primBounds, m_bbox, prims, m_builtDepth, 0);
+
+    m_nodes.swap(tree.nodes);
+    m_triRefs.resize(tree.prims.size());
+    for (size_t i = 0; i < tree.prims.size(); ++i)
+        m_triRefs[i] = triangles[tree.prims[i]];
+    m_nodes.shrink_to_fit();
+
+    double elapsed = timer.elapsed();
+    double cpuTime = getProcessCPUTime() - cpuStart;
+
+    cout << "done. (" << m_nodes.size() << " nodes, "
+         << m_triRefs.size() << " references to " << triCount << " triangles, took "
+         << timeString(elapsed) << ", "
+         << tfm::format("%.1fx", elapsed > 0 ? cpuTime / elapsed : 1.0)
+         << " parallel speedup, "
+         << memString(m_nodes.size() * sizeof(KDNode) + m_triRefs.size() * sizeof(TriangleRef))
+         << ")" << endl;
+}
+
+void KDTree::buildTree(Subtree &tree, const std::vector<BoundingBox3f> &primBounds, const BoundingBox3f &bounds,
+                       std::vector<uint32_t> &prims, int depth, int badRefines) const {
+    uint32_t nodeIdx = (uint32_t) tree.nodes.size();
+    tree.nodes.emplace_back();
+    size_t primCount = prims.size();
+
+    auto makeLeaf = [&]() {
+        KDNode &node = tree.nodes[nodeIdx];
+        node.primOffset = (uint32_t) tree.prims.size();
+        node.flags = ((uint32_t) primCount << 2) | 3;
+        tree.prims.insert(tree.prims.end(), prims.begin(), prims.end());
+    };
+
+    if (primCount <= m_maxLeafSize || depth == 0) {
+        makeLeaf();
+        return;
+    }
+
+    /* Sweep over the sorted bounding box edges along every axis and find
+       the split plane with the smallest SAH cost */
+    Vector3f extents = bounds.getExtents();
+    float invTotalArea = 1.f / bounds.getSurfaceArea();
+    float leafCost = m_intersectionCost * primCount;
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1;
+    size_t bestOffset = 0;
+
+    std::vector<BoundEdge> edges[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        std::vector<BoundEdge> &e = edges[axis];
+        e.resize(2 * primCount);
+        for (size_t i = 0; i < primCount; ++i) {
+            const BoundingBox3f &bbox = primBounds[prims[i]];
+            e[2 * i] = { bbox.min[axis], prims[i], true };
+            e[2 * i + 1] = { bbox.max[axis], prims[i], false };
+        }
+        std::sort(e.begin(), e.end());
+
+        int axis1 = (axis + 1) % 3, axis2 = (axis + 2) % 3;
+        size_t nBelow = 0, nAbove = primCount;
+        for (size_t i = 0; i < 2 * primCount; ++i) {
+            if (!e[i].start)
+                --nAbove;
+            float t = e[i].t;
+            if (t > bounds.min[axis] && t < bounds.max[axis]) {
+                /* Surface areas of the two children relative to the parent */
+                float below = t - bounds.min[axis], above = bounds.max[axis] - t;
+                float cap = extents[axis1] * extents[axis2];
+                float side = extents[axis1] + extents[axis2];
+                float pBelow = 2.f * (cap + below * side) * invTotalArea;
+                float pAbove = 2.f * (cap + above * side) * invTotalArea;
+                float bonus = (nBelow == 0 || nAbove == 0) ? m_emptyBonus : 0.f;
+                float cost = m_traversalCost +
+                    m_intersectionCost * (1.f - bonus) * (pBelow * nBelow + pAbove * nAbove);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestOffset = i;
+                }
+            }
+            if (e[i].start)
+                ++nBelow;
+        }
+    }
+
+    /* Tolerate a few splits that do not pay off on their own, since
+       they might enable good splits further down */
+    if (bestCost > leafCost)
+        ++badRefines;
+    if ((bestCost > 4.f * leafCost && primCount < 16) || bestAxis == -1 || badRefines == 3) {
+        makeLeaf();
+        return;
+    }
+
+    /* Triangles that start below the plane go to the first child, those
+       that end above it to the second one (straddling triangles to both) */
+    const std::vector<BoundEdge> &e = edges[bestAxis];
+    float split = e[bestOffset].t;
+    std::vector<uint32_t> primsBelow, primsAbove;
+    for (size_t i = 0; i < bestOffset; ++i) {
+        if (e[i].start)
+            primsBelow.push_back(e[i].prim);
+    }
+    for (size_t i = bestOffset + 1; i < 2 * primCount; ++i) {
+        if (!e[i].start)
+            primsAbove.push_back(e[i].prim);
+    }
+    for (int axis = 0; axis < 3; ++axis)
+        std::vector<BoundEdge>().swap(edges[axis]);
+    std::vector<uint32_t>().swap(prims);
+
+    BoundingBox3f boundsBelow(bounds), boundsAbove(bounds);
+    boundsBelow.max[bestAxis] = boundsAbove.min[bestAxis] = split;
+    tree.nodes[nodeIdx].split = split;
+
+    if (primCount > KDParallelBuildThreshold) {
+        /* Build the second child into a separate tree and append it */
+        Subtree above;
+        tbb::parallel_invoke(
+            [&] { buildTree(tree, primBounds, boundsBelow, primsBelow, depth - 1, badRefines); },
+            [&] { buildTree(above, primBounds, boundsAbove, primsAbove, depth - 1, badRefines); }
+        );
+
+        uint32_t nodeOffset = (uint32_t) tree.nodes.size();
+        uint32_t primOffset = (uint32_t) tree.prims.size();
+        for (KDNode node : above.nodes) {
+            if (node.isLeaf())
+                node.primOffset += primOffset;
+            else
+                node.flags += nodeOffset << 2;
+            tree.nodes.push_back(node);
+        }
+        tree.prims.insert(tree.prims.end(), above.prims.begin(), above.prims.end());
+        tree.nodes[nodeIdx].flags = (nodeOffset << 2) | (uint32_t) bestAxis;
+    } else {
+        buildTree(tree, primBounds, boundsBelow, primsBelow, depth - 1, badRefines);
+        uint32_t aboveIdx = (uint32_t) tree.nodes.size();
+        tree.nodes[nodeIdx].flags = (aboveIdx << 2) | (uint32_t) bestAxis;
+        buildTree(tree, primBounds, boundsAbove, primsAbove, depth - 1, badRefines);
+    }
+}
+
+template <bool ShadowRay> bool KDTree::traverse(Ray3f &ray, Intersection *its) const {
+    /* Clip the ray segment against the scene bounds */
+    float tMin, tMax;
+    NORI_TRAVERSAL_COUNT(boxTests, 1);
+    if (m_nodes.empty() || !m_bbox.rayIntersect(ray, tMin, tMax))
+        return false;
+    tMin = std::max(tMin, ray.mint);
+    tMax = std::min(tMax, ray.maxt);
+    if (tMin > tMax)
+        return false;
+
+    struct StackEntry {
+        uint32_t node;
+        float tMin, tMax;
+    };
+    StackEntry stack[MaxTreeDepth];
+    int stackSize = 0;
+
+    bool intersected = false;
+    uint32_t nodeIdx = 0;
+
+    while (true) {
+        /* Stop as soon as the closest intersection lies before the node */
+        if (ray.maxt < tMin)
+            return intersected;
+
+        const KDNode &node = m_nodes[nodeIdx];
+        if (!node.isLeaf()) {
+            NORI_TRAVERSAL_COUNT(nodes, 1);
+            int axis = node.axis();
+            float tPlane = (node.split - ray.o[axis]) * ray.dRcp[axis];
+
+            /* Visit the child on the side of the ray origin first */
+            bool belowFirst = ray.o[axis] < node.split ||
+                (ray.o[axis] == node.split && ray.d[axis] <= 0);
+            uint32_t first = nodeIdx + 1, second = node.aboveChild();
+            if (!belowFirst)
+                std::swap(first, second);
+
+            if (tPlane > tMax || tPlane <= 0) {
+                nodeIdx = first;
+            } else if (tPlane < tMin) {
+                nodeIdx = second;
+            } else {
+                stack[stackSize++] = { second, tPlane, tMax };
+                nodeIdx = first;
+                tMax = tPlane;
+            }
+            continue;
+        }
+
+        for (uint32_t i = 0; i < node.primCount(); ++i) {
+            const TriangleRef &ref = m_triRefs[node.primOffset + i];
+            const Mesh *mesh = m_meshes[ref.meshIdx];
+            float u, v, t;
+            NORI_TRAVERSAL_COUNT(triangleTests, 1);
+            if (mesh->rayIntersect(ref.triIdx, ray, u, v, t)) {
+                if (ShadowRay)
+                    return true;
+                ray.maxt = its->t = t;
+                its->uv = Point2f(u, v);
+                its->mesh = mesh;
+                its->f = ref.triIdx;
+                intersected = true;
+            }
+        }
+
+        if (stackSize == 0)
+            return intersected;
+        const StackEntry &entry = stack[--stackSize];
+        nodeIdx = entry.node;
+        tMin = entry.tMin;
+        tMax = entry.tMax;
+    }
+}
+
+bool KDTree::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
+    if (shadowRay)
+        return occluded(ray_);
+    NORI_TRAVERSAL_COUNT(rays, 1);
+
+    its.f = (uint32_t) -1;
+    its.t = std::numeric_limits<float>::infinity();
+    its.toWorld = nullptr;
+
+    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+    return traverse<false>(ray, &its);
+}
+
+bool KDTree::occluded(const Ray3f &ray_) const {
+    NORI_TRAVERSAL_COUNT(rays, 1);
+    Ray3f ray(ray_);
+    return traverse<true>(ray, nullptr);
+}
+
+std::string KDTree::toString() const {
+    return tfm::format(
+        "KDTree[\n"
+        "  traversalCost = %f,\n"
+        "  intersectionCost = %f,\n"
+        "  emptyBonus = %f,\n"
+        "  maxLeafSize = %i,\n"
+        "  maxDepth = %i,\n"
+        "  meshes = %i\n"
+        "]",
+        m_traversalCost, m_intersectionCost, m_emptyBonus,
+        m_maxLeafSize, m_maxDepth, m_meshes.size()
+    );
+}
+
+NORI_REGISTER_CLASS(KDTree, "kdtree");
+NORI_NAMESPACE_END
@@ -35,24 +35,45 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
-    /* For each pixel and pixel sample sample */
-    for (int y = 0; y < size.y(); ++y) {
-        for (int x = 0; x < size.x(); ++x) {
-            for (uint32_t i = 0; i < sampler->getSampleCount(); ++i) {
-                Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
-                Point2f apertureSample = sampler->next2D();
-
-                /* Sample a ray from the camera */
-                Ray3f ray;
-                Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
-
-                /* Compute the incident radiance */
-                value *= integrator->Li(scene, sampler, ray);
-
-                /* Store in the image block */
-                block.put(pixelSample, value);
+    /* Storage for the camera rays of all pixels of the block */
+    const int PacketSize = 4;
+    static_assert(PacketSize * PacketSize <= Accel::MaxPacketSize, "Packet tiles must fit into a ray packet");
+    size_t pixelCount = (size_t) size.x() * size.y();
+    std::vector<Point2f> pixelSamples(pixelCount);
+    std::vector<Ray3f> rays(pixelCount);
+    std::vector<Color3f> weights(pixelCount), values(pixelCount);
+    std::vector<Intersection> its(pixelCount);
+    std::unique_ptr<bool[]> hits(new bool[pixelCount]);
+
+    for (uint32_t i = 0; i < sampler->getSampleCount(); ++i) {
+        /* Trace the camera rays of each tile of PacketSize x PacketSize pixels as a packet */
+        size_t count = 0;
+        for (int ty = 0; ty < size.y(); ty += PacketSize) {
+            for (int tx = 0; tx < size.x(); tx += PacketSize) {
+                size_t first = count;
+                for (int y = ty; y < std::min(ty + PacketSize, size.y()); ++y) {
+                    for (int x = tx; x < std::min(tx + PacketSize, size.x()); ++x) {
+                        pixelSamples[count] = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                        Point2f apertureSample = sampler->next2D();
+                        weights[count] = camera->sampleRay(rays[count], pixelSamples[count], apertureSample);
+                        ++count;
+                    }
+                }
+
+                /* Find the visible surfaces of all rays at once */
+                uint32_t packetHits = scene->rayIntersectPacket(&rays[first], &its[first], (uint32_t) (count - first));
+                for (size_t r = first; r < count; ++r)
+                    hits[r] = (packetHits & (1u << (r - first))) != 0;
             }
         }
+
+        /* Compute the incident radiance for the whole block, so that the
+           integrator can trace its secondary rays as a stream */
+        integrator->LiPrimaryStream(scene, sampler, rays.data(), its.data(), hits.get(), values.data(), count);
+
+        /* Store in the image block */
+        for (size_t r = 0; r < count; ++r)
+            block.put(pixelSamples[r], weights[r] * values[r]);
     }
 }
 
@@ -117,6 +138,9 @@ static void render(Scene *scene, const std::string &filename) {
         // map(range);
 
         cout << "done. (took " << timer.elapsedString() << ")" << endl;
+
+        /* Only prints anything if compiled with NORI_TRAVERSAL_STATS */
+        Accel::printTraversalStatistics();
     });
 
     /* Enter the application main loop */
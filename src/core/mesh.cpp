@@ -12,9 +12,40 @@
 #include <tools/dpdf.h>
 #include <objects/texture.h>
 #include <Eigen/Geometry>
+#include <tbb/parallel_for.h>
+#include <half.h>
+#include <atomic>
 
 NORI_NAMESPACE_BEGIN
 
+/// Encode a unit vector as two 16-bit coordinates of the octahedron map
+static uint32_t encodeOctahedral(const Vector3f &n) {
+    Vector3f d = n / (std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z()));
+    float x = d.x(), y = d.y();
+    if (d.z() < 0) {
+        /* Fold the lower hemisphere over the diagonals */
+        x = (1 - std::abs(d.y())) * (d.x() >= 0 ? 1 : -1);
+        y = (1 - std::abs(d.x())) * (d.y() >= 0 ? 1 : -1);
+    }
+    auto quantize = [](float value) {
+        return (uint32_t) (uint16_t) (int16_t) std::round(clamp(value, -1.f, 1.f) * 32767.f);
+    };
+    return quantize(x) | (quantize(y) << 16);
+}
+
+/// Decode a unit vector encoded by \ref encodeOctahedral()
+static Vector3f decodeOctahedral(uint32_t value) {
+    float x = (int16_t) (value & 0xFFFF) * (1.f / 32767.f);
+    float y = (int16_t) (value >> 16) * (1.f / 32767.f);
+    float z = 1 - std::abs(x) - std::abs(y);
+    if (z < 0) {
+        float fx = x;
+        x = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+        y = (1 - std::abs(fx)) * (y >= 0 ? 1 : -1);
+    }
+    return Vector3f(x, y, z).normalized();
+}
+
 Mesh::Mesh() { }
 
 Mesh::~Mesh() {
@@ -36,17 +67,138 @@ void Mesh::activate() {
         m_areaDP.append(surfaceArea(idx));
     }
     m_areaDP.normalize();
+
+    if (m_compact || m_compactIndices)
+        compact();
+}
+
+void Mesh::applyTransform(const Transform &trafo) {
+    if (trafo.getMatrix() == Eigen::Matrix4f::Identity())
+        return;
+
+    tbb::parallel_for(Eigen::Index(0), m_V.cols(), [&](Eigen::Index i) {
+        /* Copy the components one by one, assigning the 3-vectors to the
+           matrix columns triggers spurious -Warray-bounds warnings (GCC 12) */
+        Point3f p = trafo * Point3f(m_V.col(i));
+        for (int k = 0; k < 3; ++k)
+            m_V(k, i) = p[k];
+        if (m_N.size() > 0) {
+            Normal3f n = trafo * Normal3f(m_N.col(i));
+            n.normalize();
+            for (int k = 0; k < 3; ++k)
+                m_N(k, i) = n[k];
+        }
+    });
+    m_bbox.reset();
+    for (Eigen::Index i = 0; i < m_V.cols(); ++i)
+        m_bbox.expandBy(Point3f(m_V.col(i)));
+}
+
+void Mesh::setStorageOptions(const PropertyList &propList) {
+    m_compact = propList.getBoolean("compact", false);
+    m_compactIndices = propList.getBoolean("compactIndices", m_compact);
+}
+
+void Mesh::compact() {
+    size_t oldSize = getStorageSize();
+
+    if (m_compact && m_N.size() > 0) {
+        m_octN.resize(m_N.cols());
+        tbb::parallel_for(Eigen::Index(0), m_N.cols(), [&](Eigen::Index i) {
+            m_octN[i] = encodeOctahedral(m_N.col(i));
+        });
+        m_N.resize(3, 0);
+    }
+
+    if (m_compact && m_UV.size() > 0) {
+        m_halfUV.resize(m_UV.size());
+        tbb::parallel_for(Eigen::Index(0), m_UV.size(), [&](Eigen::Index i) {
+            m_halfUV[i] = half(m_UV.data()[i]).bits();
+        });
+        m_UV.resize(2, 0);
+    }
+
+    if (m_compactIndices && m_F.size() > 0) {
+        uint32_t meshletCount = (getTriangleCount() + MeshletSize - 1) / MeshletSize;
+        std::vector<uint32_t> base(meshletCount);
+        std::atomic<bool> fits(true);
+        tbb::parallel_for(uint32_t(0), meshletCount, [&](uint32_t m) {
+            Eigen::Index start = m * MeshletSize,
+                         count = std::min(m_F.cols() - start, (Eigen::Index) MeshletSize);
+            auto block = m_F.middleCols(start, count);
+            base[m] = block.minCoeff();
+            if (block.maxCoeff() - base[m] > 0xFFFF)
+                fits = false;
+        });
+
+        if (fits) {
+            m_localF.resize(m_F.size());
+            tbb::parallel_for(Eigen::Index(0), m_F.cols(), [&](Eigen::Index f) {
+                for (int i = 0; i < 3; ++i)
+                    m_localF[3 * f + i] = (uint16_t) (m_F(i, f) - base[f / MeshletSize]);
+            });
+            m_meshletBase = std::move(base);
+            m_F.resize(3, 0);
+        } else {
+            cerr << "Mesh: the triangles of \"" << m_name << "\" reference vertices that are too far "
+                    "apart for 16-bit indices, keeping 32-bit indices" << endl;
+        }
+    }
+
+    size_t newSize = getStorageSize();
+    cout << tfm::format("Compacted \"%s\" from %s to %s (saved %s)\n", m_name,
+        memString(oldSize), memString(newSize), memString(oldSize - newSize));
+}
+
+Normal3f Mesh::getVertexNormal(uint32_t index) const {
+    if (!m_octN.empty())
+        return decodeOctahedral(m_octN[index]);
+    return m_N.col(index);
+}
+
+Point2f Mesh::getVertexTexCoord(uint32_t index) const {
+    if (!m_halfUV.empty()) {
+        half u, v;
+        u.setBits(m_halfUV[2 * (size_t) index]);
+        v.setBits(m_halfUV[2 * (size_t) index + 1]);
+        return Point2f(u, v);
+    }
+    return m_UV.col(index);
+}
+
+size_t Mesh::getStorageSize() const {
+    return sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()) + sizeof(uint32_t) * m_F.size() +
+        sizeof(uint32_t) * (m_octN.size() + m_meshletBase.size()) +
+        sizeof(uint16_t) * (m_halfUV.size() + m_localF.size());
+}
+
+void Mesh::setVertexPositions(const MatrixXf &V) {
+    if (V.rows() != 3 || V.cols() != m_V.cols())
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertex positions!", m_V.cols());
+    m_V = V;
+
+    m_bbox.reset();
+    for (uint32_t i = 0; i < getVertexCount(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+
+    /* Update the area distribution if it was already initialized */
+    if (m_areaDP.size() > 0) {
+        m_areaDP.clear();
+        for (uint32_t idx = 0; idx < getTriangleCount(); ++idx)
+            m_areaDP.append(surfaceArea(idx));
+        m_areaDP.normalize();
+    }
 }
 
 float Mesh::surfaceArea(uint32_t index) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    Vector3u f = getTriangleIndices(index);
+    const Point3f p0 = m_V.col(f[0]), p1 = m_V.col(f[1]), p2 = m_V.col(f[2]);
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    Vector3u f = getTriangleIndices(index);
+    const Point3f p0 = m_V.col(f[0]), p1 = m_V.col(f[1]), p2 = m_V.col(f[2]);
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
@@ -84,17 +236,19 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    Vector3u f = getTriangleIndices(index);
+    BoundingBox3f result(m_V.col(f[0]));
+    result.expandBy(m_V.col(f[1]));
+    result.expandBy(m_V.col(f[2]));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
+    Vector3u f = getTriangleIndices(index);
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (m_V.col(f[0]) +
+         m_V.col(f[1]) +
+         m_V.col(f[2]));
 }
 
 std::tuple<Point3f, Vector3f> Mesh::getSampleResult(const Point3f &sample) const {
@@ -107,17 +261,18 @@ std::tuple<Point3f, Vector3f> Mesh::getSampleResult(const Point3f &sample) const
     float w = 1 - u - v;
 
     /* Get triangle information */
-    Point3f v0 = m_V.col(m_F(0, idx));
-    Point3f v1 = m_V.col(m_F(1, idx));
-    Point3f v2 = m_V.col(m_F(2, idx));
+    Vector3u f = getTriangleIndices(idx);
+    Point3f v0 = m_V.col(f[0]);
+    Point3f v1 = m_V.col(f[1]);
+    Point3f v2 = m_V.col(f[2]);
     Point3f p = u * v0 + v * v1 + w * v2;
 
     Vector3f n;
     /* If vertex normal exists */
-    if (m_N.size() != 0) {
-        Vector3f n0 = m_N.col(m_F(0, idx));
-        Vector3f n1 = m_N.col(m_F(1, idx));
-        Vector3f n2 = m_N.col(m_F(2, idx));
+    if (hasVertexNormals()) {
+        Vector3f n0 = getVertexNormal(f[0]);
+        Vector3f n1 = getVertexNormal(f[1]);
+        Vector3f n2 = getVertexNormal(f[2]);
         n = (u * n0 + v * n1 + w * n2).normalized();
     } else {
         Vector3f e1 = v1 - v0;
@@ -160,33 +315,130 @@ std::string Mesh::toString() const {
         "  emitter = %s\n"
         "]",
         m_name,
-        m_V.cols(),
-        m_F.cols(),
+        getVertexCount(),
+        getTriangleCount(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
 }
 
+const Point3f &SurfaceInteraction::getPosition() const {
+    if (!(m_valid & EPosition)) {
+        if (m_its.mesh) {
+            /* Compute the intersection positon accurately
+               using barycentric coordinates */
+            const MatrixXf &V = m_its.mesh->getVertexPositions();
+            Vector3u f = m_its.mesh->getTriangleIndices(m_its.f);
+            float u = m_its.uv.x(), v = m_its.uv.y();
+            m_p = (1 - u - v) * V.col(f[0]) + u * V.col(f[1]) + v * V.col(f[2]);
+            if (m_its.toWorld)
+                m_p = *m_its.toWorld * m_p;
+        } else {
+            m_p = Point3f::Zero();
+        }
+        m_valid |= EPosition;
+    }
+    return m_p;
+}
+
+const Point2f &SurfaceInteraction::getTexCoords() const {
+    if (!(m_valid & ETexCoords)) {
+        /* Compute proper texture coordinates if provided by the mesh */
+        if (m_its.mesh && m_its.mesh->hasVertexTexCoords()) {
+            const Mesh *mesh = m_its.mesh;
+            Vector3u f = mesh->getTriangleIndices(m_its.f);
+            float u = m_its.uv.x(), v = m_its.uv.y();
+            m_uv = (1 - u - v) * mesh->getVertexTexCoord(f[0]) + u * mesh->getVertexTexCoord(f[1]) +
+                   v * mesh->getVertexTexCoord(f[2]);
+        } else {
+            m_uv = Point2f(0.f, 0.f);
+        }
+        m_valid |= ETexCoords;
+    }
+    return m_uv;
+}
+
+const Frame &SurfaceInteraction::getGeometricFrame() const {
+    if (!(m_valid & EGeometricFrame)) {
+        if (m_its.mesh) {
+            const MatrixXf &V = m_its.mesh->getVertexPositions();
+            Vector3u f = m_its.mesh->getTriangleIndices(m_its.f);
+            Point3f p0 = V.col(f[0]), p1 = V.col(f[1]), p2 = V.col(f[2]);
+            Normal3f n((p1 - p0).cross(p2 - p0));
+            if (m_its.toWorld)
+                n = *m_its.toWorld * n;
+            m_geoFrame = Frame(n.normalized());
+        } else {
+            m_geoFrame = Frame(Vector3f(0.f, 0.f, 1.f));
+        }
+        m_valid |= EGeometricFrame;
+    }
+    return m_geoFrame;
+}
+
+const Frame &SurfaceInteraction::getShadingFrame() const {
+    if (!(m_valid & EShadingFrame)) {
+        if (m_its.mesh && m_its.mesh->hasVertexNormals()) {
+            /* Compute the shading frame. Note that for simplicity,
+               the current implementation doesn't attempt to provide
+               tangents that are continuous across the surface. That
+               means that this code will need to be modified to be able
+               use anisotropic BRDFs, which need tangent continuity */
+            const Mesh *mesh = m_its.mesh;
+            Vector3u f = mesh->getTriangleIndices(m_its.f);
+            float u = m_its.uv.x(), v = m_its.uv.y();
+            Normal3f n((1 - u - v) * mesh->getVertexNormal(f[0]) +
+                       u * mesh->getVertexNormal(f[1]) +
+                       v * mesh->getVertexNormal(f[2]));
+            if (m_its.toWorld)
+                n = *m_its.toWorld * n;
+            m_shFrame = Frame(n.normalized());
+        } else {
+            m_shFrame = getGeometricFrame();
+        }
+        m_valid |= EShadingFrame;
+    }
+    return m_shFrame;
+}
+
 std::string Intersection::toString() const {
     if (!mesh)
         return "Intersection[invalid]";
 
     return tfm::format(
         "Intersection[\n"
-        "  p = %s,\n"
         "  t = %f,\n"
         "  uv = %s,\n"
-        "  shFrame = %s,\n"
-        "  geoFrame = %s,\n"
+        "  f = %i,\n"
         "  mesh = %s\n"
         "]",
-        p.toString(),
         t,
         uv.toString(),
-        indent(shFrame.toString()),
-        indent(geoFrame.toString()),
+        f,
         mesh ? mesh->toString() : std::string("null")
     );
 }
 
+std::string SurfaceInteraction::toString() const {
+    if (!m_its.mesh)
+        return "SurfaceInteraction[invalid]";
+
+    return tfm::format(
+        "SurfaceInteraction[\n"
+        "  p = %s,\n"
+        "  t = %f,\n"
+        "  uv = %s,\n"
+        "  shFrame = %s,\n"
+        "  geoFrame = %s,\n"
+        "  mesh = %s\n"
+        "]",
+        getPosition().toString(),
+        m_its.t,
+        getTexCoords().toString(),
+        indent(getShadingFrame().toString()),
+        indent(getGeometricFrame().toString()),
+        m_its.mesh->toString()
+    );
+}
+
 NORI_NAMESPACE_END
@@ -0,0 +1,92 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <tools/mmap.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+#if defined(_WIN32)
+
+MemoryMappedFile::MemoryMappedFile(const std::string &filename) {
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        m_file = nullptr;
+        throw NoriException("MemoryMappedFile: unable to open \"%s\"!", filename);
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size)) {
+        CloseHandle(m_file);
+        throw NoriException("MemoryMappedFile: unable to determine the size of \"%s\"!", filename);
+    }
+    m_size = (size_t) size.QuadPart;
+    if (m_size == 0)
+        return;
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_data = (const uint8_t *) MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_data) {
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw NoriException("MemoryMappedFile: unable to map \"%s\"!", filename);
+    }
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file)
+        CloseHandle(m_file);
+}
+
+#else
+
+MemoryMappedFile::MemoryMappedFile(const std::string &filename) {
+    m_fd = open(filename.c_str(), O_RDONLY);
+    if (m_fd < 0)
+        throw NoriException("MemoryMappedFile: unable to open \"%s\"!", filename);
+
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) {
+        close(m_fd);
+        throw NoriException("MemoryMappedFile: unable to determine the size of \"%s\"!", filename);
+    }
+    m_size = (size_t) st.st_size;
+    if (m_size == 0)
+        return;
+
+    void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (data == MAP_FAILED) {
+        close(m_fd);
+        throw NoriException("MemoryMappedFile: unable to map \"%s\"!", filename);
+    }
+    m_data = (const uint8_t *) data;
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+    if (m_data)
+        munmap((void *) m_data, m_size);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+#endif
+
+NORI_NAMESPACE_END
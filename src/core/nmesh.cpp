@@ -0,0 +1,188 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <objects/mesh.h>
+#include <tools/mmap.h>
+#include <tools/timer.h>
+#include <filesystem/resolver.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+NORI_NAMESPACE_BEGIN
+
+/// Version of the binary mesh format
+static const uint32_t MeshFileVersion = 1;
+
+/// Alignment of the arrays stored in a binary mesh file
+static const size_t MeshFileAlignment = 64;
+
+namespace {
+    /**
+     * \brief Header of a binary mesh file
+     *
+     * The header is followed by the vertex positions, normals, texture
+     * coordinates (3, 3 and 2 floats per vertex, normals and texture
+     * coordinates are optional) and the faces (3 indices each). Every
+     * array starts at a multiple of \ref MeshFileAlignment bytes and is
+     * stored in the column-major layout of the \ref Mesh matrices.
+     */
+    struct MeshFileHeader {
+        char magic[8];          ///< "NORIMSH"
+        uint32_t version;       ///< File format version
+        uint32_t flags;         ///< 1: has normals, 2: has texture coordinates
+        uint64_t key;           ///< Identifies the source of the mesh (zero if unknown)
+        uint64_t checksum;      ///< Hash of the stored arrays
+        uint64_t vertexCount;
+        uint64_t faceCount;
+        float bboxMin[3];
+        float bboxMax[3];
+    };
+
+    inline size_t alignOffset(size_t offset) {
+        return (offset + MeshFileAlignment - 1) / MeshFileAlignment * MeshFileAlignment;
+    }
+}
+
+void Mesh::loadBinaryMesh(const std::string &filename, uint64_t key) {
+    MemoryMappedFile file(filename);
+    const uint8_t *data = file.getData();
+
+    MeshFileHeader header;
+    if (file.getSize() < sizeof(MeshFileHeader))
+        throw NoriException("\"%s\" is not a binary mesh (truncated header)!", filename);
+    memcpy(&header, data, sizeof(MeshFileHeader));
+    if (strncmp(header.magic, "NORIMSH", 8) != 0 || header.version != MeshFileVersion)
+        throw NoriException("\"%s\" is not a binary mesh (unknown file format)!", filename);
+    if (key != 0 && header.key != key)
+        throw NoriException("\"%s\" belongs to a different source file!", filename);
+
+    /* Reject counts that cannot fit into the file before computing the
+       array sizes, which could otherwise wrap around */
+    if (header.vertexCount > file.getSize() / (3 * sizeof(float)) ||
+        header.faceCount > file.getSize() / (3 * sizeof(uint32_t)))
+        throw NoriException("\"%s\" has an unexpected size!", filename);
+
+    /* Positions, normals, texture coordinates and faces */
+    const size_t sizes[4] = {
+        header.vertexCount * 3 * sizeof(float),
+        (header.flags & 1) ? header.vertexCount * 3 * sizeof(float) : 0,
+        (header.flags & 2) ? header.vertexCount * 2 * sizeof(float) : 0,
+        header.faceCount * 3 * sizeof(uint32_t)
+    };
+    size_t offsets[4], offset = sizeof(MeshFileHeader);
+    for (int i = 0; i < 4; ++i) {
+        offsets[i] = offset = alignOffset(offset);
+        offset += sizes[i];
+    }
+    if (file.getSize() != offset)
+        throw NoriException("\"%s\" has an unexpected size!", filename);
+
+    uint64_t checksum = header.key;
+    for (int i = 0; i < 4; ++i)
+        checksum = hashBytes(data + offsets[i], sizes[i], checksum);
+    if (checksum != header.checksum)
+        throw NoriException("\"%s\" is damaged (checksum mismatch)!", filename);
+
+    m_V.resize(3, header.vertexCount);
+    m_N.resize(3, (header.flags & 1) ? header.vertexCount : 0);
+    m_UV.resize(2, (header.flags & 2) ? header.vertexCount : 0);
+    m_F.resize(3, header.faceCount);
+    void *arrays[4] = { m_V.data(), m_N.data(), m_UV.data(), m_F.data() };
+    for (int i = 0; i < 4; ++i) {
+        if (sizes[i] > 0)
+            memcpy(arrays[i], data + offsets[i], sizes[i]);
+    }
+
+    for (Eigen::Index i = 0; i < m_F.size(); ++i) {
+        if (m_F.data()[i] >= m_V.cols())
+            throw NoriException("\"%s\" contains invalid vertex indices!", filename);
+    }
+
+    m_bbox = BoundingBox3f(Point3f(header.bboxMin[0], header.bboxMin[1], header.bboxMin[2]),
+                           Point3f(header.bboxMax[0], header.bboxMax[1], header.bboxMax[2]));
+}
+
+void Mesh::saveBinaryMesh(const std::string &filename, uint64_t key) const {
+    MeshFileHeader header;
+    memset(&header, 0, sizeof(MeshFileHeader));
+    memcpy(header.magic, "NORIMSH", 8);
+    header.version = MeshFileVersion;
+    header.flags = (m_N.size() > 0 ? 1 : 0) | (m_UV.size() > 0 ? 2 : 0);
+    header.key = key;
+    header.vertexCount = (uint64_t) m_V.cols();
+    header.faceCount = (uint64_t) m_F.cols();
+    for (int i = 0; i < 3; ++i) {
+        header.bboxMin[i] = m_bbox.min[i];
+        header.bboxMax[i] = m_bbox.max[i];
+    }
+
+    const void *arrays[4] = { m_V.data(), m_N.data(), m_UV.data(), m_F.data() };
+    const size_t sizes[4] = {
+        m_V.size() * sizeof(float), m_N.size() * sizeof(float),
+        m_UV.size() * sizeof(float), m_F.size() * sizeof(uint32_t)
+    };
+
+    header.checksum = key;
+    for (int i = 0; i < 4; ++i)
+        header.checksum = hashBytes(arrays[i], sizes[i], header.checksum);
+
+    /* Write to a temporary file first, so that concurrent renders
+       never observe a partially written mesh */
+    std::string tmpFilename = tfm::format("%s.%x.tmp", filename,
+        (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count());
+    {
+        std::ofstream os(tmpFilename, std::ios::binary);
+        const char zeros[MeshFileAlignment] = { 0 };
+        size_t offset = sizeof(MeshFileHeader);
+        os.write((const char *) &header, sizeof(MeshFileHeader));
+        for (int i = 0; i < 4; ++i) {
+            os.write(zeros, alignOffset(offset) - offset);
+            offset = alignOffset(offset) + sizes[i];
+            os.write((const char *) arrays[i], sizes[i]);
+        }
+        if (!os.good()) {
+            cerr << "Mesh: unable to write binary mesh \"" << tmpFilename << "\"" << endl;
+            os.close();
+            std::remove(tmpFilename.c_str());
+            return;
+        }
+    }
+
+    if (std::rename(tmpFilename.c_str(), filename.c_str()) != 0)
+        std::remove(tmpFilename.c_str());
+}
+
+/**
+ * \brief Loader for meshes in Nori's binary mesh format (\c .nmesh)
+ *
+ * These files are written by the OBJ loader as a cache of parsed meshes.
+ * They are memory-mapped and copied into the mesh arrays without any
+ * parsing. An optional \c toWorld transform is applied after loading.
+ */
+class BinaryMesh : public Mesh {
+public:
+    BinaryMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        Transform trafo = propList.getTransform("toWorld", Transform());
+        setStorageOptions(propList);
+
+        Timer timer;
+
+        loadBinaryMesh(filename.str());
+        applyTransform(trafo);
+
+        m_name = filename.str();
+        cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s and %s)\n",
+            filename, m_V.cols(), m_F.cols(), timer.elapsedString(),
+            memString(m_F.size() * sizeof(uint32_t) + sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())));
+    }
+};
+
+NORI_REGISTER_CLASS(BinaryMesh, "nmesh");
+NORI_NAMESPACE_END
@@ -6,143 +6,201 @@
 
 #include <objects/mesh.h>
 #include <tools/timer.h>
+#include <tools/mmap.h>
 #include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
 #include <unordered_map>
-#include <fstream>
+#include <charconv>
+#include <filesystem>
 
 NORI_NAMESPACE_BEGIN
 
+/// Approximate size of the pieces of the file that are parsed in parallel
+static const size_t OBJChunkSize = 4 * 1024 * 1024;
+
+/// Smallest OBJ file that is cached in the binary mesh format
+static const size_t MeshCacheMinSize = 16 * 1024 * 1024;
+
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory-mapped and cut into chunks at line boundaries, which
+ * are parsed in parallel. Every chunk collects the unique face vertices in
+ * the order of their first occurrence, and the chunks are then merged in
+ * file order. This yields exactly the same vertex order as a sequential
+ * parser that deduplicates the face vertices one after the other.
+ *
+ * Files of 16 MiB or more are cached in Nori's binary mesh format (see
+ * nmesh.cpp) next to the OBJ file, or in the directory given by the
+ * \c cacheDir property. The cache holds the untransformed mesh, and later
+ * loads map it and apply \c toWorld instead of parsing the text again, as
+ * long as the OBJ file does not change. Set \c cache to \c false to
+ * disable this.
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
-
-        std::ifstream is(filename.str());
-        if (is.fail())
+        if (!filename.exists())
             throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         Transform trafo = propList.getTransform("toWorld", Transform());
+        bool useCache = propList.getBoolean("cache", true);
+        std::string cacheDir = propList.getString("cacheDir", "");
+        setStorageOptions(propList);
 
-        cout << "Loading \"" << filename << "\" .. ";
-        cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
+        /* Large meshes are cached in the binary mesh format, either next
+           to the OBJ file or in the given directory */
+        std::string cacheFile;
+        uint64_t key = 0;
+        if (useCache && filename.file_size() >= MeshCacheMinSize) {
+            key = cacheKey(filename);
+            if (cacheDir.empty())
+                cacheFile = filename.str() + ".nmesh";
+            else
+                cacheFile = (filesystem::path(cacheDir) / tfm::format("%016x.nmesh", key)).str();
+        }
 
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
+        bool cached = false;
+        if (!cacheFile.empty() && filesystem::path(cacheFile).exists()) {
+            try {
+                loadBinaryMesh(cacheFile, key);
+                cached = true;
+            } catch (const NoriException &e) {
+                cerr << "WavefrontOBJ: ignoring mesh cache (" << e.what() << ")" << endl;
+            }
+        }
 
-            std::string prefix;
-            line >> prefix;
+        if (!cached && cacheFile.empty()) {
+            parse(filename, trafo);
+        } else {
+            /* The cache stores the untransformed mesh, so that it can be
+               shared by all uses of the OBJ file */
+            if (!cached) {
+                parse(filename, Transform());
+                filesystem::path dir = filesystem::path(cacheFile).parent_path();
+                if (!dir.empty() && !dir.exists())
+                    filesystem::create_directories(dir);
+                saveBinaryMesh(cacheFile, key);
+            }
+            applyTransform(trafo);
+        }
 
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
+        m_name = filename.str();
+        /* Print a single line, since meshes may be loaded in parallel */
+        cout << tfm::format("Loading \"%s\" .. done. (%sV=%i, F=%i, took %s and %s)\n",
+            filename, cached ? "loaded from cache, " : "", m_V.cols(), m_F.cols(), timer.elapsedString(),
+            memString(m_F.size() * sizeof(uint32_t) + sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())));
+    }
 
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
+protected:
+    /// Parse the OBJ file into the mesh arrays
+    void parse(const filesystem::path &filename, const Transform &trafo) {
+        MemoryMappedFile file(filename.str());
 
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i = 0; i < nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
+        /* Cut the file into chunks that end with a complete line */
+        const char *data = (const char *) file.getData();
+        const char *dataEnd = data + file.getSize();
+        std::vector<const char *> bounds(1, data);
+        while (bounds.back() != dataEnd) {
+            const char *ptr = bounds.back() + std::min(OBJChunkSize, (size_t) (dataEnd - bounds.back()));
+            while (ptr != dataEnd && ptr[-1] != '\n')
+                ++ptr;
+            bounds.push_back(ptr);
+        }
+        size_t chunkCount = bounds.size() - 1;
+
+        std::vector<OBJChunk> chunks(chunkCount);
+        tbb::parallel_for(size_t(0), chunkCount, [&](size_t i) {
+            parseChunk(bounds[i], bounds[i + 1], trafo, chunks[i]);
+        });
+
+        /* Merge the unique vertices of the chunks in file order */
+        VertexMap vertexMap;
+        std::vector<OBJVertex> vertices;
+        size_t positionCount = 0, texcoordCount = 0, normalCount = 0;
+        std::vector<size_t> indexOffset(chunkCount + 1, 0);
+        for (size_t i = 0; i < chunkCount; ++i) {
+            OBJChunk &chunk = chunks[i];
+            chunk.vertexIndex.resize(chunk.vertices.size());
+            for (size_t j = 0; j < chunk.vertices.size(); ++j) {
+                const OBJVertex &v = chunk.vertices[j];
+                auto result = vertexMap.insert(std::make_pair(v, (uint32_t) vertices.size()));
+                if (result.second)
+                    vertices.push_back(v);
+                chunk.vertexIndex[j] = result.first->second;
             }
+            std::vector<OBJVertex>().swap(chunk.vertices);
+
+            m_bbox.expandBy(chunk.bbox);
+            positionCount += chunk.positions.size();
+            texcoordCount += chunk.texcoords.size();
+            normalCount += chunk.normals.size();
+            indexOffset[i + 1] = indexOffset[i] + chunk.indices.size();
         }
+        VertexMap().swap(vertexMap);
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+        std::vector<Point3f> positions;
+        std::vector<Point2f> texcoords;
+        std::vector<Normal3f> normals;
+        positions.reserve(positionCount);
+        texcoords.reserve(texcoordCount);
+        normals.reserve(normalCount);
+        for (const OBJChunk &chunk : chunks) {
+            positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+            texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+        }
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i = 0; i < vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p - 1);
+        /* Translate the chunk-local vertex indices of the faces */
+        m_F.resize(3, indexOffset.back() / 3);
+        tbb::parallel_for(size_t(0), chunkCount, [&](size_t i) {
+            const OBJChunk &chunk = chunks[i];
+            uint32_t *indices = m_F.data() + indexOffset[i];
+            for (size_t j = 0; j < chunk.indices.size(); ++j)
+                indices[j] = chunk.vertexIndex[chunk.indices[j]];
+        });
+        chunks.clear();
 
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i = 0; i < vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n - 1);
+        for (const OBJVertex &v : vertices) {
+            if (v.p == 0 || v.p > positions.size() ||
+                (!texcoords.empty() && (v.uv == 0 || v.uv > texcoords.size())) ||
+                (!normals.empty() && (v.n == 0 || v.n > normals.size())))
+                throw NoriException("Invalid vertex index in OBJ file \"%s\"!", filename);
         }
 
-        if (!texcoords.empty()) {
+        m_V.resize(3, vertices.size());
+        if (!normals.empty())
+            m_N.resize(3, vertices.size());
+        if (!texcoords.empty())
             m_UV.resize(2, vertices.size());
-            for (uint32_t i = 0; i < vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv - 1);
-        }
+        tbb::parallel_for(size_t(0), vertices.size(), [&](size_t i) {
+            const OBJVertex &v = vertices[i];
+            m_V.col(i) = positions[v.p - 1];
+            if (!normals.empty())
+                m_N.col(i) = normals[v.n - 1];
+            if (!texcoords.empty())
+                m_UV.col(i) = texcoords[v.uv - 1];
+        });
+    }
 
-        m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+    /// Identify the OBJ file by its path, size and modification time
+    static uint64_t cacheKey(const filesystem::path &filename) {
+        std::string path = filename.make_absolute().str();
+        uint64_t h = hashBytes(path.data(), path.size());
+        h = hashValue((uint64_t) filename.file_size(), h);
+        h = hashValue((int64_t) std::filesystem::last_write_time(path).time_since_epoch().count(), h);
+        return std::max(h, (uint64_t) 1); /* Zero means "any source" */
     }
 
-protected:
     /// Vertex indices used by the OBJ format
     struct OBJVertex {
         uint32_t p = (uint32_t) -1;
         uint32_t n = (uint32_t) -1;
         uint32_t uv = (uint32_t) -1;
 
-        inline OBJVertex() { }
-
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
-
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
-
-            p = toUInt(tokens[0]);
-
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
-
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
-        }
-
         inline bool operator==(const OBJVertex &v) const {
             return v.p == p && v.n == n && v.uv == uv;
         }
@@ -157,6 +215,132 @@ protected:
             return hash;
         }
     };
+
+    typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
+
+    /// Contents of a range of lines of the file
+    struct OBJChunk {
+        std::vector<Point3f> positions;
+        std::vector<Point2f> texcoords;
+        std::vector<Normal3f> normals;
+        std::vector<OBJVertex> vertices;    ///< Unique face vertices in the order of their first occurrence
+        std::vector<uint32_t> vertexIndex;  ///< Index of every entry of 'vertices' in the mesh (set while merging)
+        std::vector<uint32_t> indices;      ///< Face vertices (indices into 'vertices')
+        BoundingBox3f bbox;
+    };
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    static const char *skipSpace(const char *ptr, const char *end) {
+        while (ptr != end && isSpace(*ptr))
+            ++ptr;
+        return ptr;
+    }
+
+    static const char *skipToken(const char *ptr, const char *end) {
+        while (ptr != end && !isSpace(*ptr))
+            ++ptr;
+        return ptr;
+    }
+
+    /// Parse the next whitespace-separated floating point value of a line
+    static const char *parseFloat(const char *ptr, const char *end, float &value) {
+        ptr = skipSpace(ptr, end);
+        const char *tokenEnd = skipToken(ptr, end);
+        const char *start = (ptr != tokenEnd && *ptr == '+') ? ptr + 1 : ptr;
+        std::from_chars_result result = std::from_chars(start, tokenEnd, value);
+        if (result.ec == std::errc::result_out_of_range)
+            value = std::strtof(std::string(start, tokenEnd).c_str(), nullptr);
+        else if (result.ec != std::errc() || start == tokenEnd)
+            throw NoriException("Could not parse floating point value \"%s\"", std::string(ptr, tokenEnd));
+        return tokenEnd;
+    }
+
+    /// Parse a face vertex of the form <tt>p</tt>, <tt>p/uv</tt>, <tt>p//n</tt> or <tt>p/uv/n</tt>
+    static OBJVertex parseVertex(const char *ptr, const char *end) {
+        OBJVertex v;
+        uint32_t *fields[3] = { &v.p, &v.uv, &v.n };
+        const char *start = ptr;
+        for (int i = 0; ; ++i) {
+            if (i == 3)
+                throw NoriException("Invalid vertex data: \"%s\"", std::string(start, end));
+            const char *fieldEnd = std::find(ptr, end, '/');
+            if (ptr != fieldEnd || i == 0) {
+                std::from_chars_result result = std::from_chars(ptr, fieldEnd, *fields[i]);
+                if (result.ec != std::errc() || result.ptr != fieldEnd)
+                    throw NoriException("Invalid vertex data: \"%s\"", std::string(start, end));
+            }
+            if (fieldEnd == end)
+                break;
+            ptr = fieldEnd + 1;
+        }
+        return v;
+    }
+
+    /// Parse the lines in [begin, end) into \c chunk
+    static void parseChunk(const char *begin, const char *end, const Transform &trafo, OBJChunk &chunk) {
+        VertexMap vertexMap;
+
+        for (const char *ptr = begin; ptr != end; ) {
+            const char *lineEnd = std::find(ptr, end, '\n');
+            ptr = skipSpace(ptr, lineEnd);
+            const char *prefixEnd = skipToken(ptr, lineEnd);
+            size_t prefixLength = prefixEnd - ptr;
+
+            if (prefixLength == 1 && ptr[0] == 'v') {
+                Point3f p;
+                const char *cur = parseFloat(prefixEnd, lineEnd, p.x());
+                cur = parseFloat(cur, lineEnd, p.y());
+                parseFloat(cur, lineEnd, p.z());
+                p = trafo * p;
+                chunk.bbox.expandBy(p);
+                chunk.positions.push_back(p);
+            } else if (prefixLength == 2 && ptr[0] == 'v' && ptr[1] == 't') {
+                Point2f tc;
+                const char *cur = parseFloat(prefixEnd, lineEnd, tc.x());
+                parseFloat(cur, lineEnd, tc.y());
+                chunk.texcoords.push_back(tc);
+            } else if (prefixLength == 2 && ptr[0] == 'v' && ptr[1] == 'n') {
+                Normal3f n;
+                const char *cur = parseFloat(prefixEnd, lineEnd, n.x());
+                cur = parseFloat(cur, lineEnd, n.y());
+                parseFloat(cur, lineEnd, n.z());
+                chunk.normals.push_back((trafo * n).normalized());
+            } else if (prefixLength == 1 && ptr[0] == 'f') {
+                OBJVertex verts[6];
+                int nVertices = 0;
+                const char *cur = prefixEnd;
+                while (nVertices < 4) {
+                    cur = skipSpace(cur, lineEnd);
+                    if (cur == lineEnd)
+                        break;
+                    const char *tokenEnd = skipToken(cur, lineEnd);
+                    verts[nVertices++] = parseVertex(cur, tokenEnd);
+                    cur = tokenEnd;
+                }
+                if (nVertices < 3)
+                    throw NoriException("Invalid face data: \"%s\"", std::string(ptr, lineEnd));
+
+                if (nVertices == 4) {
+                    /* This is a quad, split into two triangles */
+                    verts[4] = verts[0];
+                    verts[5] = verts[2];
+                    nVertices = 6;
+                }
+                /* Convert to an indexed vertex list */
+                for (int i = 0; i < nVertices; ++i) {
+                    auto result = vertexMap.insert(std::make_pair(verts[i], (uint32_t) chunk.vertices.size()));
+                    if (result.second)
+                        chunk.vertices.push_back(verts[i]);
+                    chunk.indices.push_back(result.first->second);
+                }
+            }
+
+            ptr = lineEnd == end ? end : lineEnd + 1;
+        }
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -8,6 +8,7 @@
 #include <core/proplist.h>
 #include <Eigen/Geometry>
 #include <pugixml.hpp>
+#include <tbb/task_group.h>
 #include <fstream>
 #include <set>
 
@@ -57,6 +58,8 @@ NoriObject *loadFromXML(const std::string &filename) {
         EReconstructionFilter = NoriObject::EReconstructionFilter,
         ETextureFilter        = NoriObject::ETextureFilter,
         ETexture              = NoriObject::ETexture,
+        EInstance             = NoriObject::EInstance,
+        EAccel                = NoriObject::EAccel,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -91,6 +94,8 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["tfilter"]    = ETextureFilter;
     tags["test"]       = ETest;
     tags["texture"]    = ETexture;
+    tags["instance"]   = EInstance;
+    tags["accel"]      = EAccel;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -119,11 +124,24 @@ NoriObject *loadFromXML(const std::string &filename) {
                                 filename, *attrs.begin(), node.name(), offset(node.offset_debug()));
     };
 
+    /* Objects that were given an 'id' and can be referenced by instances */
+    std::map<std::string, NoriObject *> namedObjects;
+
     Eigen::Affine3f transform;
 
-    /* Helper function to parse a Nori XML node (recursive) */
-    std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
-        pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
+    /* Meshes and textures that are being loaded in the background */
+    struct PendingObject {
+        NoriObject *result = nullptr;
+        std::exception_ptr error;
+    };
+    std::map<const void *, PendingObject> pending;
+    tbb::task_group loaders;
+
+    /* Helper function to parse a Nori XML node (recursive). With 'prefetch'
+       set, it only collects the properties and starts loading the meshes
+       and textures in the background without creating any other objects */
+    std::function<NoriObject *(pugi::xml_node &, PropertyList &, int, bool)> parseTag = [&](
+        pugi::xml_node &node, PropertyList &list, int parentTag, bool prefetch) -> NoriObject * {
         /* Skip over comments */
         if (node.type() == pugi::node_comment || node.type() == pugi::node_declaration)
             return nullptr;
@@ -160,7 +178,7 @@ NoriObject *loadFromXML(const std::string &filename) {
             throw NoriException("Error while parsing \"%s\": node \"%s\" requires a Nori object as parent (at %s)",
                                 filename, node.name(), offset(node.offset_debug()));
 
-        if (tag == EScene)
+        if (tag == EScene && !prefetch)
             node.append_attribute("type") = "scene";
         else if (tag == ETransform)
             transform.setIdentity();
@@ -168,21 +186,55 @@ NoriObject *loadFromXML(const std::string &filename) {
         PropertyList propList;
         std::vector<NoriObject *> children;
         for (pugi::xml_node &ch: node.children()) {
-            NoriObject *child = parseTag(ch, propList, tag);
+            NoriObject *child = parseTag(ch, propList, tag, prefetch);
             if (child)
                 children.push_back(child);
         }
 
         NoriObject *result = nullptr;
         try {
-            if (currentIsObject) {
-                check_attributes(node, { "type" });
+            if (currentIsObject && prefetch) {
+                /* Meshes and textures only depend on their properties */
+                if (tag == EMesh || tag == ETexture) {
+                    PendingObject &object = pending[node.internal_object()];
+                    std::string type = node.attribute("type").value();
+                    loaders.run([&object, type, propList] {
+                        try {
+                            object.result = NoriObjectFactory::createInstance(type, propList);
+                        } catch (...) {
+                            object.error = std::current_exception();
+                        }
+                    });
+                }
+            } else if (currentIsObject) {
+                std::string type = node.attribute("type").value();
+                NoriObject *ref = nullptr;
+                if (tag == EInstance) {
+                    /* Instances reference a previously declared object */
+                    check_attributes(node, { "ref" });
+                    auto it = namedObjects.find(node.attribute("ref").value());
+                    if (it == namedObjects.end())
+                        throw NoriException("Reference to unknown object \"%s\"",
+                                            node.attribute("ref").value());
+                    ref = it->second;
+                    type = "instance";
+                } else if (node.attribute("id")) {
+                    check_attributes(node, { "type", "id" });
+                } else {
+                    check_attributes(node, { "type" });
+                }
 
-                /* This is an object, first instantiate it */
-                result = NoriObjectFactory::createInstance(
-                    node.attribute("type").value(),
-                    propList
-                );
+                /* This is an object, first instantiate it (or pick up
+                   the result of loading it in the background) */
+                auto it = pending.find(node.internal_object());
+                if (it != pending.end()) {
+                    loaders.wait();
+                    if (it->second.error)
+                        std::rethrow_exception(it->second.error);
+                    result = it->second.result;
+                } else {
+                    result = NoriObjectFactory::createInstance(type, propList);
+                }
 
                 if (result->getClassType() != (int) tag) {
                     throw NoriException(
@@ -194,6 +246,8 @@ NoriObject *loadFromXML(const std::string &filename) {
                 }
 
                 /* Add all children */
+                if (ref)
+                    result->addChild(ref);
                 for (auto ch: children) {
                     result->addChild(ch);
                     ch->setParent(result);
@@ -201,6 +255,12 @@ NoriObject *loadFromXML(const std::string &filename) {
 
                 /* Activate / configure the object */
                 result->activate();
+
+                if (node.attribute("id")) {
+                    std::string id = node.attribute("id").value();
+                    if (!namedObjects.insert({ id, result }).second)
+                        throw NoriException("Duplicate object id \"%s\"", id);
+                }
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -304,8 +364,24 @@ NoriObject *loadFromXML(const std::string &filename) {
         return result;
     };
 
-    PropertyList list;
-    return parseTag(*doc.begin(), list, EInvalid);
+    /* A first pass over the document starts loading all meshes and textures
+       in parallel. Errors are ignored here, the second pass creates the
+       remaining objects in the usual order and reports errors as before */
+    try {
+        PropertyList list;
+        parseTag(*doc.begin(), list, EInvalid, true);
+    } catch (const std::exception &) { }
+
+    NoriObject *root = nullptr;
+    try {
+        PropertyList list;
+        root = parseTag(*doc.begin(), list, EInvalid, false);
+    } catch (...) {
+        loaders.wait();
+        throw;
+    }
+    loaders.wait();
+    return root;
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,382 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <objects/mesh.h>
+#include <tools/timer.h>
+#include <tools/mmap.h>
+#include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
+#include <charconv>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Loader for PLY triangle meshes
+ *
+ * Supports ASCII as well as little- and big-endian binary files. The
+ * vertex element provides the positions (\c x, \c y, \c z) and optionally
+ * normals (\c nx, \c ny, \c nz) and texture coordinates (\c u, \c v or
+ * \c s, \c t), which may be stored with any scalar type. The face element
+ * provides the \c vertex_indices list of every polygon, which is split
+ * into a triangle fan. Other elements and properties are skipped.
+ *
+ * The file is memory-mapped and the vertex data is read directly into the
+ * mesh arrays (with a single copy if the positions are the only vertex
+ * properties of a little-endian file).
+ */
+class PLYMesh : public Mesh {
+public:
+    PLYMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        if (!filename.exists())
+            throw NoriException("Unable to open PLY file \"%s\"!", filename);
+        Transform trafo = propList.getTransform("toWorld", Transform());
+        setStorageOptions(propList);
+
+        Timer timer;
+
+        MemoryMappedFile file(filename.str());
+        const char *ptr = (const char *) file.getData();
+        const char *end = ptr + file.getSize();
+
+        EFormat format = EASCII;
+        std::vector<PLYElement> elements;
+        ptr = parseHeader(ptr, end, format, elements, filename.str());
+
+        bool foundVertices = false;
+        for (const PLYElement &element : elements) {
+            if (element.name == "vertex") {
+                ptr = readVertices(ptr, end, format, element);
+                foundVertices = true;
+            } else if (element.name == "face") {
+                if (!foundVertices)
+                    throw NoriException("PLYMesh: faces must follow the vertices in \"%s\"!", filename);
+                ptr = readFaces(ptr, end, format, element);
+            } else {
+                ptr = skipElement(ptr, end, format, element);
+            }
+        }
+        if (!foundVertices)
+            throw NoriException("PLYMesh: \"%s\" contains no vertices!", filename);
+
+        /* The bounding box is only updated by non-identity transforms */
+        for (Eigen::Index i = 0; i < m_V.cols(); ++i)
+            m_bbox.expandBy(Point3f(m_V.col(i)));
+        applyTransform(trafo);
+
+        m_name = filename.str();
+        cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s and %s)\n",
+            filename, m_V.cols(), m_F.cols(), timer.elapsedString(),
+            memString(m_F.size() * sizeof(uint32_t) + sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())));
+    }
+
+protected:
+    /// Encoding of the file contents after the header
+    enum EFormat {
+        EASCII = 0,
+        EBinaryLittleEndian,
+        EBinaryBigEndian
+    };
+
+    /// Scalar types of the PLY format
+    enum EType {
+        EInt8 = 0, EUInt8, EInt16, EUInt16, EInt32, EUInt32, EFloat32, EFloat64
+    };
+
+    struct PLYProperty {
+        std::string name;
+        EType type;                 ///< Type of the value (or of the list entries)
+        EType countType;            ///< Type of the list length
+        bool isList = false;
+    };
+
+    struct PLYElement {
+        std::string name;
+        size_t count;
+        std::vector<PLYProperty> properties;
+    };
+
+    static size_t typeSize(EType type) {
+        const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+        return sizes[type];
+    }
+
+    static EType parseType(const std::string &name) {
+        if (name == "char" || name == "int8") return EInt8;
+        if (name == "uchar" || name == "uint8") return EUInt8;
+        if (name == "short" || name == "int16") return EInt16;
+        if (name == "ushort" || name == "uint16") return EUInt16;
+        if (name == "int" || name == "int32") return EInt32;
+        if (name == "uint" || name == "uint32") return EUInt32;
+        if (name == "float" || name == "float32") return EFloat32;
+        if (name == "double" || name == "float64") return EFloat64;
+        throw NoriException("PLYMesh: unknown property type \"%s\"!", name);
+    }
+
+    /// Parse the header and return a pointer to the first byte of the data
+    static const char *parseHeader(const char *ptr, const char *end, EFormat &format,
+                                   std::vector<PLYElement> &elements, const std::string &filename) {
+        bool first = true, foundFormat = false;
+        while (true) {
+            const char *lineEnd = std::find(ptr, end, '\n');
+            if (lineEnd == end)
+                throw NoriException("PLYMesh: \"%s\" has an incomplete header!", filename);
+            std::string line(ptr, lineEnd);
+            std::vector<std::string> tokens = tokenize(line, " \t\r");
+            ptr = lineEnd + 1;
+
+            if (first) {
+                if (tokens.size() != 1 || tokens[0] != "ply")
+                    throw NoriException("PLYMesh: \"%s\" is not a PLY file!", filename);
+                first = false;
+            } else if (tokens.empty() || tokens[0] == "comment" || tokens[0] == "obj_info") {
+                continue;
+            } else if (tokens[0] == "format" && tokens.size() == 3) {
+                if (tokens[1] == "ascii")
+                    format = EASCII;
+                else if (tokens[1] == "binary_little_endian")
+                    format = EBinaryLittleEndian;
+                else if (tokens[1] == "binary_big_endian")
+                    format = EBinaryBigEndian;
+                else
+                    throw NoriException("PLYMesh: unknown format \"%s\" in \"%s\"!", tokens[1], filename);
+                foundFormat = true;
+            } else if (tokens[0] == "element" && tokens.size() == 3) {
+                PLYElement element;
+                element.name = tokens[1];
+                element.count = (size_t) std::stoull(tokens[2]);
+                elements.push_back(element);
+            } else if (tokens[0] == "property" && !elements.empty() && tokens.size() >= 3) {
+                PLYProperty property;
+                if (tokens[1] == "list" && tokens.size() == 5) {
+                    property.isList = true;
+                    property.countType = parseType(tokens[2]);
+                    property.type = parseType(tokens[3]);
+                    property.name = tokens[4];
+                } else if (tokens.size() == 3) {
+                    property.type = parseType(tokens[1]);
+                    property.name = tokens[2];
+                } else {
+                    throw NoriException("PLYMesh: invalid property declaration in \"%s\"!", filename);
+                }
+                elements.back().properties.push_back(property);
+            } else if (tokens[0] == "end_header") {
+                break;
+            } else {
+                throw NoriException("PLYMesh: invalid header line \"%s\" in \"%s\"!", line, filename);
+            }
+        }
+        if (!foundFormat)
+            throw NoriException("PLYMesh: \"%s\" does not specify a format!", filename);
+        return ptr;
+    }
+
+    /// Read a binary value of the given type and convert it to \c T
+    template <typename T> static T readBinary(const char *ptr, EType type, bool swap) {
+        uint8_t bytes[8];
+        size_t size = typeSize(type);
+        memcpy(bytes, ptr, size);
+        if (swap)
+            std::reverse(bytes, bytes + size);
+
+        switch (type) {
+            case EInt8:    { int8_t v;   memcpy(&v, bytes, 1); return (T) v; }
+            case EUInt8:   { uint8_t v;  memcpy(&v, bytes, 1); return (T) v; }
+            case EInt16:   { int16_t v;  memcpy(&v, bytes, 2); return (T) v; }
+            case EUInt16:  { uint16_t v; memcpy(&v, bytes, 2); return (T) v; }
+            case EInt32:   { int32_t v;  memcpy(&v, bytes, 4); return (T) v; }
+            case EUInt32:  { uint32_t v; memcpy(&v, bytes, 4); return (T) v; }
+            case EFloat32: { float v;    memcpy(&v, bytes, 4); return (T) v; }
+            default:       { double v;   memcpy(&v, bytes, 8); return (T) v; }
+        }
+    }
+
+    /// Read the next whitespace-separated number of an ASCII file
+    static double readAscii(const char *&ptr, const char *end) {
+        while (ptr != end && isspace((unsigned char) *ptr))
+            ++ptr;
+        const char *start = (ptr != end && *ptr == '+') ? ptr + 1 : ptr;
+        double value;
+        std::from_chars_result result = std::from_chars(start, end, value);
+        if (result.ec != std::errc() || start == end)
+            throw NoriException("PLYMesh: could not parse a numeric value!");
+        ptr = result.ptr;
+        return value;
+    }
+
+    /// Read one value of a property (or the length of a list), binary or ASCII
+    template <typename T> static T readValue(const char *&ptr, const char *end, EFormat format, EType type) {
+        if (format == EASCII)
+            return (T) readAscii(ptr, end);
+        size_t size = typeSize(type);
+        if ((size_t) (end - ptr) < size)
+            throw NoriException("PLYMesh: unexpected end of file!");
+        T value = readBinary<T>(ptr, type, format == EBinaryBigEndian);
+        ptr += size;
+        return value;
+    }
+
+    const char *readVertices(const char *ptr, const char *end, EFormat format, const PLYElement &element) {
+        /* Find the destination of every property (matrix and row) */
+        size_t propCount = element.properties.size();
+        std::vector<MatrixXf *> target(propCount, nullptr);
+        std::vector<int> row(propCount, 0);
+        std::vector<size_t> offset(propCount, 0);
+        int found[3] = { 0, 0, 0 };
+        size_t stride = 0;
+        for (size_t i = 0; i < propCount; ++i) {
+            const PLYProperty &prop = element.properties[i];
+            if (prop.isList)
+                throw NoriException("PLYMesh: list properties of vertices are not supported!");
+            const char *names[3][3] = { { "x", "y", "z" }, { "nx", "ny", "nz" }, { "u", "v", nullptr } };
+            const char *altNames[2] = { "s", "t" };
+            MatrixXf *matrices[3] = { &m_V, &m_N, &m_UV };
+            for (int m = 0; m < 3; ++m) {
+                for (int r = 0; r < 3; ++r) {
+                    if (names[m][r] && (prop.name == names[m][r] || (m == 2 && r < 2 && prop.name == altNames[r]))) {
+                        target[i] = matrices[m];
+                        row[i] = r;
+                        found[m] |= 1 << r;
+                    }
+                }
+            }
+            offset[i] = stride;
+            stride += typeSize(prop.type);
+        }
+        if (found[0] != 7)
+            throw NoriException("PLYMesh: the vertices must provide x, y and z coordinates!");
+
+        /* Validate the count before allocating: every vertex takes 'stride'
+           bytes in binary files and at least one byte per value in ASCII files */
+        size_t count = element.count;
+        size_t minSize = format == EASCII ? propCount : std::max(stride, (size_t) 1);
+        if ((size_t) (end - ptr) / minSize < count)
+            throw NoriException("PLYMesh: unexpected end of file!");
+
+        m_V.resize(3, count);
+        m_N.resize(3, found[1] == 7 ? count : 0);
+        m_UV.resize(2, found[2] == 3 ? count : 0);
+        if (found[1] != 7 || found[2] != 3) {
+            for (size_t i = 0; i < propCount; ++i) {
+                if ((target[i] == &m_N && found[1] != 7) || (target[i] == &m_UV && found[2] != 3))
+                    target[i] = nullptr;
+            }
+        }
+
+        if (format == EASCII) {
+            for (size_t v = 0; v < count; ++v) {
+                for (size_t i = 0; i < propCount; ++i) {
+                    float value = (float) readAscii(ptr, end);
+                    if (target[i])
+                        (*target[i])(row[i], v) = value;
+                }
+            }
+            normalizeNormals();
+            return ptr;
+        }
+
+        bool swap = format == EBinaryBigEndian;
+        bool positionsOnly = propCount == 3 && stride == 3 * sizeof(float) && !swap;
+        for (size_t i = 0; i < propCount && positionsOnly; ++i)
+            positionsOnly = element.properties[i].type == EFloat32 && target[i] == &m_V && row[i] == (int) i;
+
+        if (positionsOnly) {
+            /* The vertex data has the exact layout of the position matrix */
+            memcpy(m_V.data(), ptr, count * stride);
+        } else {
+            tbb::parallel_for(size_t(0), count, [&](size_t v) {
+                const char *vertex = ptr + v * stride;
+                for (size_t i = 0; i < propCount; ++i) {
+                    if (target[i])
+                        (*target[i])(row[i], v) = readBinary<float>(vertex + offset[i],
+                                                                    element.properties[i].type, swap);
+                }
+            });
+        }
+        normalizeNormals();
+        return ptr + count * stride;
+    }
+
+    /// Normalize the vertex normals (like the OBJ loader does)
+    void normalizeNormals() {
+        tbb::parallel_for(Eigen::Index(0), m_N.cols(), [&](Eigen::Index v) {
+            m_N.col(v).normalize();
+        });
+    }
+
+    const char *readFaces(const char *ptr, const char *end, EFormat format, const PLYElement &element) {
+        int indexProp = -1;
+        for (size_t i = 0; i < element.properties.size(); ++i) {
+            const PLYProperty &prop = element.properties[i];
+            if (prop.isList && (prop.name == "vertex_indices" || prop.name == "vertex_index"))
+                indexProp = (int) i;
+        }
+        if (indexProp < 0)
+            throw NoriException("PLYMesh: the faces must provide a \"vertex_indices\" list!");
+
+        uint32_t vertexCount = (uint32_t) m_V.cols();
+        /* Every face takes at least one byte, reject larger counts before reserving */
+        if ((size_t) (end - ptr) < element.count)
+            throw NoriException("PLYMesh: unexpected end of file!");
+        std::vector<uint32_t> indices;
+        indices.reserve(element.count * 3);
+        uint32_t polygon[3];
+        for (size_t f = 0; f < element.count; ++f) {
+            for (size_t i = 0; i < element.properties.size(); ++i) {
+                const PLYProperty &prop = element.properties[i];
+                if ((int) i != indexProp) {
+                    skipProperty(ptr, end, format, prop);
+                    continue;
+                }
+
+                /* Split the polygon into a triangle fan on the fly */
+                uint32_t n = readValue<uint32_t>(ptr, end, format, prop.countType);
+                for (uint32_t k = 0; k < n; ++k) {
+                    uint32_t index = readValue<uint32_t>(ptr, end, format, prop.type);
+                    if (index >= vertexCount)
+                        throw NoriException("PLYMesh: invalid vertex index %i!", index);
+                    if (k < 2) {
+                        polygon[k] = index;
+                        continue;
+                    }
+                    polygon[2] = index;
+                    indices.insert(indices.end(), polygon, polygon + 3);
+                    polygon[1] = index;
+                }
+            }
+        }
+
+        m_F.resize(3, indices.size() / 3);
+        if (!indices.empty())
+            memcpy(m_F.data(), indices.data(), sizeof(uint32_t) * indices.size());
+        return ptr;
+    }
+
+    static void skipProperty(const char *&ptr, const char *end, EFormat format, const PLYProperty &prop) {
+        size_t n = prop.isList ? readValue<size_t>(ptr, end, format, prop.countType) : 1;
+        if (format == EASCII) {
+            for (size_t k = 0; k < n; ++k)
+                readAscii(ptr, end);
+        } else {
+            if ((size_t) (end - ptr) / typeSize(prop.type) < n)
+                throw NoriException("PLYMesh: unexpected end of file!");
+            ptr += n * typeSize(prop.type);
+        }
+    }
+
+    static const char *skipElement(const char *ptr, const char *end, EFormat format, const PLYElement &element) {
+        for (size_t e = 0; e < element.count; ++e) {
+            for (const PLYProperty &prop : element.properties)
+                skipProperty(ptr, end, format, prop);
+        }
+        return ptr;
+    }
+};
+
+NORI_REGISTER_CLASS(PLYMesh, "ply");
+NORI_NAMESPACE_END
@@ -10,12 +10,11 @@
 #include <objects/sampler.h>
 #include <objects/camera.h>
 #include <objects/emitter.h>
+#include <set>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
-}
+Scene::Scene(const PropertyList &propList) : m_propList(propList) { }
 
 Scene::~Scene() {
     delete m_accel;
@@ -25,6 +24,32 @@ Scene::~Scene() {
 }
 
 void Scene::activate() {
+    if (!m_accel) {
+        /* Create a default (BVH) acceleration data structure, which is
+           configured by the properties of the scene */
+        m_accel = static_cast<Accel *>(
+            NoriObjectFactory::createInstance("bvh", m_propList));
+    }
+
+    /* Meshes referenced by an instance are only stored once, in the shared
+       bottom-level BVH, and their declared copy is placed by an implicit
+       identity instance */
+    std::set<const Mesh *> instanced;
+    for (auto instance : m_instances)
+        instanced.insert(instance->getMesh());
+    m_implicitInstances.clear();
+    for (auto mesh : m_meshes) {
+        if (instanced.find(mesh) == instanced.end()) {
+            m_accel->addMesh(mesh);
+        } else {
+            m_implicitInstances.emplace_back(new Instance(PropertyList()));
+            m_implicitInstances.back()->addChild(mesh);
+            m_implicitInstances.back()->activate();
+            m_accel->addInstance(m_implicitInstances.back().get());
+        }
+    }
+    for (auto instance : m_instances)
+        m_accel->addInstance(instance);
     m_accel->build();
 
     if (!m_integrator)
@@ -54,11 +79,16 @@ void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Mesh *mesh = static_cast<Mesh *>(obj);
-                m_accel->addMesh(mesh);
                 m_meshes.push_back(mesh);
             }
             break;
         
+        case EInstance: {
+                Instance *instance = static_cast<Instance *>(obj);
+                m_instances.push_back(instance);
+            }
+            break;
+
         case EEmitter: {
                 //Emitter *emitter = static_cast<Emitter *>(obj);
                 throw NoriException("Scene::addChild(): You need to implement this for emitters");
@@ -77,6 +107,12 @@ void Scene::addChild(NoriObject *obj) {
             m_camera = static_cast<Camera *>(obj);
             break;
         
+        case EAccel:
+            if (m_accel)
+                throw NoriException("There can only be one acceleration data structure per scene!");
+            m_accel = static_cast<Accel *>(obj);
+            break;
+
         case EIntegrator:
             if (m_integrator)
                 throw NoriException("There can only be one integrator per scene!");
@@ -103,13 +139,17 @@ std::string Scene::toString() const {
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
+        "  accel = %s,\n"
         "  meshes = {\n"
-        "  %s  }\n"
+        "  %s  },\n"
+        "  instances = %i\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
-        indent(meshes, 2)
+        indent(m_accel->toString()),
+        indent(meshes, 2),
+        m_instances.size()
     );
 }
 
@@ -42,6 +42,10 @@ NORI_NAMESPACE_BEGIN
  *
  * 2. that the average radiance received by a camera within some scene
  *    matches a given value (modulo noise).
+ *
+ * In the second case, an optional \c update transform moves the vertices of
+ * all meshes of every scene before it is rendered, which tests the refitting
+ * or rebuilding of the acceleration data structure (\ref Scene::update()).
  */
 class StudentsTTest : public NoriObject {
 public:
@@ -62,6 +66,14 @@ public:
 
         /* Number of BSDF samples that should be generated (default: 100K) */
         m_sampleCount = propList.getInteger("sampleCount", 100000);
+
+        /* Optional transform that is applied to the vertices of all meshes of
+           every scene (followed by Scene::update()) before it is rendered */
+        m_update = propList.getTransform("update", Transform());
+
+        /* Trace the camera rays through Scene::rayIntersectStream() and
+           Integrator::LiPrimaryStream() instead of Integrator::Li() */
+        m_rayStream = propList.getBoolean("rayStream", false);
     }
 
     virtual ~StudentsTTest() {
@@ -108,7 +120,8 @@ public:
                     cout << "Testing (angle=" << angle << "): " << bsdf->toString() << endl;
                     ++total;
 
-                    BSDFQueryRecord bRec(sphericalDirection(degToRad(angle), 0), Intersection());
+                    SurfaceInteraction si;
+                    BSDFQueryRecord bRec(sphericalDirection(degToRad(angle), 0), si);
 
                     cout << "Drawing " << m_sampleCount << " samples .. " << endl;
                     double mean=0, variance = 0;
@@ -149,26 +162,67 @@ public:
                 cout << "Testing scene: " << scene->toString() << endl;
                 ++total;
 
+                if (m_update.getMatrix() != Eigen::Matrix4f::Identity()) {
+                    for (auto mesh : scene->getMeshes()) {
+                        MatrixXf V = mesh->getVertexPositions();
+                        for (Eigen::Index i = 0; i < V.cols(); ++i) {
+                            Point3f p = m_update * Point3f(V.col(i));
+                            for (int k = 0; k < 3; ++k)
+                                V(k, i) = p[k];
+                        }
+                        mesh->setVertexPositions(V);
+                    }
+                    scene->update();
+                }
+
                 cout << "Generating " << m_sampleCount << " paths.. " << endl;
 
                 double mean = 0, variance = 0;
-                for (int k=0; k<m_sampleCount; ++k) {
-                    /* Sample a ray from the camera */
-                    Ray3f ray;
-                    Point2f pixelSample = (sampler->next2D().array()
-                        * camera->getOutputSize().cast<float>().array()).matrix();
-                    Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
-
-                    /* Compute the incident radiance */
-                    value *= integrator->Li(scene, sampler, ray);
-
+                auto addSample = [&](const Color3f &value, int k) {
                     /* Numerically robust online variance estimation using an
                        algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
                     double result = (double) value.getLuminance();
                     double delta = result - mean;
                     mean += delta / (double) (k+1);
                     variance += delta * (result - mean);
+                };
+
+                if (m_rayStream) {
+                    /* Trace the camera rays in batches through the ray stream API */
+                    const int batchSize = 4096;
+                    std::vector<Ray3f> rays(batchSize);
+                    std::vector<Intersection> its(batchSize);
+                    std::vector<Color3f> weights(batchSize), values(batchSize);
+                    std::unique_ptr<bool[]> hits(new bool[batchSize]);
+
+                    for (int k=0; k<m_sampleCount; k += batchSize) {
+                        int count = std::min(batchSize, m_sampleCount - k);
+                        for (int r=0; r<count; ++r) {
+                            Point2f pixelSample = (sampler->next2D().array()
+                                * camera->getOutputSize().cast<float>().array()).matrix();
+                            weights[r] = camera->sampleRay(rays[r], pixelSample, sampler->next2D());
+                        }
+
+                        scene->rayIntersectStream(rays.data(), its.data(), hits.get(), (size_t) count);
+                        integrator->LiPrimaryStream(scene, sampler, rays.data(), its.data(),
+                                                    hits.get(), values.data(), (size_t) count);
+
+                        for (int r=0; r<count; ++r)
+                            addSample(weights[r] * values[r], k + r);
+                    }
+                } else {
+                    for (int k=0; k<m_sampleCount; ++k) {
+                        /* Sample a ray from the camera */
+                        Ray3f ray;
+                        Point2f pixelSample = (sampler->next2D().array()
+                            * camera->getOutputSize().cast<float>().array()).matrix();
+                        Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
+
+                        /* Compute the incident radiance */
+                        addSample(value * integrator->Li(scene, sampler, ray), k);
+                    }
                 }
+
                 variance /= m_sampleCount - 1;
 
                 std::pair<bool, std::string>
@@ -204,6 +258,8 @@ private:
     std::vector<float> m_references;
     float m_significanceLevel;
     int m_sampleCount;
+    Transform m_update;
+    bool m_rayStream;
 };
 
 NORI_REGISTER_CLASS(StudentsTTest, "ttest");
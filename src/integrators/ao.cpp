@@ -10,17 +10,51 @@ public:
 
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its);
+        return LiPrimary(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const Intersection &its, bool hit) const {
+        if (!hit)
             return Color3f(0.0f);
 
+        SurfaceInteraction si(its);
+
         Vector3f sampleDir = Warp::squareToCosineHemisphere(sampler->next2D());
-        Vector3f outDir = its.toWorld(sampleDir).normalized();
-        Ray3f shadowRay = Ray3f(its.p, outDir);
+        Vector3f outDir = si.toWorld(sampleDir).normalized();
+        Ray3f shadowRay = Ray3f(si.getPosition(), outDir);
         int visiblity = scene->rayIntersect(shadowRay) ? 0 : 1;
 
         return Color3f(float(visiblity));
     }
 
+    void LiPrimaryStream(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+                         const Intersection *its, const bool *hits, Color3f *values,
+                         size_t count) const {
+        /* Queue the shadow rays of all hits and trace them as a stream */
+        std::vector<Ray3f> shadowRays;
+        std::vector<size_t> pixels;
+        shadowRays.reserve(count);
+        pixels.reserve(count);
+        for (size_t r = 0; r < count; ++r) {
+            values[r] = Color3f(0.0f);
+            if (!hits[r])
+                continue;
+
+            SurfaceInteraction si(its[r]);
+            Vector3f sampleDir = Warp::squareToCosineHemisphere(sampler->next2D());
+            Vector3f outDir = si.toWorld(sampleDir).normalized();
+            shadowRays.push_back(Ray3f(si.getPosition(), outDir));
+            pixels.push_back(r);
+        }
+
+        std::unique_ptr<bool[]> occluded(new bool[shadowRays.size()]);
+        scene->occludedStream(shadowRays.data(), occluded.get(), shadowRays.size());
+        for (size_t i = 0; i < shadowRays.size(); ++i)
+            values[pixels[i]] = Color3f(occluded[i] ? 0.0f : 1.0f);
+    }
+
     std::string toString() const {
         return "AmbientLightIntegrator[]";
     }
@@ -12,12 +12,20 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its);
+        return LiPrimary(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const Intersection &its, bool hit) const {
+        if (!hit)
             return Color3f(0.0f);
 
+        SurfaceInteraction si(its);
+
         /* Return the component-wise absolute
            value of the shading normal as a color */
-        Normal3f n = its.shFrame.n.cwiseAbs();
+        Normal3f n = si.getShadingFrame().n.cwiseAbs();
         return Color3f(n.x(), n.y(), n.z());
     }
 
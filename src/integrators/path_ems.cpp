@@ -16,6 +16,13 @@ public:
 
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         Intersection its;
+        bool hit = scene->rayIntersect(ray, its);
+        return LiPrimary(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const Intersection &primaryIts, bool hit) const {
+        Intersection its(primaryIts);
         Ray3f nextRay(ray);
         Color3f result(0.f);
         Color3f throughOutput(1.f);
@@ -31,13 +38,18 @@ public:
         float etaProduct = 1.f;
 
         while (sampler->next1D() < RR) {
-            if (!scene->rayIntersect(nextRay, its))
+            /* The first intersection is passed in by the caller */
+            if (depth > 0)
+                hit = scene->rayIntersect(nextRay, its);
+            if (!hit)
                 break;
 
+            SurfaceInteraction si(its);
+
             /* Sampling indirect light */
             if (its.mesh->isEmitter()) {
                 EmitterQueryRecord rec(nextRay.o, its.mesh);
-                rec.w = its.toLocal(-nextRay.d.normalized());
+                rec.w = si.toLocal(-nextRay.d.normalized());
 
                 if (previousIsSpecular)
                     result += its.mesh->getEmitter()->eval(rec) * throughOutput;
@@ -47,14 +59,14 @@ public:
             if (its.mesh->getBSDF()->isDiffuse()) {
                 /* Sampling the light */
                 auto light = scene->sampleLight(sampler->next1D());
-                EmitterQueryRecord eRec(its, light);
+                EmitterQueryRecord eRec(si, light);
                 Color3f color = light->getEmitter()->sample(eRec, sampler->next3D());
 
                 /* If succeed to sample light */
-                Ray3f shadowRay(eRec.p, its.toWorld(eRec.wo), Epsilon, (eRec.s - eRec.p).norm() - Epsilon);
+                Ray3f shadowRay(eRec.p, si.toWorld(eRec.wo), Epsilon, (eRec.s - eRec.p).norm() - Epsilon);
                 if (!scene->rayIntersect(shadowRay)) {
                     /* Compute BSDF */
-                    BSDFQueryRecord bRecDirect(its.toLocal(-nextRay.d), eRec.wo, ESolidAngle, its);
+                    BSDFQueryRecord bRecDirect(si.toLocal(-nextRay.d), eRec.wo, ESolidAngle, si);
                     Color3f f = its.mesh->getBSDF()->eval(bRecDirect);
                 
                     float pdf = 1 / (float)(scene->getLights().size());
@@ -66,9 +78,9 @@ public:
             }
 
             /* Sampling the next ray accroding to BRDF */
-            BSDFQueryRecord bRec(its.toLocal(-nextRay.d), its);
+            BSDFQueryRecord bRec(si.toLocal(-nextRay.d), si);
             Color3f color = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
-            nextRay = Ray3f(its.p, its.toWorld(bRec.wo));
+            nextRay = Ray3f(si.getPosition(), si.toWorld(bRec.wo));
 
             /* Fail to sample BSDF */
             if (color.isZero())
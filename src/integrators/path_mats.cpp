@@ -15,6 +15,13 @@ public:
 
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         Intersection its;
+        bool hit = scene->rayIntersect(ray, its);
+        return LiPrimary(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const Intersection &primaryIts, bool hit) const {
+        Intersection its(primaryIts);
         Ray3f nextRay(ray);
         Color3f result(0.f);
         Color3f throughOutput(1.f);
@@ -25,19 +32,24 @@ public:
         float etaProduct = 1.f;
 
         while (sampler->next1D() < RR) {
-            if (!scene->rayIntersect(nextRay, its))
+            /* The first intersection is passed in by the caller */
+            if (depth > 0)
+                hit = scene->rayIntersect(nextRay, its);
+            if (!hit)
                 break;
 
+            SurfaceInteraction si(its);
+
             if (its.mesh->isEmitter()) {
                 EmitterQueryRecord eRec(nextRay.o, its.mesh);
-                eRec.w = its.toLocal(-nextRay.d.normalized());
+                eRec.w = si.toLocal(-nextRay.d.normalized());
                 result += its.mesh->getEmitter()->eval(eRec) * throughOutput;
             }
 
             /* Sampling the next ray accroding to BSDF */
-            BSDFQueryRecord bRec(its.toLocal(-nextRay.d), its);
+            BSDFQueryRecord bRec(si.toLocal(-nextRay.d), si);
             Color3f color = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
-            nextRay = Ray3f(its.p, its.toWorld(bRec.wo));
+            nextRay = Ray3f(si.getPosition(), si.toWorld(bRec.wo));
 
             /* Fail to sample BSDF */
             if (color.isZero())
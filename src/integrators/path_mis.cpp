@@ -15,6 +15,13 @@ public:
 
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         Intersection its;
+        bool hit = scene->rayIntersect(ray, its);
+        return LiPrimary(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const Intersection &primaryIts, bool hit) const {
+        Intersection its(primaryIts);
         Ray3f nextRay(ray);
         Color3f result(0.f);
         Color3f throughput(1.f);
@@ -32,13 +39,18 @@ public:
         bool previousIsSpecular = true;
 
         while (sampler->next1D() < RR) {
-            if (!scene->rayIntersect(nextRay, its))
+            /* The first intersection is passed in by the caller */
+            if (depth > 0)
+                hit = scene->rayIntersect(nextRay, its);
+            if (!hit)
                 break;
 
+            SurfaceInteraction si(its);
+
             /* Sampling indirect light */
             if (its.mesh->isEmitter()) {
-                EmitterQueryRecord eRecMats(nextRay.o, its.p, its.mesh, ESolidAngle);
-                eRecMats.w = its.toLocal(-nextRay.d.normalized());
+                EmitterQueryRecord eRecMats(nextRay.o, si.getPosition(), its.mesh, ESolidAngle);
+                eRecMats.w = si.toLocal(-nextRay.d.normalized());
 
                 /* Refresh sampling weight */
                 if (previousIsSpecular) {
@@ -54,14 +66,14 @@ public:
             if (its.mesh->getBSDF()->isDiffuse()) {
                 /* Sampling the emitter */
                 auto light = scene->sampleLight(sampler->next1D());
-                EmitterQueryRecord eRecEms(its, light);
+                EmitterQueryRecord eRecEms(si, light);
                 Color3f color = light->getEmitter()->sample(eRecEms, sampler->next3D());
 
                 /* If succeed to sample direct light */
-                Ray3f shadowRay(eRecEms.p, its.toWorld(eRecEms.wo), Epsilon, (eRecEms.s - eRecEms.p).norm() - Epsilon);
+                Ray3f shadowRay(eRecEms.p, si.toWorld(eRecEms.wo), Epsilon, (eRecEms.s - eRecEms.p).norm() - Epsilon);
                 if (!scene->rayIntersect(shadowRay)) {
                     /* Compute BSDF */
-                    BSDFQueryRecord bRecEms(its.toLocal(-nextRay.d), eRecEms.wo, ESolidAngle, its);
+                    BSDFQueryRecord bRecEms(si.toLocal(-nextRay.d), eRecEms.wo, ESolidAngle, si);
                     Color3f f = its.mesh->getBSDF()->eval(bRecEms);
 
                     /* Refresh sampling weight */
@@ -78,9 +90,9 @@ public:
             }
 
             /* Sampling the next ray accroding to BSDF */
-            BSDFQueryRecord bRecMats(its.toLocal(-nextRay.d), its);
+            BSDFQueryRecord bRecMats(si.toLocal(-nextRay.d), si);
             Color3f color = its.mesh->getBSDF()->sample(bRecMats, sampler->next2D());
-            nextRay = Ray3f(its.p, its.toWorld(bRecMats.wo));
+            nextRay = Ray3f(si.getPosition(), si.toWorld(bRecMats.wo));
 
             /* Fail to sample BSDF */
             if (color.isZero())
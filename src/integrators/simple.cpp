@@ -12,16 +12,24 @@ public:
 
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its);
+        return LiPrimary(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const Intersection &its, bool hit) const {
+        if (!hit)
             return Color3f(0.0f);
 
-        Vector3f wi = (m_position - its.p).normalized();
-        Ray3f shadowRay = Ray3f(its.p, wi);
+        SurfaceInteraction si(its);
+
+        Vector3f wi = (m_position - si.getPosition()).normalized();
+        Ray3f shadowRay = Ray3f(si.getPosition(), wi);
         if (scene->rayIntersect(shadowRay))
             return Color3f(0.0f);
 
-        auto cosTheta = Frame::cosTheta(its.shFrame.toLocal(wi));
-        float attenuation = std::max(0.f, cosTheta) / std::pow((m_position - its.p).norm(), 2.0f);
+        auto cosTheta = Frame::cosTheta(si.getShadingFrame().toLocal(wi));
+        float attenuation = std::max(0.f, cosTheta) / std::pow((m_position - si.getPosition()).norm(), 2.0f);
         Color3f color = m_energy * INV_PI * INV_FOURPI;
 
         return color * attenuation;
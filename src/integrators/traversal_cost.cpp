@@ -0,0 +1,104 @@
+#include <objects/integrator.h>
+#include <objects/scene.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Visualizes the cost of tracing the camera rays
+ *
+ * Every pixel shows the number of interior nodes visited, ray-box tests or
+ * ray-triangle tests (\c "metric") of its camera ray as a false color that
+ * ranges from blue (no work) over green to red (\c "maxCount" or more).
+ * Requires Nori to be compiled with \c NORI_TRAVERSAL_STATS.
+ *
+ * The packet traversal of the renderer only counts the work of entire
+ * packets, hence every camera ray is traced once more on its own. This
+ * second trace is not included in the totals that are printed after
+ * rendering.
+ */
+class TraversalCostIntegrator : public Integrator {
+public:
+    TraversalCostIntegrator(const PropertyList &props) {
+#if !defined(NORI_TRAVERSAL_STATS)
+        throw NoriException("TraversalCostIntegrator: Nori must be compiled with NORI_TRAVERSAL_STATS!");
+#endif
+        std::string metric = props.getString("metric", "nodes");
+        if (metric == "nodes")
+            m_metric = ENodes;
+        else if (metric == "boxes")
+            m_metric = EBoxTests;
+        else if (metric == "triangles")
+            m_metric = ETriangleTests;
+        else
+            throw NoriException("TraversalCostIntegrator: unknown metric \"%s\"!", metric);
+
+        m_maxCount = props.getFloat("maxCount", 100.f);
+        if (m_maxCount <= 0.f)
+            throw NoriException("TraversalCostIntegrator: the maximum count must be positive!");
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        /* Trace the ray on its own and measure how much the counters grow */
+        const Accel::TraversalStatistics &stats = Accel::getThreadStatistics();
+        uint64_t before = getCount(stats);
+        Intersection its;
+        scene->rayIntersect(ray, its);
+        uint64_t count = getCount(stats) - before;
+
+        return falseColor(std::min(count / m_maxCount, 1.f));
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const Intersection &its, bool hit) const {
+        /* The renderer already counted this ray as part of its packet */
+        Accel::TraversalStatistics &stats = Accel::getThreadStatistics();
+        Accel::TraversalStatistics saved = stats;
+        Color3f result = Li(scene, sampler, ray);
+        stats = saved;
+        return result;
+    }
+
+    std::string toString() const {
+        const char *metricNames[] = { "nodes", "boxes", "triangles" };
+        return tfm::format(
+            "TraversalCostIntegrator[\n"
+            "  metric = \"%s\",\n"
+            "  maxCount = %f\n"
+            "]",
+            metricNames[m_metric], m_maxCount
+        );
+    }
+
+private:
+    enum EMetric {
+        ENodes = 0,
+        EBoxTests,
+        ETriangleTests
+    };
+
+    uint64_t getCount(const Accel::TraversalStatistics &stats) const {
+        switch (m_metric) {
+            case ENodes: return stats.nodes;
+            case EBoxTests: return stats.boxTests;
+            default: return stats.triangleTests;
+        }
+    }
+
+    /// Map a value in [0, 1] onto a blue-cyan-green-yellow-red ramp
+    static Color3f falseColor(float x) {
+        static const Color3f ramp[5] = {
+            Color3f(0.f, 0.f, 1.f), Color3f(0.f, 1.f, 1.f), Color3f(0.f, 1.f, 0.f),
+            Color3f(1.f, 1.f, 0.f), Color3f(1.f, 0.f, 0.f)
+        };
+        float pos = x * 4.f;
+        int i = std::min((int) pos, 3);
+        float t = pos - i;
+        return (1.f - t) * ramp[i] + t * ramp[i + 1];
+    }
+
+    EMetric m_metric;
+    float m_maxCount;
+};
+
+NORI_REGISTER_CLASS(TraversalCostIntegrator, "traversal_cost");
+NORI_NAMESPACE_END
@@ -15,15 +15,23 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its)) {
+        bool hit = scene->rayIntersect(ray, its);
+        return LiPrimary(scene, sampler, ray, its, hit);
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const Intersection &its, bool hit) const {
+        if (!hit) {
             return Color3f(0.f);
         }
 
+        SurfaceInteraction si(its);
+
         /* Direct illumination from light to camera */
         Color3f le(0.0f);
         if (its.mesh->isEmitter()) {
             EmitterQueryRecord rec(ray.o, its.mesh);
-            rec.w = its.toLocal(-ray.d.normalized());
+            rec.w = si.toLocal(-ray.d.normalized());
             le = rec.mesh->getEmitter()->eval(rec);
         }
 
@@ -33,15 +41,15 @@ public:
             auto light = scene->sampleLight(sampler->next1D());
 
             /* Direct illumination from light to mesh */
-            EmitterQueryRecord eRec(its, light);
+            EmitterQueryRecord eRec(si, light);
             Color3f color = light->getEmitter()->sample(eRec, sampler->next3D());
 
             /* If there is occluder between light and mesh */
-            Ray3f shadowRay(eRec.p, its.toWorld(eRec.wo), Epsilon, (eRec.s - eRec.p).norm() - Epsilon);
+            Ray3f shadowRay(eRec.p, si.toWorld(eRec.wo), Epsilon, (eRec.s - eRec.p).norm() - Epsilon);
             color = scene->rayIntersect(shadowRay) ? Color3f(0.f) : color;           
 
             /* Compute BSDF of the surface */
-            BSDFQueryRecord bRec(its.toLocal(-ray.d), eRec.wo, ESolidAngle, its);
+            BSDFQueryRecord bRec(si.toLocal(-ray.d), eRec.wo, ESolidAngle, si);
             Color3f f = its.mesh->getBSDF()->eval(bRec);
 
             /* Compute light sampling probability*/
@@ -51,13 +59,13 @@ public:
 
         /* Otherwise change the ray direction */
         } else {
-            BSDFQueryRecord bRec(its.toLocal(-ray.d), its);
+            BSDFQueryRecord bRec(si.toLocal(-ray.d), si);
             Color3f color = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
 
             /* Using russian roulette to control the recursion depth */
             float RR = 0.95f;
             if (sampler->next1D() < RR && color.x() > 0.f) {
-                Ray3f newRay(its.p, its.toWorld(bRec.wo));
+                Ray3f newRay(si.getPosition(), si.toWorld(bRec.wo));
                 return Li(scene, sampler, newRay) / RR * color;
             } else {
                 return Color3f(0.0f);
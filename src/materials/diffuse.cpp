@@ -28,7 +28,7 @@ public:
             return Color3f(0.0f);
 
         /* The BRDF is simply the albedo / pi */
-        return m_textures.at(EAlbedo)->eval(bRec.its.uv) * INV_PI;
+        return m_textures.at(EAlbedo)->eval(bRec.its.getTexCoords()) * INV_PI;
     }
 
     /// Compute the density of \ref sample() wrt. solid angles
@@ -65,7 +65,7 @@ public:
 
         /* eval() / pdf() * cos(theta) = albedo. There
            is no need to call these functions. */
-        return m_textures.at(EAlbedo)->eval(bRec.its.uv);
+        return m_textures.at(EAlbedo)->eval(bRec.its.getTexCoords());
     }
 
     bool isDiffuse() const {